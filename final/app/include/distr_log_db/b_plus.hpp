@@ -1,3 +1,5 @@
+#pragma once
+
 #include <stdint.h>
 #include <map>
 #include <iostream>
@@ -6,21 +8,42 @@
 #include <string>
 #include <mutex>
 #include <atomic>
+#include <vector>
+#include <deque>
+#include <thread>
 
 #include "hash_map.hpp"
+#include "concurrent_hash_map.hpp"
+#include "fixed_vector.hpp"
+#include "frame_pool.hpp"
+#include "page_io.hpp"
 #include "tracer.hpp"
 
+class Backup;
+
 class B_Tree
 {
     public:
 
     static constexpr uint32_t Tree_Node_Order = 10;
     static constexpr uint32_t Leaf_Node_Order = 10;
-    static constexpr uint32_t Log_Size = 2;
+    static constexpr uint32_t Log_Size = 9;
 
     static constexpr uint32_t Max_Num_Tree_Nodes = 10;
     static constexpr uint32_t Max_Num_Leaf_Nodes = 100;
     static constexpr uint32_t Max_Num_Txns = 100;
+    static constexpr uint32_t Max_Prepared_Txns = 16;
+    static constexpr uint32_t Leaf_Pool_Chunk = 16;
+    // Resident leaves kept until set_cache_budget says otherwise
+    static constexpr uint32_t Leaf_Cache_Size = 4;
+    static constexpr uint32_t Num_Recovery_Threads = 4;
+    // Pending upserts a tree node holds before flushing them to its children
+    static constexpr uint32_t Message_Buffer_Size = 32;
+    static constexpr uint32_t Frame_Bitmap_Size = ( Max_Num_Tree_Nodes + Max_Num_Leaf_Nodes + 7 ) / 8;
+
+    // Number of consecutive ascending inserts after which splits on the right
+    // edge of the tree leave the left node nearly full
+    static constexpr uint32_t Sequential_Insert_Run = Leaf_Node_Order;
 
     struct Val
     {
@@ -47,6 +70,14 @@ class B_Tree
         Txn t;
     };
 
+    // Leaves whose logs still have to be resolved after an open
+    enum Recovery_State
+    {
+        Recovery_Done,
+        Recovery_Pending,
+        Recovery_Running,
+    };
+
     enum TxnState
     {
         TxnState_Invalid,
@@ -60,15 +91,45 @@ class B_Tree
         uint8_t _raw_[ 256 ];
     };
 
+    // A transaction prepared for two-phase commit under a global id. Its
+    // entries are durable and it stays current across a reopen until it is
+    // committed or aborted.
+    struct Prepared
+    {
+        Txn t;
+        uint32_t gtid;
+    };
+
+    // Number of entries under a subtree and their values reduced to one
+    struct Aggregate
+    {
+        uint32_t count;
+        uint64_t value;
+    };
+
+    // User defined reduction over values. map turns a value into a number,
+    // combine must be associative with identity as its neutral element.
+    struct Reduction
+    {
+        std::function<uint64_t( const Val& v )> map;
+        std::function<uint64_t( uint64_t a, uint64_t b )> combine;
+        uint64_t identity;
+    };
+
     struct Node
     {
-        virtual void split( Node*& b ) = 0;
+        virtual void split( Node*& b, uint32_t at ) = 0;
         virtual bool find( const Key& k, Val& v ) const = 0;
+        virtual void multi_find( const Key* k, uint32_t n, Val* v, uint8_t* found ) const = 0;
+        virtual void scan( const Key& lo, const Key& hi, std::vector<KeyVal>& kvs ) const = 0;
         virtual void insert( const Key& k, const Val& v, Txn t ) = 0;
+        virtual void totals( Aggregate& a ) const = 0;
+        virtual void aggregate( const Key& lo, const Key& hi, Aggregate& a ) const = 0;
         virtual Key largest() const = 0;
         virtual Key smallest() const = 0;
         virtual uint32_t size() const  = 0;
         virtual uint32_t max_size() const = 0;
+        virtual bool full() = 0;
         virtual void print( size_t depth = 0 ) const = 0;
         virtual uint32_t node_id() const = 0;
 
@@ -109,32 +170,60 @@ class B_Tree
                 };
                 Page _mPage;
             };
-            void insert( const Key& k, const Val& v, Txn t );
-            uint32_t index( Key k, uint32_t start, uint32_t end ) const;
-            uint32_t index( Key k ) const;
-            void remove( Key k );
         };
 
-        Data _mStored, _mCurrent;
-        Log _mLog;
+        // A logged change that is not yet part of the stored data, with the
+        // value it replaced so the stored data can be rebuilt
+        struct Delta
+        {
+            KeyValTxn kvt;
+            bool replaced;
+            Val old;
+        };
+
+        typedef Fixed_Vector<Delta, Log_Size> Delta_Log;
+
+        // Only the current image is kept in memory. The stored data and the
+        // log are rebuilt from it and the deltas when the node is written.
+        // The deltas take a frame of the delta pool only while there are any,
+        // so a leaf without pending changes costs little more than its page.
+        Data _mCurrent;
+        Delta_Log* _mDelta;
 
         uint32_t _mNodeId;
         bool _mDataModified;
 
-        void split( Node*& b );
+        void split( Node*& b, uint32_t at );
         void shorten_log();
+        bool settle( uint32_t idx );
         void insert( const Key& k, const Val& v, Txn t );
+        void load( const Data& stored, const Log& log );
+        void stored( Data& d ) const;
+        void log( Log& l ) const;
+        uint32_t delta_index( Key k ) const;
+        uint32_t log_size() const { return _mDelta ? _mDelta->size() : 0; }
+        Delta_Log& deltas();
+        void trim_deltas();
         void persist();
 
         bool find( const Key& k, Val& v ) const;
+        void multi_find( const Key* k, uint32_t n, Val* v, uint8_t* found ) const;
+        void scan( const Key& lo, const Key& hi, std::vector<KeyVal>& kvs ) const;
+        void totals( Aggregate& a ) const;
+        void aggregate( const Key& lo, const Key& hi, Aggregate& a ) const;
         Key largest() const { return _mCurrent._mKVs[ _mCurrent._mSize-1 ].k; }
         Key smallest() const { return _mCurrent._mKVs[ 0 ].k; }
         uint32_t size() const  { return _mCurrent._mSize; }
         uint32_t max_size() const { return Leaf_Node_Order; };
+        bool full();
         void print( size_t depth = 0 ) const;
         uint32_t node_id() const { return _mNodeId; }
         TxnState state( Key k ) const;
 
+        static void* operator new( size_t size, Frame_Pool& pool ) { assert( size <= pool._mFrameSize ); return pool.allocate(); }
+        static void operator delete( void* ptr, Frame_Pool& ) { Frame_Pool::release( ptr ); }
+        static void operator delete( void* ptr ) { Frame_Pool::release( ptr ); }
+
         Leaf_Node( B_Tree* _aPar, uint32_t _aNodeId, bool exists=false );
         ~Leaf_Node();
     };
@@ -150,25 +239,47 @@ class B_Tree
                 uint32_t _mNodeId;
                 uint32_t _mChildNodes[ Tree_Node_Order ];
                 Key      _mKeys[ Tree_Node_Order - 1 ];
+                // Per child aggregates, only kept while aggregates are enabled
+                uint32_t _mCounts[ Tree_Node_Order ];
+                uint64_t _mReduced[ Tree_Node_Order ];
             };
             Page _mPage;
         };
 
-        void split( Node*& b );
+        // Write buffering: upserts not yet applied below this node, oldest
+        // first. Kept in memory only and drained before anything is flushed.
+        std::vector<KeyValTxn> _mBuffer;
+
+        void split( Node*& b, uint32_t at );
         bool find( const Key& k, Val& v ) const;
         Node* find( const Key& k ) const;
+        bool buffered_find( const Key& k, Val& v ) const;
+        void flush_buffer();
+        void multi_find( const Key* k, uint32_t n, Val* v, uint8_t* found ) const;
+        void scan( const Key& lo, const Key& hi, std::vector<KeyVal>& kvs ) const;
         void insert( const Key& k, const Val& v, Txn t );
         void insert( const Node* v );
+        void totals( Aggregate& a ) const;
+        void aggregate( const Key& lo, const Key& hi, Aggregate& a ) const;
+        void refresh( uint32_t idx );
+        void refresh_path( const Key& k );
+        void rebuild_aggregates();
         Key largest() const { return _mPar->unswizzle( _mChildNodes [ _mSize-1 ] )->largest(); }
         Key smallest() const { return _mPar->unswizzle( _mChildNodes[ 0 ] )->smallest(); }
         uint32_t size() const { return _mSize; }
         uint32_t max_size() const { return Tree_Node_Order; };
+        bool full() { return _mSize == Tree_Node_Order; }
         void print( size_t depth = 0 ) const;
         void rekey();
+        void persist();
         uint32_t index( Key k, uint32_t start, uint32_t end ) const;
         uint32_t index( Key k ) const;
         uint32_t node_id() const { return _mNodeId; }
 
+        static void* operator new( size_t size, Frame_Pool& pool ) { assert( size <= pool._mFrameSize ); return pool.allocate(); }
+        static void operator delete( void* ptr, Frame_Pool& ) { Frame_Pool::release( ptr ); }
+        static void operator delete( void* ptr ) { Frame_Pool::release( ptr ); }
+
         Tree_Node( B_Tree* _aPar, uint32_t _aNodeId, bool exists=false );
         ~Tree_Node();
     };
@@ -185,11 +296,26 @@ class B_Tree
                 uint32_t _mNumLeafNodes;
                 uint32_t _mRootId;
                 uint32_t _mRecentTransaction;
+                uint32_t _mShadowPaging;
+                uint32_t _mCommitSeq;
+                // Sequence number of the last commit shipped to, or applied
+                // from, a replication stream
+                uint32_t _mReplicationSeq;
+                // Shadow paging: which of its two frames holds each node
+                uint8_t _mFrames[ Frame_Bitmap_Size ];
+                // Entries whose transaction is no longer current are stale
+                uint32_t _mNumPrepared;
+                Prepared _mPrepared[ Max_Prepared_Txns ];
+                // Set while the aggregates in the tree nodes are current
+                uint32_t _mAggregates;
             };
             Page _mPage;
         };
     };
 
+    // A published header, nodes are read from the frames it records
+    typedef Header Snapshot;
+
     struct Transactions
     {
         union
@@ -203,49 +329,154 @@ class B_Tree
         };
     };
 
+    // Page table of the resident leaves. Building with CONCURRENT_PAGE_TABLE
+    // swaps in the concurrent variant, which frees an evicted leaf only once
+    // no Guard taken before the eviction is held. Anything that keeps a leaf
+    // from unswizzle holds a guard.
+#ifdef CONCURRENT_PAGE_TABLE
+    typedef Concurrent_Hash_Map<uint32_t, Leaf_Node*> Page_Table;
+#else
+    typedef Hash_Map<uint32_t, Leaf_Node*> Page_Table;
+#endif
+
+    // Called after each commit is durable with its replication sequence number
+    // and everything the transaction wrote, in order
+    typedef std::function<void( uint32_t seq, const std::vector<KeyVal>& kvs )> Commit_Hook;
+
     void insert( const Key& k, const Val& v, Txn t );
+    void insert_batch( const std::vector<KeyVal>& kvs, Txn t );
+    void set_write_buffering( bool on );
+    bool write_buffering() const { return _mWriteBuffering; }
     void print();
-    bool find( const Key& k, Val& v ) { return unswizzle( _mHeader._mRootId )->find( k, v ); }
+    bool find( const Key& k, Val& v )
+    {
+        Page_Table::Guard guard( _mLeafNodeMap );
+        return unswizzle( _mHeader._mRootId )->find( k, v );
+    }
+    uint32_t multi_find( const std::vector<Key>& keys, std::vector<Val>& vals, std::vector<bool>& found );
+    bool find( const Snapshot& s, const Key& k, Val& v );
+    Snapshot snapshot() const { return _mPublishedHeader; }
+    bool snapshot_valid( const Snapshot& s ) const { return s._mCommitSeq == _mPublishedHeader._mCommitSeq; }
+    void scan( const Key& lo, const Key& hi, std::vector<KeyVal>& kvs );
+    void enable_aggregates( const Reduction& r );
+    bool aggregates_enabled() const { return (bool)_mReduction.combine; }
+    Aggregate aggregate( const Key& lo, const Key& hi );
+    uint32_t range_count( const Key& lo, const Key& hi ) { return aggregate( lo, hi ).count; }
 
     // Member variables
     Tree_Node** _mTreeNodes;
     Header _mHeader;
+    Header _mPublishedHeader;
+    uint8_t _mPendingFrames[ Frame_Bitmap_Size ];
     Transactions _mCurrTxns;
     Transactions _mAbortTxns;
-    std::fstream _mTreeFile;
-    Hash_Map<uint32_t, Leaf_Node*> _mLeafNodeMap;
+    Page_IO _mTreeFile;
+    // While flush() persists nodes their pages are gathered here and go out
+    // as one batch
+    bool _mBatchingWrites;
+    std::deque<Page> _mBatchPages;
+    std::vector<Page_IO::Write> _mWriteBatch;
+    Frame_Pool _mTreePool;
+    Frame_Pool _mLeafPool;
+    Frame_Pool _mDeltaPool;
+    Page_Table _mLeafNodeMap;
+    uint32_t _mLeafCacheSize;
+    uint32_t _mRightmostLeaf;
+    Key _mLastInsertKey;
+    uint32_t _mSequentialRun;
+    uint32_t _mSyncDeferred;
+    bool _mHeaderDirty;
+    Commit_Hook _mCommitHook;
+    std::map<Txn, std::vector<KeyVal>> _mTxnWrites;
+    Backup* _mBackup;
+    std::atomic<uint8_t> _mLeafRecovery[ Max_Num_Leaf_Nodes ];
+    std::atomic<uint32_t> _mRecoveredLeaves;
+    std::vector<std::thread> _mRecoveryThreads;
+    Reduction _mReduction;
+    Txn _mAggregatesSince;
+    bool _mWriteBuffering;
+
+    void apply_insert( const Key& k, const Val& v, Txn t );
+    void record_write( const Key& k, const Val& v, Txn t );
+    void apply_batch( const std::vector<KeyValTxn>& sorted );
+    void buffer_messages( const std::vector<KeyValTxn>& msgs );
+    void drain_buffers();
+    void set_commit_hook( const Commit_Hook& hook ) { _mCommitHook = hook; }
+    void combine( Aggregate& a, uint32_t count, uint64_t value ) const;
+    void refresh_aggregates( const Key& k );
+    void invalidate_aggregates();
 
     Node* unswizzle( uint32_t node_id );
+    void prefetch_node( uint32_t node_id );
+    void read_ahead_node( uint32_t node_id );
     Tree_Node* new_tree_node( uint32_t& node_id );
     Leaf_Node* new_leaf_node( uint32_t& node_id );
-    void clamp_size( float f );
+    Leaf_Node* find_leaf( const Key& k, Key& upper, bool& bounded );
+    uint32_t leaf_id( const Key& k, Key& upper, bool& bounded ) const;
+    void clamp_cache();
+    void set_cache_budget( size_t bytes );
+    uint32_t split_point( Node* n, const Key& k );
+    uint32_t find_rightmost_leaf();
 
     void store_node( Tree_Node* n, uint32_t idx );
     void store_node( Leaf_Node* n, uint32_t idx );
     void fetch_node( Tree_Node* n, uint32_t idx );
-    void fetch_node( Leaf_Node* n, uint32_t idx );
+    void fetch_node( Leaf_Node::Data& stored, Leaf_Node::Log& log, uint32_t idx );
 
     void remove_txn( Transactions& txns, Txn t );
     void add_txn( Transactions& txns, Txn t );
 
+    void start_recovery();
+    void recover_leaves( uint32_t first, uint32_t last, const std::vector<Txn>& aborted, const std::vector<Txn>& current );
+    void claim_leaf( uint32_t node_id );
+    void wait_recovery();
+
+    void write_file( const void* buf, size_t len, std::streamoff off );
+    void write_file( const std::vector<Page_IO::Write>& writes );
     void sync_header_txns();
+    void sync_file();
+    void flush();
+
+    bool shadow_paging() const { return _mHeader._mShadowPaging; }
+    bool node_frame( const uint8_t* frames, uint32_t node_id ) const { return frames[ node_id / 8 ] & ( 1 << ( node_id % 8 ) ); }
+    bool read_frame( uint32_t node_id ) const { return node_frame( _mHeader._mFrames, node_id ) != node_frame( _mPendingFrames, node_id ); }
+    std::streamoff frame_offset( uint32_t node_id, bool frame ) const;
+    void store_frame( const Page& p, uint32_t node_id );
+    void publish();
+    void rollback();
 
     Txn new_txn();
+    bool txn_prepare( Txn t, uint32_t gtid );
     void txn_commit( Txn t );
     void txn_abort( Txn t );
+    void prepared_txns( std::vector<Prepared>& prepared );
+    bool is_prepared( Txn t ) const;
+    void drop_stale_prepared();
 
     TxnState txn_state( Txn t );
 
     Tree_Node* _mRoot();
 
-    B_Tree( std::string file_name, bool reset=false );
+    B_Tree( std::string file_name, bool reset=false, bool direct_io=false, bool shadow_paging=false );
     ~B_Tree();
 
     static constexpr std::streamoff Curr_Txns_Offset = 1 * sizeof( Header::_mPage );
     static constexpr std::streamoff Abort_Txns_Offset = Curr_Txns_Offset + sizeof( Transactions::_mPage );
     static constexpr std::streamoff Tree_Node_Offset = Abort_Txns_Offset + sizeof( Transactions::_mPage );
     static constexpr std::streamoff Leaf_Node_Offset = Tree_Node_Offset + Max_Num_Tree_Nodes * sizeof( Tree_Node::_mPage );
-    static constexpr std::streamoff File_Size = Leaf_Node_Offset + Max_Num_Leaf_Nodes * ( sizeof( Leaf_Node::_mLog ) + sizeof( Leaf_Node::_mStored ) );
+    static constexpr std::streamoff File_Size = Leaf_Node_Offset + Max_Num_Leaf_Nodes * ( sizeof( Leaf_Node::Data ) + sizeof( Leaf_Node::Log ) );
+
+    // Shadow paging keeps a second frame for each tree node past the end of
+    // the regular layout. Leaf nodes use their data and log pages as frames.
+    static constexpr std::streamoff Tree_Shadow_Offset = File_Size;
+    static constexpr std::streamoff Shadow_File_Size = Tree_Shadow_Offset + Max_Num_Tree_Nodes * sizeof( Tree_Node::_mPage );
+
+    static std::streamoff leaf_node_offset( uint32_t idx ) { return Leaf_Node_Offset + ( idx - Max_Num_Tree_Nodes ) * 2 * sizeof( Page ); }
 };
 
+static_assert( sizeof( B_Tree::Leaf_Node::Log ) == sizeof( B_Tree::Page ), "Leaf log must fit in one page" );
+static_assert( sizeof( B_Tree::Header ) == sizeof( B_Tree::Page ), "Header must fit in one page" );
+static_assert( sizeof( B_Tree::Tree_Node ) == sizeof( B_Tree::Node ) + sizeof( B_Tree::Page ) + sizeof( std::vector<B_Tree::KeyValTxn> ),
+               "Tree node must fit in one page" );
+
 std::ostream& operator<<( std::ostream& os, const B_Tree::Page& p );
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "b_plus.hpp"
+#include "page_io.hpp"
+
+/**
+ * @brief Online copy of a B_Tree file as of a checkpoint, taken while the
+ * tree keeps being written. Creating the backup writes out everything the
+ * tree holds in memory, after that the file is copied in large sequential
+ * chunks. A page the tree overwrites before the copy reaches it is copied
+ * first, so the backup holds exactly the checkpoint. Transactions open at the
+ * checkpoint are aborted when the backup is opened.
+ *
+ * The backup is created and destroyed on the tree's thread, copying can run
+ * on any thread.
+ */
+class Backup
+{
+    public:
+    static constexpr uint32_t Chunk_Pages = 64;
+
+    bool step();
+    void run();
+    bool done();
+    uint32_t pages_copied();
+
+    void before_write( std::streamoff off, size_t len );
+
+    Backup( B_Tree& _aTree, const std::string& file_name );
+    ~Backup();
+
+    // Member variables
+    B_Tree& _mTree;
+    Page_IO _mFile;
+    std::mutex _mMutex;
+    std::vector<bool> _mCopied;
+    uint32_t _mNumPages;
+    uint32_t _mNumCopied;
+    uint32_t _mNextPage;
+
+    void copy_pages( uint32_t first, uint32_t count );
+};
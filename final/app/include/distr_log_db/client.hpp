@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "b_plus.hpp"
+#include "protocol.hpp"
+#include "socket.hpp"
+
+/**
+ * @brief Connection to a Server. send queues a request and returns its id,
+ * flush writes everything queued and receive reads the responses in order,
+ * so many requests can be in flight at once. The other calls send one
+ * request, or a pipelined run of them, and wait for the answers.
+ */
+class Client
+{
+    public:
+
+    bool connect( const std::string& address );
+    uint32_t send( uint8_t op, B_Tree::Txn txn = 0, B_Tree::Key k = 0, B_Tree::Key hi = 0, const B_Tree::Val* v = nullptr );
+    bool flush();
+    bool receive( Protocol::Response& r, std::vector<B_Tree::KeyVal>& kvs );
+
+    uint8_t get( const B_Tree::Key& k, B_Tree::Val& v );
+    uint8_t put( const B_Tree::Key& k, const B_Tree::Val& v, B_Tree::Txn txn = 0 );
+    uint8_t scan( const B_Tree::Key& lo, const B_Tree::Key& hi, std::vector<B_Tree::KeyVal>& kvs );
+    B_Tree::Txn begin();
+    uint8_t commit( B_Tree::Txn txn );
+    uint8_t abort( B_Tree::Txn txn );
+
+    uint32_t multi_get( const std::vector<B_Tree::Key>& keys, std::vector<B_Tree::Val>& vals, std::vector<bool>& found );
+    uint32_t put_batch( const std::vector<B_Tree::KeyVal>& kvs, B_Tree::Txn txn = 0 );
+
+    Client() : _mNextId( 0 ) {}
+
+    // Member variables
+    Socket _mSocket;
+    std::string _mOut;
+    uint32_t _mNextId;
+
+    uint8_t call( uint8_t op, B_Tree::Txn txn, B_Tree::Key k, B_Tree::Key hi, const B_Tree::Val* v,
+                  Protocol::Response& r, std::vector<B_Tree::KeyVal>& kvs );
+};
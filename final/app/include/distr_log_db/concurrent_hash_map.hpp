@@ -0,0 +1,513 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <cassert>
+#include <algorithm>
+#include <thread>
+
+#include "hash_map.hpp"
+#include "epoch.hpp"
+
+/**
+ * @brief Variant of Hash_Map that many threads can use at once, for running
+ * the page table under concurrent load
+ *
+ * Reads take no lock. Each slot carries a version that is odd while a writer
+ * changes it, and a reader retries a slot whose version moved while it read
+ * it. Writers lock one of Num_Stripes mutexes picked by the hash and claim
+ * free slots with a compare and swap, so writers of different stripes run in
+ * parallel. Slots are linear probed, and removed entries leave a tombstone so
+ * no entry ever moves while readers probe past it.
+ *
+ * Once three quarters of the slots were used, tombstones included, a new
+ * table without tombstones is swapped in and the old one is drained into it
+ * a few slots at a time by every insert and remove, like Hash_Map does. Only
+ * the swap holds every stripe. An entry is copied to the new table before it
+ * is removed from the old one, so lookups probe the old table first.
+ *
+ * Drained tables and removed values go to an epoch domain. A reader that
+ * holds a Guard can keep using a value it found until it drops the guard.
+ */
+template <typename Key, typename Val, typename Hash = Default_Hash<Key>>
+class Concurrent_Hash_Map
+{
+    public:
+    static_assert( std::is_trivially_copyable<Key>::value, "keys are copied atomically" );
+    static_assert( std::is_pointer<Val>::value, "values are owned pointers" );
+
+    // A slot as seen from outside, copied out under its version
+    struct Hash_Table_Data
+    {
+        bool exists;
+        Key key;
+        Val val;
+    };
+
+    enum Slot_State : uint8_t
+    {
+        Slot_Empty,
+        // Claimed by a writer that is filling it in
+        Slot_Busy,
+        Slot_Full,
+        Slot_Deleted,
+    };
+
+    static constexpr unsigned Num_Stripes = 16;
+    static constexpr unsigned Min_Size = 16;
+    // Drain into a new table once more than Max_Load_Num / Max_Load_Den of
+    // the slots were used, tombstones included
+    static constexpr unsigned Max_Load_Num = 3;
+    static constexpr unsigned Max_Load_Den = 4;
+    // Slots of the old table moved per insert or remove during a rehash
+    static constexpr unsigned Rehash_Step = 8;
+
+    struct Slot
+    {
+        std::atomic<uint32_t> version;
+        std::atomic<uint8_t> state;
+        std::atomic<Key> key;
+        std::atomic<Val> val;
+    };
+
+    struct Table
+    {
+        Table( unsigned _aSize, Table* _aOld )
+            : slots( new Slot[ _aSize ] ),
+              size( _aSize ),
+              used( 0 ),
+              old( _aOld ),
+              rehash_next( 0 ),
+              rehash_done( 0 )
+        {
+            for( unsigned i=0; i<size; i++ )
+            {
+                slots[ i ].version.store( 0, std::memory_order_relaxed );
+                slots[ i ].state.store( Slot_Empty, std::memory_order_relaxed );
+            }
+        }
+        ~Table()
+        {
+            delete [] slots;
+        }
+
+        Slot* slots;
+        unsigned size;
+        // Slots that are not empty
+        std::atomic<unsigned> used;
+
+        // Table being drained into this one, nullptr once it is empty
+        std::atomic<Table*> old;
+        // Next slot of old to drain, and slots of old already drained
+        std::atomic<unsigned> rehash_next;
+        std::atomic<unsigned> rehash_done;
+    };
+
+    /**
+     * @brief Keeps the values found while it is held from being deleted
+     */
+    class Guard : public Epoch::Guard
+    {
+        public:
+        Guard( Concurrent_Hash_Map& _aMap )
+            : Epoch::Guard( _aMap._mEpoch )
+        {
+        }
+    };
+
+    Concurrent_Hash_Map( unsigned size )
+        : _mCurrSize( 0 )
+    {
+        unsigned n = Min_Size;
+        while( n < size )
+        {
+            n *= 2;
+        }
+        _mTable.store( new Table( n, nullptr ) );
+    }
+
+    uint64_t calc_hash( const Key& k ) const
+    {
+        return Hash()( k );
+    }
+
+    /**
+     * @brief Reads a slot consistently, retrying while a writer is inside
+     */
+    static Slot_State read_slot( const Slot& s, Key& k, Val& v )
+    {
+        for( ;; )
+        {
+            uint32_t before = s.version.load( std::memory_order_acquire );
+            if( before & 1 ) continue;
+            Slot_State state = (Slot_State)s.state.load( std::memory_order_relaxed );
+            k = s.key.load( std::memory_order_relaxed );
+            v = s.val.load( std::memory_order_relaxed );
+            std::atomic_thread_fence( std::memory_order_acquire );
+            if( s.version.load( std::memory_order_relaxed ) == before ) return state;
+        }
+    }
+
+    /**
+     * @brief Changes a slot while readers may be inside it, the caller owns
+     * the slot
+     */
+    static void write_slot( Slot& s, Slot_State state, const Key& k, Val v )
+    {
+        uint32_t version = s.version.load( std::memory_order_relaxed );
+        s.version.store( version + 1, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+        s.key.store( k, std::memory_order_relaxed );
+        s.val.store( v, std::memory_order_relaxed );
+        s.state.store( state, std::memory_order_relaxed );
+        s.version.store( version + 2, std::memory_order_release );
+    }
+
+    /**
+     * @brief Probes one table without taking a lock
+     *
+     * @return true The key was found and d filled in
+     */
+    static bool probe( const Table& t, uint64_t h, const Key& k, Hash_Table_Data& d )
+    {
+        unsigned mask = t.size - 1;
+        unsigned i = h & mask;
+        for( unsigned n=0; n<t.size; n++, i=( i + 1 ) & mask )
+        {
+            Key key;
+            Val val;
+            Slot_State state = read_slot( t.slots[ i ], key, val );
+            if( state == Slot_Empty ) return false;
+            if( state == Slot_Full && key == k )
+            {
+                d.exists = true;
+                d.key = key;
+                d.val = val;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Looks for the key without taking a lock. The value stays valid
+     * for as long as the caller holds a Guard.
+     */
+    Hash_Table_Data find( const Key& k )
+    {
+        Guard guard( *this );
+        uint64_t h = calc_hash( k );
+        Hash_Table_Data d = Hash_Table_Data();
+        for( ;; )
+        {
+            const Table* t = _mTable.load( std::memory_order_acquire );
+            const Table* old = t->old.load( std::memory_order_acquire );
+            if( old && probe( *old, h, k, d ) ) return d;
+            if( probe( *t, h, k, d ) ) return d;
+
+            // A miss only counts if no later table took the entry away
+            if( _mTable.load( std::memory_order_acquire ) == t ) return d;
+        }
+    }
+
+    /**
+     * @brief Finds the slot holding the key, called under the key's stripe
+     */
+    static Slot* locate( Table& t, uint64_t h, const Key& k )
+    {
+        unsigned mask = t.size - 1;
+        unsigned i = h & mask;
+        for( unsigned n=0; n<t.size; n++, i=( i + 1 ) & mask )
+        {
+            Slot& s = t.slots[ i ];
+            uint8_t state = s.state.load( std::memory_order_acquire );
+            if( state == Slot_Empty ) break;
+            if( state == Slot_Full && s.key.load( std::memory_order_relaxed ) == k )
+            {
+                return &s;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief Claims the first free slot of the key's probe sequence, others
+     * may take slots under us
+     *
+     * @param limit If set to true, fails instead of filling the table past
+     * its load factor
+     * @return false No slot was claimed
+     */
+    static bool claim( Table& t, uint64_t h, const Key& k, Val v, bool limit )
+    {
+        unsigned mask = t.size - 1;
+        unsigned i = h & mask;
+        for( unsigned n=0; n<t.size; n++, i=( i + 1 ) & mask )
+        {
+            Slot& s = t.slots[ i ];
+            uint8_t state = s.state.load( std::memory_order_acquire );
+            if( state != Slot_Empty && state != Slot_Deleted ) continue;
+
+            if( limit && state == Slot_Empty &&
+                ( t.used.load() + 1 ) * Max_Load_Den > t.size * Max_Load_Num )
+            {
+                return false;
+            }
+            if( s.state.compare_exchange_strong( state, Slot_Busy ) )
+            {
+                if( state == Slot_Empty )
+                {
+                    t.used++;
+                }
+                write_slot( s, Slot_Full, k, v );
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void insert( const Key& k, const Val& v )
+    {
+        Guard guard( *this );
+        uint64_t h = calc_hash( k );
+        for( ;; )
+        {
+            rehash_step();
+            {
+                std::lock_guard<std::mutex> lock( _mStripes[ h % Num_Stripes ] );
+                if( try_insert( h, k, v ) ) return;
+            }
+            start_rehash();
+        }
+    }
+
+    /**
+     * @brief Inserts or updates under the key's stripe. Keys of a stripe only
+     * change under its lock, so the key is in at most one of the tables.
+     *
+     * @return false The table is too full, nothing was changed
+     */
+    bool try_insert( uint64_t h, const Key& k, const Val& v )
+    {
+        Table* t = _mTable.load( std::memory_order_relaxed );
+        Slot* s = locate( *t, h, k );
+        if( s )
+        {
+            write_slot( *s, Slot_Full, k, v );
+            return true;
+        }
+
+        Table* old = t->old.load( std::memory_order_acquire );
+        s = old ? locate( *old, h, k ) : nullptr;
+        if( !claim( *t, h, k, v, true ) ) return false;
+        if( s )
+        {
+            write_slot( *s, Slot_Deleted, k, nullptr );
+        }
+        else
+        {
+            _mCurrSize++;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Removes the key, the value is deleted once no reader can hold it
+     */
+    void remove( const Key& k )
+    {
+        Guard guard( *this );
+        rehash_step();
+
+        uint64_t h = calc_hash( k );
+        Val v = nullptr;
+        {
+            std::lock_guard<std::mutex> lock( _mStripes[ h % Num_Stripes ] );
+            Table* t = _mTable.load( std::memory_order_relaxed );
+            Slot* s = locate( *t, h, k );
+            if( !s && t->old.load( std::memory_order_acquire ) )
+            {
+                s = locate( *t->old.load( std::memory_order_acquire ), h, k );
+            }
+            if( s )
+            {
+                v = s->val.load( std::memory_order_relaxed );
+                write_slot( *s, Slot_Deleted, k, nullptr );
+                _mCurrSize--;
+            }
+        }
+        _mEpoch.retire( v );
+    }
+
+    /**
+     * @brief Swaps in a new table without tombstones, doubled when the
+     * entries alone would fill it past half. Entries stay in the old table
+     * until rehash_step moves them.
+     */
+    void start_rehash()
+    {
+        finish_rehash();
+
+        lock_all();
+        Table* t = _mTable.load( std::memory_order_relaxed );
+        if( !t->old.load() && ( t->used.load() + 1 ) * Max_Load_Den > t->size * Max_Load_Num )
+        {
+            unsigned size = t->size;
+            while( ( _mCurrSize + 1 ) * 2 > size )
+            {
+                size *= 2;
+            }
+            _mTable.store( new Table( size, t ), std::memory_order_release );
+        }
+        unlock_all();
+    }
+
+    /**
+     * @brief Moves the next Rehash_Step slots of the table being drained,
+     * whoever moves the last slot retires it
+     */
+    void rehash_step()
+    {
+        Table* t = _mTable.load( std::memory_order_acquire );
+        Table* old = t->old.load( std::memory_order_acquire );
+        if( !old ) return;
+
+        unsigned first = t->rehash_next.fetch_add( Rehash_Step );
+        if( first >= old->size ) return;
+        unsigned last = std::min( first + Rehash_Step, old->size );
+        for( unsigned i=first; i<last; i++ )
+        {
+            move( *t, old->slots[ i ] );
+        }
+
+        if( t->rehash_done.fetch_add( last - first ) + ( last - first ) == old->size )
+        {
+            t->old.store( nullptr, std::memory_order_release );
+            _mEpoch.retire( old );
+        }
+    }
+
+    /**
+     * @brief Copies an entry of the table being drained into t, then
+     * removes it from the old table
+     */
+    void move( Table& t, Slot& s )
+    {
+        Key k;
+        Val v;
+        if( read_slot( s, k, v ) != Slot_Full ) return;
+
+        // Drained tables take no new entries, the slot can only be removed
+        uint64_t h = calc_hash( k );
+        std::lock_guard<std::mutex> lock( _mStripes[ h % Num_Stripes ] );
+        if( read_slot( s, k, v ) != Slot_Full ) return;
+        bool claimed = claim( t, h, k, v, false );
+        assert( claimed );
+        (void)claimed;
+        write_slot( s, Slot_Deleted, k, nullptr );
+    }
+
+    /**
+     * @brief Helps drain the old table until it is gone
+     */
+    void finish_rehash()
+    {
+        Guard guard( *this );
+        for( ;; )
+        {
+            Table* t = _mTable.load( std::memory_order_acquire );
+            Table* old = t->old.load( std::memory_order_acquire );
+            if( !old ) return;
+            if( t->rehash_next.load() < old->size )
+            {
+                rehash_step();
+            }
+            else
+            {
+                // The last slots are being moved by others
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void lock_all()
+    {
+        for( unsigned i=0; i<Num_Stripes; i++ )
+        {
+            _mStripes[ i ].lock();
+        }
+    }
+    void unlock_all()
+    {
+        for( unsigned i=Num_Stripes; i>0; i-- )
+        {
+            _mStripes[ i - 1 ].unlock();
+        }
+    }
+
+    // Slots of the current table and the one being drained, for walking
+    // every entry. Only exact while no writer runs.
+    unsigned num_slots() const
+    {
+        const Table* t = _mTable.load( std::memory_order_acquire );
+        const Table* old = t->old.load( std::memory_order_acquire );
+        return t->size + ( old ? old->size : 0 );
+    }
+    Hash_Table_Data slot( unsigned i )
+    {
+        Guard guard( *this );
+        const Table* t = _mTable.load( std::memory_order_acquire );
+        const Table* old = t->old.load( std::memory_order_acquire );
+        Hash_Table_Data d = Hash_Table_Data();
+        if( i >= t->size )
+        {
+            i -= t->size;
+            t = old;
+        }
+        if( t && i < t->size )
+        {
+            d.exists = read_slot( t->slots[ i ], d.key, d.val ) == Slot_Full;
+        }
+        return d;
+    }
+
+    /**
+     * @brief Drops every entry without deleting the values, the caller owns
+     * them
+     */
+    void clear()
+    {
+        finish_rehash();
+        lock_all();
+        Table* t = _mTable.load( std::memory_order_relaxed );
+        _mTable.store( new Table( t->size, nullptr ), std::memory_order_release );
+        _mCurrSize = 0;
+        unlock_all();
+        _mEpoch.retire( t );
+    }
+
+    ~Concurrent_Hash_Map()
+    {
+        finish_rehash();
+        _mEpoch.synchronize();
+        Table* t = _mTable.load();
+        for( unsigned i=0; i<t->size; i++ )
+        {
+            Key k;
+            Val v;
+            if( read_slot( t->slots[ i ], k, v ) == Slot_Full )
+            {
+                delete v;
+            }
+        }
+        delete t;
+    }
+
+    // Member variables
+    std::atomic<Table*> _mTable;
+    std::atomic<size_t> _mCurrSize;
+    std::mutex _mStripes[ Num_Stripes ];
+    Epoch _mEpoch;
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "page_io.hpp"
+#include "sharded.hpp"
+
+/**
+ * @brief Two-phase commit of transactions that span the shards of a
+ * Sharded_B_Tree. Writes are buffered under a global transaction id until
+ * commit. Every shard holding part of the write set then writes and prepares
+ * its part, the decision is made durable in the coordinator's log, and the
+ * shards finish their parts.
+ *
+ * Only commit decisions are logged, a prepared transaction with no decision
+ * is aborted. Opening the coordinator resolves the transactions the shards
+ * still hold as prepared.
+ */
+class Txn_Coordinator
+{
+    public:
+    typedef B_Tree::Key Key;
+    typedef B_Tree::Val Val;
+    typedef B_Tree::KeyVal KeyVal;
+
+    enum Decision
+    {
+        Decision_Commit = 1,
+        // Every shard finished, the commit record is no longer needed
+        Decision_Done = 2,
+    };
+
+    struct Log_Record
+    {
+        uint32_t gtid;
+        uint32_t decision;
+    };
+
+    uint32_t begin();
+    void insert( uint32_t gtid, const Key& k, const Val& v );
+    bool commit( uint32_t gtid );
+    void abort( uint32_t gtid );
+
+    Txn_Coordinator( Sharded_B_Tree& _aShards, const std::string& log_name );
+
+    // Member variables
+    Sharded_B_Tree& _mShards;
+    Page_IO _mLog;
+    std::mutex _mMutex;
+    uint32_t _mNextGtid;
+    std::map<uint32_t, std::vector<KeyVal>> _mOpen;
+
+    bool prepare( uint32_t gtid, const std::vector<KeyVal>& writes );
+    void log_decision( uint32_t gtid, Decision d, bool sync );
+    void complete( uint32_t gtid, const std::vector<KeyVal>& writes, bool committed );
+    void recover();
+};
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <cassert>
+
+/**
+ * @brief Epoch based reclamation. Readers announce the global epoch while
+ * they hold pointers into a shared structure, and writers retire unlinked
+ * objects instead of freeing them. An object retired in epoch e is freed
+ * once the epoch reached e + 2, since every reader active by then started
+ * after it was unlinked.
+ *
+ * Retired objects are freed by whichever thread retires or calls reclaim(),
+ * never by readers. Guards nest, a thread holds one reader record per
+ * Epoch however many guards it has taken.
+ */
+class Epoch
+{
+    public:
+    // Readers that can be inside the domain at once
+    static constexpr unsigned Max_Readers = 64;
+    static constexpr uint64_t Idle = UINT64_MAX;
+
+    /**
+     * @brief Keeps objects reachable when the guard was taken from being
+     * freed until it goes out of scope
+     */
+    class Guard
+    {
+        public:
+        Guard( Epoch& _aEpoch )
+            : _mEpoch( _aEpoch ),
+              _mRecord( _aEpoch.enter() )
+        {
+        }
+        ~Guard()
+        {
+            _mEpoch.exit( _mRecord );
+        }
+        Guard( const Guard& ) = delete;
+        Guard& operator=( const Guard& ) = delete;
+
+        // Member variables
+        Epoch& _mEpoch;
+        unsigned _mRecord;
+    };
+
+    struct Retired
+    {
+        void* ptr;
+        void (*deleter)( void* );
+        uint64_t epoch;
+    };
+
+    // A record held by the calling thread and how many guards share it
+    struct Held
+    {
+        const Epoch* epoch;
+        unsigned record;
+        unsigned depth;
+    };
+
+    Epoch()
+        : _mGlobal( 0 )
+    {
+        for( unsigned i=0; i<Max_Readers; i++ )
+        {
+            _mReaders[ i ].store( Idle );
+        }
+    }
+    ~Epoch()
+    {
+        synchronize();
+    }
+
+    static std::vector<Held>& held()
+    {
+        static thread_local std::vector<Held> h;
+        return h;
+    }
+
+    static Held* find_held( const Epoch* e )
+    {
+        std::vector<Held>& h = held();
+        for( size_t i=0; i<h.size(); i++ )
+        {
+            if( h[ i ].epoch == e ) return &h[ i ];
+        }
+        return nullptr;
+    }
+
+    /**
+     * @brief Enters the domain. A thread already inside reuses its record,
+     * which keeps the older epoch announced.
+     *
+     * @return unsigned Index of the record
+     */
+    unsigned enter()
+    {
+        Held* h = find_held( this );
+        if( h )
+        {
+            h->depth++;
+            return h->record;
+        }
+
+        unsigned i = claim();
+        Held n = { this, i, 1 };
+        held().push_back( n );
+        return i;
+    }
+
+    void exit( unsigned record )
+    {
+        Held* h = find_held( this );
+        assert( h && h->record == record );
+        if( --h->depth ) return;
+
+        std::vector<Held>& all = held();
+        all.erase( all.begin() + ( h - all.data() ) );
+        _mReaders[ record ].store( Idle, std::memory_order_release );
+    }
+
+    /**
+     * @brief Claims a free reader record, starting from a slot picked by
+     * thread so threads rarely contend for one
+     */
+    unsigned claim()
+    {
+        unsigned start = std::hash<std::thread::id>()( std::this_thread::get_id() ) % Max_Readers;
+        for( ;; )
+        {
+            for( unsigned n=0; n<Max_Readers; n++ )
+            {
+                unsigned i = ( start + n ) % Max_Readers;
+                uint64_t expected = Idle;
+                if( _mReaders[ i ].load( std::memory_order_relaxed ) == Idle &&
+                    _mReaders[ i ].compare_exchange_strong( expected, _mGlobal.load() ) )
+                {
+                    // Pairs with the fence in try_advance, either the writer
+                    // sees this reader or the reader sees the unlink
+                    std::atomic_thread_fence( std::memory_order_seq_cst );
+                    return i;
+                }
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    /**
+     * @brief Frees the object with delete once no reader can still hold it
+     *
+     * @param ptr Object already unlinked from the shared structure
+     */
+    template <typename T>
+    void retire( T* ptr )
+    {
+        retire( ptr, []( void* p ) { delete (T*)p; } );
+    }
+
+    void retire( void* ptr, void (*deleter)( void* ) )
+    {
+        if( !ptr ) return;
+        {
+            std::lock_guard<std::mutex> lock( _mMutex );
+            Retired r = { ptr, deleter, _mGlobal.load() };
+            _mRetired.push_back( r );
+        }
+        reclaim();
+    }
+
+    /**
+     * @brief Advances the epoch as far as the readers allow and frees what is
+     * old enough
+     *
+     * @return size_t Objects still waiting
+     */
+    size_t reclaim()
+    {
+        std::vector<Retired> ready;
+        size_t waiting;
+        {
+            std::lock_guard<std::mutex> lock( _mMutex );
+            if( _mRetired.empty() ) return 0;
+
+            // Two steps free everything when no reader is inside
+            for( unsigned n=0; n<2 && try_advance(); n++ );
+
+            uint64_t global = _mGlobal.load();
+            size_t kept = 0;
+            for( size_t i=0; i<_mRetired.size(); i++ )
+            {
+                if( _mRetired[ i ].epoch + 2 <= global )
+                {
+                    ready.push_back( _mRetired[ i ] );
+                }
+                else
+                {
+                    _mRetired[ kept++ ] = _mRetired[ i ];
+                }
+            }
+            _mRetired.resize( kept );
+            waiting = kept;
+        }
+
+        // Deleters run unlocked, they may retire more
+        for( size_t i=0; i<ready.size(); i++ )
+        {
+            ready[ i ].deleter( ready[ i ].ptr );
+        }
+        return waiting;
+    }
+
+    /**
+     * @brief Waits for the readers inside and frees everything retired
+     */
+    void synchronize()
+    {
+        while( reclaim() )
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    /**
+     * @brief Moves the global epoch on when every reader inside has seen it.
+     * Called with the mutex held.
+     */
+    bool try_advance()
+    {
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        uint64_t global = _mGlobal.load();
+        for( unsigned i=0; i<Max_Readers; i++ )
+        {
+            uint64_t e = _mReaders[ i ].load();
+            if( e != Idle && e != global ) return false;
+        }
+        _mGlobal.store( global + 1 );
+        return true;
+    }
+
+    // Member variables
+    std::atomic<uint64_t> _mGlobal;
+    std::atomic<uint64_t> _mReaders[ Max_Readers ];
+    std::mutex _mMutex;
+    std::vector<Retired> _mRetired;
+};
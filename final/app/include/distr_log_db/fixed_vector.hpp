@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cassert>
+
+/**
+ * @brief Vector with its storage inline and a fixed capacity. Supports the
+ * subset of std::vector the tree uses, without ever touching the heap.
+ */
+template <typename T, size_t N>
+class Fixed_Vector
+{
+    public:
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    Fixed_Vector() : _mSize( 0 ) {}
+
+    size_t size() const { return _mSize; }
+    bool empty() const { return !_mSize; }
+    size_t capacity() const { return N; }
+
+    T& operator[]( size_t i ) { return _mData[ i ]; }
+    const T& operator[]( size_t i ) const { return _mData[ i ]; }
+
+    iterator begin() { return _mData; }
+    iterator end() { return _mData + _mSize; }
+    const_iterator begin() const { return _mData; }
+    const_iterator end() const { return _mData + _mSize; }
+
+    void clear() { _mSize = 0; }
+
+    void push_back( const T& v )
+    {
+        assert( _mSize < N );
+        _mData[ _mSize++ ] = v;
+    }
+
+    void resize( size_t n )
+    {
+        assert( n <= N );
+        _mSize = n;
+    }
+
+    void assign( const_iterator first, const_iterator last )
+    {
+        assert( last - first <= (ptrdiff_t)N );
+        _mSize = 0;
+        for( ; first != last; first++ )
+        {
+            _mData[ _mSize++ ] = *first;
+        }
+    }
+
+    iterator insert( iterator pos, const T& v )
+    {
+        assert( _mSize < N );
+        for( iterator it=end(); it!=pos; it-- )
+        {
+            *it = *( it - 1 );
+        }
+        *pos = v;
+        _mSize++;
+        return pos;
+    }
+
+    iterator erase( iterator pos )
+    {
+        for( iterator it=pos; it+1!=end(); it++ )
+        {
+            *it = *( it + 1 );
+        }
+        _mSize--;
+        return pos;
+    }
+
+    // Member variables
+    T _mData[ N ];
+    size_t _mSize;
+};
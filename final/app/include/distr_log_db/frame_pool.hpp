@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstdlib>
+#include <cassert>
+#include <vector>
+#include <mutex>
+
+/**
+ * @brief Allocator for objects of one fixed size. Frames are carved out of
+ * chunks that are allocated up front, and more chunks are only added once
+ * every frame is in use. Released frames go on a free list for reuse, so a
+ * steady state never touches the general heap. Each frame starts with a
+ * pointer to its pool, so it can be released by address alone. The free
+ * list is locked, so frames may be released from other threads, as the
+ * epoch reclamation of a concurrent page table does.
+ */
+class Frame_Pool
+{
+    public:
+    static constexpr size_t Header_Size = 16;
+
+    union Frame
+    {
+        Frame_Pool* pool;
+        Frame* next;
+    };
+
+    Frame_Pool( size_t _aFrameSize, size_t _aChunkFrames )
+        : _mFrameSize( ( ( _aFrameSize + Header_Size - 1 ) / Header_Size + 1 ) * Header_Size ),
+          _mChunkFrames( _aChunkFrames ),
+          _mNumFrames( 0 ),
+          _mNumFree( 0 ),
+          _mFreeList( nullptr )
+    {
+        grow();
+    }
+
+    void* allocate()
+    {
+        std::lock_guard<std::mutex> lock( _mMutex );
+        if( !_mFreeList )
+        {
+            grow();
+        }
+        Frame* f = _mFreeList;
+        _mFreeList = f->next;
+        _mNumFree--;
+        f->pool = this;
+        return (char*)f + Header_Size;
+    }
+
+    static void release( void* ptr )
+    {
+        Frame* f = (Frame*)( (char*)ptr - Header_Size );
+        Frame_Pool* pool = f->pool;
+        std::lock_guard<std::mutex> lock( pool->_mMutex );
+        f->next = pool->_mFreeList;
+        pool->_mFreeList = f;
+        pool->_mNumFree++;
+    }
+
+    size_t in_use() const { return _mNumFrames - _mNumFree; }
+    size_t bytes() const { return _mNumFrames * _mFrameSize; }
+
+    ~Frame_Pool()
+    {
+        assert( _mNumFree == _mNumFrames );
+        for( size_t i=0; i<_mChunks.size(); i++ )
+        {
+            free( _mChunks[ i ] );
+        }
+    }
+
+    // Member variables
+    size_t _mFrameSize, _mChunkFrames, _mNumFrames, _mNumFree;
+    Frame* _mFreeList;
+    std::vector<char*> _mChunks;
+    std::mutex _mMutex;
+
+    void grow()
+    {
+        char* chunk = (char*)malloc( _mFrameSize * _mChunkFrames );
+        assert( chunk );
+        _mChunks.push_back( chunk );
+        for( size_t i=0; i<_mChunkFrames; i++ )
+        {
+            Frame* f = (Frame*)( chunk + i * _mFrameSize );
+            f->next = _mFreeList;
+            _mFreeList = f;
+        }
+        _mNumFrames += _mChunkFrames;
+        _mNumFree += _mChunkFrames;
+    }
+};
@@ -1,12 +1,124 @@
+#pragma once
+
+#include <stdint.h>
 #include <string>
 #include <cstring>
+#include <iostream>
 #include <unordered_map>
+#include <utility>
+#include <type_traits>
 #include <cassert>
 
-template <typename Key, typename Val>
+#if defined( __AVX2__ ) || defined( __SSE2__ )
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Folds the 128 bit product of a and b into 64 bits
+ */
+inline uint64_t hash_mix( uint64_t a, uint64_t b )
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)( r >> 64 );
+}
+
+/**
+ * @brief Hash of a byte string in the style of wyhash, 16 bytes are folded
+ * in per multiply
+ */
+inline uint64_t hash_bytes( const void* data, size_t len, uint64_t seed = 0 )
+{
+    const uint64_t s0 = 0xa0761d6478bd642full;
+    const uint64_t s1 = 0xe7037ed1a0b428dbull;
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t a = 0, b = 0;
+
+    seed ^= hash_mix( seed ^ s0, s1 );
+    size_t left = len;
+    while( left > 16 )
+    {
+        memcpy( &a, p, 8 );
+        memcpy( &b, p + 8, 8 );
+        seed = hash_mix( a ^ s1, b ^ seed );
+        p += 16;
+        left -= 16;
+    }
+
+    a = b = 0;
+    if( left >= 8 )
+    {
+        memcpy( &a, p, 8 );
+        memcpy( &b, p + left - 8, 8 );
+    }
+    else
+    {
+        memcpy( &a, p, left );
+    }
+    return hash_mix( s1 ^ len, hash_mix( a ^ s1, b ^ seed ) );
+}
+
+/**
+ * @brief Default hash policies. A policy returns 64 well mixed bits, the map
+ * takes the slot from the low bits and the control fragment from the top 7.
+ */
+template <typename Key, typename Enable = void>
+struct Default_Hash;
+
+template <typename Key>
+struct Default_Hash<Key, typename std::enable_if<std::is_integral<Key>::value>::type>
+{
+    uint64_t operator()( Key k ) const
+    {
+        // Xor-shift-multiply finalizer, every output bit depends on every
+        // key bit, so the low slot bits and the top fragment bits are both
+        // well mixed
+        uint64_t h = (uint64_t)k;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+};
+
+template <>
+struct Default_Hash<std::string>
+{
+    uint64_t operator()( const std::string& k ) const
+    {
+        return hash_bytes( k.data(), k.size() );
+    }
+};
+
+/**
+ * @brief Open addressing map from keys to owned pointers, laid out like a
+ * Swiss table. One control byte per slot, either empty or a 7 bit fragment
+ * of the key's hash, sits in its own array and a whole group of them is
+ * compared against the fragment with one vector instruction. Keys and
+ * values live in parallel arrays and are only touched for slots whose
+ * fragment matched. Probing is linear, a group is loaded starting at any
+ * slot and the first Group::Size - 1 control bytes are mirrored past the
+ * end so loads near the end need no wrap around.
+ *
+ * Entries are kept in Robin Hood order, an insert takes the slot of any
+ * entry closer to its home than the new one, which keeps probe distances
+ * even. Removal shifts the rest of the cluster back by one slot instead of
+ * leaving tombstones.
+ *
+ * Table sizes are powers of two so the slot is the hash masked, Hash is the
+ * policy that produces the hash.
+ *
+ * The table doubles once it is three quarters full. Entries move to the new
+ * table a few slots at a time on each insert and remove, so no single
+ * operation pays for a whole rehash. Lookups check the new table and then
+ * the one being drained.
+ */
+template <typename Key, typename Val, typename Hash = Default_Hash<Key>>
 class Hash_Map
 {
     public:
+    // A slot as seen from outside, copied out of the parallel arrays
     struct Hash_Table_Data
     {
         bool exists;
@@ -14,129 +126,426 @@ class Hash_Map
         Val val;
     };
 
-    Hash_Table_Data* _mMapTable;
-    unsigned _mTableSize, _mCurrSize;
+    // Values stay valid until they are removed, so readers of the single
+    // threaded map need no protection. Stands in for
+    // Concurrent_Hash_Map::Guard where either map can be used.
+    struct Guard
+    {
+        Guard( const Hash_Map& ) {}
+    };
+
+    static constexpr int8_t Ctrl_Empty = -128;
+
+    // Grow once more than Max_Load_Num / Max_Load_Den of the slots are used
+    static constexpr unsigned Max_Load_Num = 3;
+    static constexpr unsigned Max_Load_Den = 4;
+    // Slots of the old table moved per insert or remove during a rehash
+    static constexpr unsigned Rehash_Step = 4;
+
+    /**
+     * @brief Matches a group of control bytes at once. Bit i of a result is
+     * set when control byte i matched.
+     */
+    struct Group
+    {
+#if defined( __AVX2__ )
+        static constexpr unsigned Size = 32;
+
+        static uint32_t match( const int8_t* ctrl, int8_t c )
+        {
+            __m256i g = _mm256_loadu_si256( (const __m256i*)ctrl );
+            return _mm256_movemask_epi8( _mm256_cmpeq_epi8( g, _mm256_set1_epi8( c ) ) );
+        }
+#elif defined( __SSE2__ )
+        static constexpr unsigned Size = 16;
+
+        static uint32_t match( const int8_t* ctrl, int8_t c )
+        {
+            __m128i g = _mm_loadu_si128( (const __m128i*)ctrl );
+            return _mm_movemask_epi8( _mm_cmpeq_epi8( g, _mm_set1_epi8( c ) ) );
+        }
+#else
+        static constexpr unsigned Size = 8;
+
+        static uint32_t match( const int8_t* ctrl, int8_t c )
+        {
+            uint32_t m = 0;
+            for( unsigned i=0; i<Size; i++ )
+            {
+                m |= (uint32_t)( ctrl[ i ] == c ) << i;
+            }
+            return m;
+        }
+#endif
+    };
+
+    struct Table
+    {
+        int8_t* ctrl;
+        // Distance of each entry from its home slot
+        uint8_t* dists;
+        Key* keys;
+        Val* vals;
+        unsigned size;
+        // Longest distance any entry ever had, bounds lookups
+        unsigned max_dist;
+    };
+
+    Table _mTable;
+    unsigned _mCurrSize;
+
+    // Table being drained into _mTable, ctrl is nullptr outside a rehash. The
+    // drain starts at an empty slot and always stops at the end of a
+    // cluster, so entries left behind keep their probe sequences intact.
+    Table _mOld;
+    unsigned _mRehashStart, _mRehashDone;
 
     Hash_Map( unsigned _aLength )
-        : _mTableSize( _aLength ),
-          _mCurrSize( 0 )
+        : _mCurrSize( 0 ),
+          _mRehashStart( 0 ),
+          _mRehashDone( 0 )
     {
-        _mMapTable = new Hash_Table_Data[ _mTableSize ];
-        memset( _mMapTable, 0, sizeof( Hash_Table_Data ) * _mTableSize );
+        allocate( _mTable, _aLength );
+        _mOld.ctrl = nullptr;
+        _mOld.size = 0;
     }
 
-    unsigned calc_index( const Key& k )
+    static void allocate( Table& t, unsigned size )
     {
-        return std::hash<Key>{}( k * ( k + 1 ) * ( k + 2 ) ) % _mTableSize;
+        t.size = Group::Size;
+        while( t.size < size )
+        {
+            t.size *= 2;
+        }
+        t.ctrl = new int8_t[ t.size + Group::Size - 1 ];
+        memset( t.ctrl, Ctrl_Empty, t.size + Group::Size - 1 );
+        t.dists = new uint8_t[ t.size ];
+        t.keys = new Key[ t.size ];
+        t.vals = new Val[ t.size ];
+        t.max_dist = 0;
     }
-    Hash_Table_Data& find( const Key& k )
+    static void release( Table& t )
     {
-        Hash_Table_Data* ptr = _mMapTable + calc_index( k );
+        delete [] t.ctrl;
+        delete [] t.dists;
+        delete [] t.keys;
+        delete [] t.vals;
+        t.ctrl = nullptr;
+    }
 
-        while( 1 )
+    uint64_t calc_hash( const Key& k ) const
+    {
+        return Hash()( k );
+    }
+    static unsigned calc_index( uint64_t h, unsigned size )
+    {
+        return h & ( size - 1 );
+    }
+    static int8_t fragment( uint64_t h )
+    {
+        return h >> 57;
+    }
+
+    static void set_ctrl( Table& t, unsigned i, int8_t c )
+    {
+        t.ctrl[ i ] = c;
+        if( i < Group::Size - 1 )
+        {
+            t.ctrl[ t.size + i ] = c;
+        }
+    }
+
+    /**
+     * @brief Looks for the slot holding k. Stops at the first empty slot or
+     * once past the longest probe distance in the table.
+     *
+     * @param t
+     * @param k
+     * @param i Set to the slot if found
+     * @return true Found
+     */
+    bool probe( const Table& t, const Key& k, unsigned& i ) const
+    {
+        uint64_t h = calc_hash( k );
+        int8_t h2 = fragment( h );
+        unsigned pos = calc_index( h, t.size );
+
+        for( unsigned scanned=0; scanned<=t.max_dist; scanned+=Group::Size )
         {
-            if( ( ptr->exists && ptr->key == k ) || ( !ptr->exists ) )
+            uint32_t match = Group::match( t.ctrl + pos, h2 );
+            uint32_t empty = Group::match( t.ctrl + pos, Ctrl_Empty );
+
+            // Only slots before the first empty one are part of the sequence
+            if( empty )
             {
-                return *ptr;
+                match &= ( empty & -empty ) - 1;
             }
-            ptr++;
-            if( ptr - _mMapTable >= _mTableSize )
+            while( match )
             {
-                ptr = _mMapTable;
+                i = pos + __builtin_ctz( match );
+                i -= i >= t.size ? t.size : 0;
+                if( t.keys[ i ] == k )
+                {
+                    return true;
+                }
+                match &= match - 1;
+            }
+            if( empty )
+            {
+                return false;
             }
+            pos = ( pos + Group::Size ) & ( t.size - 1 );
         }
+        return false;
     }
-    void insert( const Key& k, const Val& v )
+
+    static Hash_Table_Data data( const Table& t, unsigned i )
     {
-        Hash_Table_Data& d = find( k );
-        d.exists = true;
-        d.key = k;
-        d.val = v;
-        _mCurrSize++;
+        Hash_Table_Data d;
+        d.exists = t.ctrl[ i ] != Ctrl_Empty;
+        d.key = t.keys[ i ];
+        d.val = t.vals[ i ];
+        return d;
     }
-    Val& at( const Key& k )
+
+    /**
+     * @brief Inserts a key that is not in the table. Walking from its home,
+     * the entry takes over the first slot whose entry is closer to its own
+     * home, and the displaced entry continues the walk.
+     */
+    void place( Table& t, Key k, Val v )
     {
-        return find( k ).val;
+        uint64_t h = calc_hash( k );
+        int8_t c = fragment( h );
+        unsigned i = calc_index( h, t.size );
+        unsigned d = 0;
+
+        while( t.ctrl[ i ] != Ctrl_Empty )
+        {
+            if( t.dists[ i ] < d )
+            {
+                std::swap( k, t.keys[ i ] );
+                std::swap( v, t.vals[ i ] );
+                int8_t resident = t.ctrl[ i ];
+                set_ctrl( t, i, c );
+                c = resident;
+                unsigned resident_dist = t.dists[ i ];
+                t.dists[ i ] = d;
+                t.max_dist = d > t.max_dist ? d : t.max_dist;
+                d = resident_dist;
+            }
+            i = i + 1 == t.size ? 0 : i + 1;
+            d++;
+        }
+        assert( d <= UINT8_MAX );
+
+        set_ctrl( t, i, c );
+        t.dists[ i ] = d;
+        t.keys[ i ] = k;
+        t.vals[ i ] = v;
+        t.max_dist = d > t.max_dist ? d : t.max_dist;
     }
+
+    /**
+     * @brief Empties a slot and shifts the following entries of the cluster
+     * back by one, up to an empty slot or an entry at its home
+     */
+    static void erase( Table& t, unsigned i )
+    {
+        while( 1 )
+        {
+            unsigned next = i + 1 == t.size ? 0 : i + 1;
+            if( t.ctrl[ next ] == Ctrl_Empty || !t.dists[ next ] )
+            {
+                break;
+            }
+            set_ctrl( t, i, t.ctrl[ next ] );
+            t.dists[ i ] = t.dists[ next ] - 1;
+            t.keys[ i ] = t.keys[ next ];
+            t.vals[ i ] = t.vals[ next ];
+            i = next;
+        }
+        set_ctrl( t, i, Ctrl_Empty );
+    }
+
+    Hash_Table_Data find( const Key& k ) const
+    {
+        unsigned i;
+        if( probe( _mTable, k, i ) )
+        {
+            return data( _mTable, i );
+        }
+        if( _mOld.ctrl && probe( _mOld, k, i ) )
+        {
+            return data( _mOld, i );
+        }
+
+        Hash_Table_Data d = Hash_Table_Data();
+        return d;
+    }
+    void insert( const Key& k, const Val& v )
+    {
+        rehash_step();
+        if( ( _mCurrSize + 1 ) * Max_Load_Den > _mTable.size * Max_Load_Num )
+        {
+            finish_rehash();
+            start_rehash();
+        }
+
+        unsigned i;
+        if( probe( _mTable, k, i ) )
+        {
+            _mTable.vals[ i ] = v;
+        }
+        else if( _mOld.ctrl && probe( _mOld, k, i ) )
+        {
+            _mOld.vals[ i ] = v;
+        }
+        else
+        {
+            place( _mTable, k, v );
+            _mCurrSize++;
+        }
+    }
+
+    // Slots of both tables, for walking every entry
+    unsigned num_slots() const { return _mTable.size + ( _mOld.ctrl ? _mOld.size : 0 ); }
+    Hash_Table_Data slot( unsigned i ) const { return i < _mTable.size ? data( _mTable, i ) : data( _mOld, i - _mTable.size ); }
+
     void clear()
     {
-        memset( _mMapTable, 0, sizeof( Hash_Table_Data ) * _mTableSize );
+        if( _mOld.ctrl )
+        {
+            release( _mOld );
+        }
+        memset( _mTable.ctrl, Ctrl_Empty, _mTable.size + Group::Size - 1 );
         _mCurrSize = 0;
     }
 
     void remove( const Key& k )
     {
-        Hash_Table_Data* ptr = &find( k );
-        if( !ptr->exists )
+        rehash_step();
+
+        unsigned i;
+        Table* t = &_mTable;
+        if( !probe( *t, k, i ) )
         {
-            std::cout << "error " << k << std::endl;
+            t = &_mOld;
+            if( !_mOld.ctrl || !probe( *t, k, i ) )
+            {
+                return;
+            }
         }
-        if( ptr->exists )
-        {
-            ptr->exists = false;
-            delete ptr->val;
-            _mCurrSize--;
 
-            while( 1 )
-            {
-                ptr++;
-                if( ptr - _mMapTable >= _mTableSize ) ptr = _mMapTable;
+        delete t->vals[ i ];
+        erase( *t, i );
+        _mCurrSize--;
+    }
 
-                if( ! ptr->exists )
-                {
-                    break;
-                }
+    void start_rehash()
+    {
+        assert( !_mOld.ctrl );
+        _mOld = _mTable;
+        _mRehashDone = 0;
+        _mRehashStart = 0;
+        while( _mOld.ctrl[ _mRehashStart ] != Ctrl_Empty ) _mRehashStart++;
 
-                Hash_Table_Data d;
-                memcpy( &d, ptr, sizeof( Hash_Table_Data ) );
-                ptr->exists = false;
-                _mCurrSize--;
-                insert( ptr->key, ptr->val );
+        allocate( _mTable, _mOld.size * 2 );
+    }
+
+    /**
+     * @brief Moves at least Rehash_Step slots of the old table, and then the
+     * rest of the cluster it stopped in
+     */
+    void rehash_step()
+    {
+        bool in_cluster = false;
+        for( unsigned n=0; _mOld.ctrl && ( n < Rehash_Step || in_cluster ); n++ )
+        {
+            unsigned i = ( _mRehashStart + _mRehashDone ) & ( _mOld.size - 1 );
+            in_cluster = _mOld.ctrl[ i ] != Ctrl_Empty;
+            if( in_cluster )
+            {
+                place( _mTable, _mOld.keys[ i ], _mOld.vals[ i ] );
+                set_ctrl( _mOld, i, Ctrl_Empty );
+            }
+
+            if( ++_mRehashDone == _mOld.size )
+            {
+                release( _mOld );
             }
         }
     }
+
+    void finish_rehash()
+    {
+        while( _mOld.ctrl )
+        {
+            rehash_step();
+        }
+    }
+
     void verify()
     {
-        for( unsigned i=0; i<_mTableSize; i++ )
+        verify( _mTable );
+        if( _mOld.ctrl )
+        {
+            verify( _mOld );
+        }
+    }
+    void verify( const Table& t )
+    {
+        for( unsigned i=0; i<Group::Size - 1; i++ )
         {
-            if( _mMapTable[ i ].exists )
+            assert( t.ctrl[ t.size + i ] == t.ctrl[ i ] );
+        }
+        for( unsigned i=0; i<t.size; i++ )
+        {
+            if( t.ctrl[ i ] != Ctrl_Empty )
             {
-                unsigned index = calc_index( _mMapTable[ i ].key );
-                Hash_Table_Data* ptr = &_mMapTable[ i ];
-                while( 1 )
-                {
-                    assert( ptr->exists );
-                    if( ( ptr - _mMapTable ) == index ) break;
-                    ptr--;
-                    if( ptr - _mMapTable < 0 ) ptr = _mMapTable + _mTableSize - 1;
-                }
+                uint64_t h = calc_hash( t.keys[ i ] );
+                assert( t.ctrl[ i ] == fragment( h ) );
+                unsigned index = calc_index( h, t.size );
+                assert( t.dists[ i ] == ( ( i - index ) & ( t.size - 1 ) ) );
+                assert( t.dists[ i ] <= t.max_dist );
+
+                // Robin Hood order, distances grow by at most one per slot
+                unsigned prev = i ? i - 1 : t.size - 1;
+                assert( t.ctrl[ prev ] != Ctrl_Empty || !t.dists[ i ] );
+                assert( t.ctrl[ prev ] == Ctrl_Empty || t.dists[ i ] <= t.dists[ prev ] + 1 );
             }
         }
     }
     ~Hash_Map()
     {
-        for( uint32_t i=0; i<_mTableSize; i++ )
+        for( uint32_t i=0; i<num_slots(); i++ )
         {
-            if( _mMapTable[i].exists )
+            if( slot( i ).exists )
             {
-                delete _mMapTable[i].val;
+                delete slot( i ).val;
             }
         }
+        release( _mTable );
+        if( _mOld.ctrl )
+        {
+            release( _mOld );
+        }
     }
 };
 
 #include <iostream>
 #include <iomanip>
-template <typename Key, typename Val>
-std::ostream& operator<<( std::ostream& os, const Hash_Map<Key,Val>& map )
+template <typename Key, typename Val, typename Hash>
+std::ostream& operator<<( std::ostream& os, const Hash_Map<Key,Val,Hash>& map )
 {
     os << "Hash Map:" << std::endl;
-    for( size_t i=0; i<map._mTableSize; i++ )
+    for( size_t i=0; i<map.num_slots(); i++ )
     {
+        typename Hash_Map<Key,Val,Hash>::Hash_Table_Data d = map.slot( i );
         os << "   " << std::setw( 4 ) << std::hex << i;
-        if( map._mMapTable[ i ].exists )
+        if( d.exists )
         {
-            os << " " << map._mMapTable[ i ].key << std::flush << " " << map._mMapTable[ i ].val->_mNodeId << " " << map._mMapTable[ i ].val->_mInUse;
+            os << " " << d.key << std::flush << " " << d.val->_mNodeId << " " << d.val->_mInUse;
         }
         os << std::endl;
     }
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <string>
+#include <list>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * @brief Positional page I/O on a single file. Requests are issued through
+ * io_uring when the kernel supports it, otherwise through a small pool of
+ * threads doing pread/pwrite. Reads can be issued ahead of time with
+ * read_ahead(), so several pages are in flight at once and a later read()
+ * of the same range is served from memory. A batch of writes is submitted
+ * at once and waited for together.
+ *
+ * Any number of threads may call in at once and each has its requests in
+ * flight independently, only the bookkeeping is locked. A read_ahead() of a
+ * range that another thread is writing is not ordered with the write.
+ */
+class Page_IO
+{
+    public:
+
+    static constexpr size_t Direct_Alignment = 4096;
+    static constexpr uint32_t Queue_Depth = 64;
+    static constexpr uint32_t Num_IO_Threads = 4;
+    static constexpr uint32_t Max_Read_Aheads = 32;
+
+    enum Backend
+    {
+        Backend_None,
+        Backend_IO_Uring,
+        Backend_Thread_Pool,
+    };
+
+    enum Opcode
+    {
+        Opcode_Read,
+        Opcode_Write,
+        Opcode_Sync,
+    };
+
+    struct Request
+    {
+        Opcode op;
+        struct iovec iov;
+        off_t off;
+        ssize_t res;
+        bool done;
+    };
+
+    // One write of a batch
+    struct Write
+    {
+        const void* buf;
+        size_t len;
+        off_t off;
+    };
+
+    bool open( const std::string& file_name, bool direct=false, bool force_thread_pool=false );
+    void close();
+    bool is_open() const { return _mFd >= 0; }
+    off_t size();
+    void resize( off_t size );
+
+    void read( void* buf, size_t len, off_t off );
+    void write( const void* buf, size_t len, off_t off );
+    void write( const std::vector<Write>& writes );
+    void sync();
+    void read_ahead( off_t off, size_t len );
+
+    Backend backend() const { return _mBackend; }
+    bool direct() const { return _mDirect; }
+
+    Page_IO();
+    ~Page_IO();
+
+    // Member variables
+    int _mFd;
+    bool _mDirect;
+    off_t _mSize;
+    Backend _mBackend;
+    // Guards the size, the read-aheads and the busy blocks
+    std::mutex _mMutex;
+    std::list<Request*> _mReadAheads;
+    // O_DIRECT: block ranges being read, patched and written back. A range
+    // that reaches past the end of the file is open ended, since extending
+    // the file truncates the last block.
+    std::vector<std::pair<off_t, off_t>> _mBusyBlocks;
+    std::condition_variable _mBusyCond;
+
+    // io_uring backend. The rings have a single submitter and a single
+    // reaper at a time, both under _mRingMutex. One waiter sleeps in the
+    // kernel while the others wait for it on _mReapCond.
+    std::mutex _mRingMutex;
+    std::condition_variable _mReapCond;
+    bool _mReaping;
+    unsigned _mInFlight;
+    int _mRingFd;
+    void* _mSqRing;
+    void* _mCqRing;
+    size_t _mSqRingSize;
+    size_t _mCqRingSize;
+    struct io_uring_sqe* _mSqes;
+    size_t _mSqesSize;
+    unsigned* _mSqHead;
+    unsigned* _mSqTail;
+    unsigned* _mSqMask;
+    unsigned* _mSqArray;
+    unsigned* _mCqHead;
+    unsigned* _mCqTail;
+    unsigned* _mCqMask;
+    struct io_uring_cqe* _mCqes;
+
+    // Thread pool backend
+    std::vector<std::thread> _mThreads;
+    std::list<Request*> _mQueue;
+    std::mutex _mQueueMutex;
+    std::condition_variable _mQueueCond;
+    std::condition_variable _mDoneCond;
+    bool _mStopping;
+
+    bool uring_setup();
+    void uring_teardown();
+    unsigned uring_reap();
+    void uring_wait( std::unique_lock<std::mutex>& lock, Request* r );
+
+    void worker();
+    ssize_t execute( const Request* r );
+
+    void submit( Request* r );
+    void wait( Request* r );
+    ssize_t transfer( Opcode op, void* buf, size_t len, off_t off );
+    void copy_out( const Request* r, void* buf, size_t len, off_t off );
+    void drop_read_aheads( off_t off, size_t len );
+    void write_direct( const std::vector<Write>& writes );
+    bool blocks_busy( off_t off, off_t end ) const;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "b_plus.hpp"
+
+/**
+ * @brief Wire format spoken between Server and Client. Every request is one
+ * fixed size record and is answered by one response, in order, so a client
+ * may send any number of requests before reading the responses. Records are
+ * in host byte order.
+ */
+namespace Protocol
+{
+    // Most pairs a response can carry, a scan of the whole tree. A larger
+    // count is corrupt.
+    static constexpr uint32_t Max_Count = B_Tree::Max_Num_Leaf_Nodes * B_Tree::Leaf_Node_Order;
+
+    enum Op
+    {
+        // k, answered with the pair if found
+        Op_Get = 1,
+        // k and v under txn, or as a transaction of its own when txn is 0
+        Op_Put = 2,
+        // Every pair with k <= key <= hi
+        Op_Scan = 3,
+        // Answered with the new txn
+        Op_Begin = 4,
+        Op_Commit = 5,
+        Op_Abort = 6,
+    };
+
+    enum Status
+    {
+        Status_Ok = 0,
+        Status_Not_Found = 1,
+        // The key is written by a transaction that has not finished
+        Status_Conflict = 2,
+        Status_Error = 3,
+    };
+
+    struct Request
+    {
+        uint32_t id;
+        uint8_t op;
+        uint8_t pad[ 3 ];
+        B_Tree::Txn txn;
+        B_Tree::Key k;
+        B_Tree::Key hi;
+        B_Tree::Val v;
+    };
+
+    // Followed by count B_Tree::KeyVal entries
+    struct Response
+    {
+        uint32_t id;
+        uint8_t status;
+        uint8_t pad[ 3 ];
+        B_Tree::Txn txn;
+        uint32_t count;
+    };
+}
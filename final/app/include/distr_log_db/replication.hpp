@@ -0,0 +1,163 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "b_plus.hpp"
+#include "socket.hpp"
+
+/**
+ * @brief Log shipping between a primary database and read only followers.
+ *
+ * Each commit on the primary gets a replication sequence number, kept in the
+ * tree header, and is sent to every follower as one record holding the pairs
+ * the transaction wrote. A follower applies a record as one local transaction
+ * and stores the sequence number with it, so on reconnect it asks for exactly
+ * the records it is missing. Records are in host byte order.
+ */
+namespace Replication
+{
+    static constexpr uint32_t Magic = 0x52504c44;
+    // Most pairs a record can carry, a snapshot of a full tree. A larger
+    // count is corrupt.
+    static constexpr uint32_t Max_Count = B_Tree::Max_Num_Leaf_Nodes * B_Tree::Leaf_Node_Order;
+
+    enum Record_Type
+    {
+        Record_Commit = 1,
+        // Every pair in the primary, sent to followers the history can not
+        // bring up to date
+        Record_Snapshot = 2,
+        // The follower has applied commits the primary never made, it has
+        // diverged and must be rebuilt
+        Record_Reject = 3,
+    };
+
+    // Sent by a follower when it connects
+    struct Hello
+    {
+        uint32_t magic;
+        uint32_t seq;
+    };
+
+    // Followed by count B_Tree::KeyVal entries
+    struct Record
+    {
+        uint32_t magic;
+        uint32_t type;
+        uint32_t seq;
+        uint32_t count;
+    };
+}
+
+/**
+ * @brief Ships the commits of a B_Tree to followers. A commit is queued once
+ * it is durable and a sender thread writes it to the followers, so a slow
+ * follower never holds up a commit. Followers that connect are brought up
+ * to date at the next commit or call to poll, from recent history if it
+ * reaches back far enough, otherwise with a snapshot. A follower ahead of
+ * the primary is rejected.
+ */
+class Replication_Primary
+{
+    public:
+    static constexpr size_t Max_History = 1024;
+    static constexpr int Send_Timeout_Ms = 1000;
+
+    struct Follower
+    {
+        Socket sock;
+        uint32_t seq;
+    };
+
+    typedef std::pair<uint32_t, std::vector<B_Tree::KeyVal>> Commit;
+
+    struct Outgoing
+    {
+        uint32_t type;
+        uint32_t seq;
+        std::vector<B_Tree::KeyVal> kvs;
+    };
+
+    // Work for the sender thread. Without a joining follower the records go
+    // to every follower, otherwise only to the joining one, which then
+    // receives the later commits as well.
+    struct Job
+    {
+        std::vector<Follower> joining;
+        std::vector<Outgoing> records;
+    };
+
+    void poll();
+    size_t num_followers();
+    uint16_t port() const { return _mListener.port(); }
+
+    Replication_Primary( B_Tree& _aTree, const std::string& address );
+    ~Replication_Primary();
+
+    // Member variables
+    B_Tree& _mTree;
+    Socket _mListener;
+    std::atomic<bool> _mStopping;
+    std::thread _mAcceptThread;
+    std::mutex _mPendingMutex;
+    std::vector<Follower> _mPending;
+    std::deque<Commit> _mHistory;
+    // Sender thread, _mFollowers is only used by it
+    std::mutex _mJobMutex;
+    std::condition_variable _mJobCond;
+    std::deque<Job> _mJobs;
+    std::vector<Follower> _mFollowers;
+    std::atomic<size_t> _mNumFollowers;
+    std::thread _mSendThread;
+
+    void ship( uint32_t seq, const std::vector<B_Tree::KeyVal>& kvs );
+    void accept_loop();
+    void catch_up( Follower& f );
+    void queue( Job& job );
+    void send_loop();
+    static bool send_record( Socket& s, uint32_t type, uint32_t seq, const std::vector<B_Tree::KeyVal>& kvs );
+};
+
+/**
+ * @brief Keeps a local copy of a primary's database current by applying the
+ * records it ships, and serves reads from it. The connection is made and
+ * remade in the background. A follower that has applied more commits than
+ * the primary made is rejected and stops following, its copy has to be
+ * rebuilt with reset.
+ */
+class Replication_Follower
+{
+    public:
+    static constexpr int Reconnect_Ms = 50;
+
+    bool find( const B_Tree::Key& k, B_Tree::Val& v );
+    uint32_t multi_find( const std::vector<B_Tree::Key>& keys, std::vector<B_Tree::Val>& vals, std::vector<bool>& found );
+    void scan( const B_Tree::Key& lo, const B_Tree::Key& hi, std::vector<B_Tree::KeyVal>& kvs );
+    uint32_t applied_seq();
+    bool wait_for( uint32_t seq, uint32_t timeout_ms );
+    bool rejected() const { return _mRejected; }
+
+    Replication_Follower( const std::string& file_name, const std::string& address, bool reset=false );
+    ~Replication_Follower();
+
+    // Member variables
+    std::string _mAddress;
+    B_Tree _mTree;
+    std::mutex _mMutex;
+    std::condition_variable _mApplied;
+    Socket _mSocket;
+    std::atomic<bool> _mStopping;
+    std::atomic<bool> _mRejected;
+    std::thread _mThread;
+
+    void run();
+    void apply( const Replication::Record& r, const std::vector<B_Tree::KeyVal>& kvs );
+};
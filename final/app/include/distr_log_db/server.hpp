@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "b_plus.hpp"
+#include "protocol.hpp"
+#include "socket.hpp"
+
+/**
+ * @brief Serves a B_Tree over the network. A few event loop threads own the
+ * connections, read requests and write responses, while one engine thread
+ * owns the tree. The engine takes everything queued since its last pass as
+ * one batch, so runs of gets from all connections become one multi_find and
+ * runs of standalone puts share one transaction and one commit.
+ *
+ * Keys written by an open transaction are locked to it until it finishes,
+ * other writers get Status_Conflict rather than waiting.
+ */
+class Server
+{
+    public:
+    static constexpr uint32_t Max_Events = 64;
+    static constexpr size_t Read_Chunk = 64 * 1024;
+
+    struct Connection
+    {
+        int fd;
+        int epoll_fd;
+        std::mutex mutex;
+        std::string in;
+        std::string out;
+        bool closed;
+        // Engine thread only
+        std::set<B_Tree::Txn> txns;
+    };
+
+    struct Work
+    {
+        std::shared_ptr<Connection> conn;
+        Protocol::Request req;
+        bool close;
+    };
+
+    struct Event_Loop
+    {
+        int epoll_fd;
+        int wake_fd;
+        std::thread thread;
+    };
+
+    void stop();
+    uint16_t port() const { return _mListener.port(); }
+
+    Server( B_Tree& _aTree, const std::string& address, uint32_t num_loops = 2 );
+    ~Server();
+
+    // Member variables
+    B_Tree& _mTree;
+    Socket _mListener;
+    std::atomic<bool> _mStopping;
+    std::vector<Event_Loop> _mLoops;
+    std::atomic<uint32_t> _mNextLoop;
+
+    std::mutex _mConnsMutex;
+    std::map<Connection*, std::shared_ptr<Connection>> _mConns;
+
+    std::mutex _mQueueMutex;
+    std::condition_variable _mQueueCond;
+    std::vector<Work> _mQueue;
+    bool _mEngineStopping;
+    std::thread _mEngine;
+
+    // Engine thread only
+    std::map<B_Tree::Key, B_Tree::Txn> _mLocks;
+    std::vector<Work> _mGets;
+    std::vector<Work> _mPuts;
+    std::vector<std::shared_ptr<Connection>> _mTouched;
+
+    void run_loop( Event_Loop& loop );
+    void accept_connections();
+    void read_connection( Connection* c );
+    void write_connection( Connection* c );
+    void close_connection( Connection* c );
+
+    void run_engine();
+    void execute( Work& w );
+    void flush_gets();
+    void flush_puts();
+    bool lock_key( const B_Tree::Key& k, B_Tree::Txn t );
+    void end_txn( Connection* c, B_Tree::Txn t, bool commit );
+    void respond( const std::shared_ptr<Connection>& conn, const Protocol::Request& req, uint8_t status,
+                  B_Tree::Txn txn = 0, const B_Tree::KeyVal* kvs = nullptr, uint32_t count = 0 );
+    void send_responses();
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "b_plus.hpp"
+
+/**
+ * @brief Front end that splits the key space into ranges, each held by its
+ * own B_Tree file and served by its own worker thread. Operations are routed
+ * by key, and those that span shards run on all of them in parallel.
+ *
+ * The shard boundaries are kept in a manifest next to the shard files. A hot
+ * or full shard can be split while the others keep serving, operations that
+ * reach a shard after it was split are routed again.
+ */
+class Sharded_B_Tree
+{
+    public:
+    typedef B_Tree::Key Key;
+    typedef B_Tree::Val Val;
+    typedef B_Tree::KeyVal KeyVal;
+
+    // Runs on a shard's worker with the part of a range the shard holds
+    typedef std::function<void( B_Tree& tree, Key lo, Key hi )> Range_Op;
+
+    struct Shard
+    {
+        Key _mLo;
+        Key _mHi;
+        uint32_t _mFileId;
+        B_Tree* _mTree;
+        std::thread _mWorker;
+        std::mutex _mMutex;
+        std::condition_variable _mCond;
+        std::deque<std::function<void()>> _mTasks;
+        // Set once the shard was split, queued operations then report that
+        // they have to be routed again
+        bool _mRetired;
+        bool _mStopping;
+        std::atomic<uint64_t> _mOps;
+
+        void submit( const std::function<void()>& task );
+        void run();
+        void stop();
+
+        Shard( const std::string& file_name, Key _aLo, Key _aHi, uint32_t _aFileId, bool reset );
+        ~Shard();
+    };
+
+    void insert( const Key& k, const Val& v );
+    void insert_batch( const std::vector<KeyVal>& kvs );
+    bool find( const Key& k, Val& v );
+    uint32_t multi_find( const std::vector<Key>& keys, std::vector<Val>& vals, std::vector<bool>& found );
+    void scan( const Key& lo, const Key& hi, std::vector<KeyVal>& kvs );
+
+    bool split_shard( size_t idx );
+    size_t hottest_shard();
+    size_t num_shards();
+
+    void for_range( Key lo, Key hi, const Range_Op& op );
+
+    Sharded_B_Tree( const std::string& base_name, uint32_t num_shards = 1, bool reset = false );
+    ~Sharded_B_Tree();
+
+    // Member variables
+    std::string _mBaseName;
+    std::mutex _mRouteMutex;
+    std::vector<std::shared_ptr<Shard>> _mShards;
+    std::vector<std::shared_ptr<Shard>> _mRetiredShards;
+    uint32_t _mNextFileId;
+
+    std::string shard_file( uint32_t file_id ) const;
+    std::string manifest_file() const { return _mBaseName + ".shards"; }
+    bool load_manifest();
+    void store_manifest();
+    void split( Shard* s, bool& split );
+};
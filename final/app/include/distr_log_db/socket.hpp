@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <string>
+
+/**
+ * @brief Owning wrapper around a stream socket file descriptor. Addresses
+ * are written "unix:<path>" for Unix domain sockets or "tcp:<host>:<port>"
+ * for TCP, a TCP listener given port 0 picks a free port.
+ */
+class Socket
+{
+    public:
+
+    static Socket listen( const std::string& address );
+    static Socket connect( const std::string& address );
+
+    Socket accept();
+    bool write_all( const void* buf, size_t len );
+    bool read_all( void* buf, size_t len );
+    void shutdown();
+    void close();
+    bool valid() const { return _mFd >= 0; }
+    int fd() const { return _mFd; }
+    uint16_t port() const;
+
+    Socket() : _mFd( -1 ) {}
+    explicit Socket( int _aFd ) : _mFd( _aFd ) {}
+    Socket( Socket&& s ) : _mFd( s._mFd ) { s._mFd = -1; }
+    Socket& operator=( Socket&& s );
+    ~Socket() { close(); }
+
+    Socket( const Socket& ) = delete;
+    Socket& operator=( const Socket& ) = delete;
+
+    // Member variables
+    int _mFd;
+};
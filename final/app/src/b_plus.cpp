@@ -1,5 +1,7 @@
 #include "distr_log_db/b_plus.hpp"
+#include "distr_log_db/backup.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <string>
@@ -10,36 +12,65 @@
  * 
  * @param file_name 
  * @param reset If set to true, file will be overwritten with new database
+ * @param direct_io If set to true, pages bypass the page cache (O_DIRECT)
+ * @param shadow_paging If set to true, the database uses copy-on-write shadow
+ * paging instead of per leaf logs. A database opened in the other mode is
+ * overwritten.
  */
-B_Tree::B_Tree( std::string file_name, bool reset )
-    : _mLeafNodeMap( 8 ),
-      _mTreeFile( file_name, std::ios::in | std::ios::out | std::ios::binary )
+B_Tree::B_Tree( std::string file_name, bool reset, bool direct_io, bool shadow_paging )
+    : _mBatchingWrites( false ),
+      _mTreePool( sizeof( Tree_Node ), Max_Num_Tree_Nodes ),
+      _mLeafPool( sizeof( Leaf_Node ), Leaf_Pool_Chunk ),
+      _mDeltaPool( sizeof( Leaf_Node::Delta_Log ), Leaf_Pool_Chunk ),
+      _mLeafNodeMap( 8 ),
+      _mLeafCacheSize( Leaf_Cache_Size ),
+      _mRightmostLeaf( 0 ),
+      _mLastInsertKey( 0 ),
+      _mSequentialRun( 0 ),
+      _mSyncDeferred( 0 ),
+      _mHeaderDirty( false ),
+      _mBackup( nullptr ),
+      _mRecoveredLeaves( 0 ),
+      _mAggregatesSince( 0 ),
+      _mWriteBuffering( false )
 {
+    for( uint32_t i=0; i<Max_Num_Leaf_Nodes; i++ )
+    {
+        _mLeafRecovery[ i ] = Recovery_Done;
+    }
+
     memset( &_mHeader._mPage, 0, sizeof( Header::_mPage ) );
+    memset( &_mPublishedHeader._mPage, 0, sizeof( Header::_mPage ) );
+    memset( _mPendingFrames, 0, sizeof( _mPendingFrames ) );
+
+    bool opened = _mTreeFile.open( file_name, direct_io );
+    assert( opened );
+    (void)opened;
 
-    if( _mTreeFile.fail() )
+    std::streamoff file_size = shadow_paging ? Shadow_File_Size : File_Size;
+    if( _mTreeFile.size() != file_size || reset )
     {
-        _mTreeFile.open( file_name, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc );
+        _mTreeFile.resize( 0 );
+        _mTreeFile.resize( file_size );
     }
-    _mTreeFile.seekg( 0, std::ios_base::end );
-    std::streampos pos = _mTreeFile.tellg();
 
-    if( pos != File_Size || reset )
+    // Header and transaction lists, and all tree nodes, are each contiguous.
+    // Both regions are read with one large request apiece, issued together.
+    _mTreeFile.read_ahead( 0, Tree_Node_Offset );
+    _mTreeFile.read_ahead( Tree_Node_Offset, Leaf_Node_Offset - Tree_Node_Offset );
+    if( shadow_paging )
     {
-        _mTreeFile.close();
-        _mTreeFile.open( file_name, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc );
-        _mTreeFile.seekg( File_Size - 1, std::ios_base::beg );
-        _mTreeFile.write( "", 1 );
-        _mTreeFile.flush();
+        _mTreeFile.read_ahead( Tree_Shadow_Offset, Shadow_File_Size - Tree_Shadow_Offset );
     }
-
-    _mTreeFile.seekg( 0, std::ios::beg );
-    _mTreeFile.read( (char*)&_mHeader._mPage, sizeof( Header::_mPage ) );
+    _mTreeFile.read( &_mHeader._mPage, sizeof( Header::_mPage ), 0 );
+    _mTreeFile.read( &_mCurrTxns._mPage, sizeof( Transactions::_mPage ), Curr_Txns_Offset );
+    _mTreeFile.read( &_mAbortTxns._mPage, sizeof( Transactions::_mPage ), Abort_Txns_Offset );
 
     _mTreeNodes = new Tree_Node*[ Max_Num_Tree_Nodes ];
 
     if( _mHeader._mMaxLeafNodes != Max_Num_Leaf_Nodes ||
         _mHeader._mMaxTreeNodes != Max_Num_Tree_Nodes ||
+        _mHeader._mShadowPaging != shadow_paging ||
         !_mHeader._mNumLeafNodes ||
         !_mHeader._mNumTreeNodes                         )
     {
@@ -51,6 +82,7 @@ B_Tree::B_Tree( std::string file_name, bool reset )
         _mHeader._mMaxTreeNodes = Max_Num_Tree_Nodes;
         _mHeader._mNumLeafNodes = 0;
         _mHeader._mNumTreeNodes = 0;
+        _mHeader._mShadowPaging = shadow_paging;
 
         Tree_Node* temp_root = new_tree_node( _mHeader._mRootId );
 
@@ -59,20 +91,45 @@ B_Tree::B_Tree( std::string file_name, bool reset )
 
         _mRoot()->_mChildNodes[0] = temp_leaf->_mNodeId;
         _mRoot()->_mSize = 1;
+        _mRightmostLeaf = leaf_node_id;
+
+        if( shadow_paging )
+        {
+            flush();
+        }
     }
     else
     {
+        memcpy( &_mPublishedHeader._mPage, &_mHeader._mPage, sizeof( Header::_mPage ) );
+
+        // Prepared transactions are in doubt and wait for their coordinator,
+        // every other unfinished transaction is aborted
+        Transactions in_doubt;
+        memset( &in_doubt._mPage, 0, sizeof( in_doubt._mPage ) );
         for( uint32_t i=0; i<_mCurrTxns._mNumTransactions; i++ )
         {
-            add_txn( _mAbortTxns, _mCurrTxns._mTransactions[i] );
-            memset( &_mCurrTxns._mPage, 0, sizeof( _mCurrTxns._mPage ) );
-            sync_header_txns();
+            if( is_prepared( _mCurrTxns._mTransactions[i] ) )
+            {
+                add_txn( in_doubt, _mCurrTxns._mTransactions[i] );
+            }
+            else
+            {
+                add_txn( _mAbortTxns, _mCurrTxns._mTransactions[i] );
+
+                // The aggregates written before the crash counted its entries
+                _mHeader._mAggregates = 0;
+            }
         }
+        memcpy( &_mCurrTxns._mPage, &in_doubt._mPage, sizeof( _mCurrTxns._mPage ) );
+        drop_stale_prepared();
+        sync_header_txns();
 
         for( uint32_t i=0; i<_mHeader._mNumTreeNodes; i++ )
         {
-            _mTreeNodes[ i ] = new Tree_Node( this, i, true );
+            _mTreeNodes[ i ] = new ( _mTreePool ) Tree_Node( this, i, true );
         }
+        start_recovery();
+        _mRightmostLeaf = find_rightmost_leaf();
     }
 }
 
@@ -82,9 +139,19 @@ B_Tree::B_Tree( std::string file_name, bool reset )
  */
 B_Tree::~B_Tree()
 {
-    _mTreeFile.seekp( 0, std::ios::beg );
-    _mTreeFile.write( (char*)&_mHeader._mPage, sizeof( Header::_mPage ) );
-    _mTreeFile.sync();
+    wait_recovery();
+    if( !shadow_paging() )
+    {
+        drain_buffers();
+    }
+
+    // With shadow paging only commits publish the header, anything not yet
+    // committed is dropped
+    if( !shadow_paging() )
+    {
+        write_file( &_mHeader._mPage, sizeof( Header::_mPage ), 0 );
+        _mTreeFile.sync();
+    }
 
     for( uint32_t i=0; i<_mHeader._mNumTreeNodes; i++ )
     {
@@ -94,7 +161,9 @@ B_Tree::~B_Tree()
 }
 
 /**
- * @brief Insert key value pair into database with current transaction number
+ * @brief Insert key value pair into database with current transaction number.
+ * Keys beyond the largest key in the tree are appended straight to the
+ * rightmost leaf while it has room, without descending from the root.
  * 
  * @param k 
  * @param v 
@@ -102,13 +171,69 @@ B_Tree::~B_Tree()
  */
 void B_Tree::insert( const Key& k, const Val& v, Txn t )
 {
+    TRACE_SPAN( "b_tree_insert" );
+    Page_Table::Guard guard( _mLeafNodeMap );
+    invalidate_aggregates();
+    record_write( k, v, t );
+    if( _mWriteBuffering )
+    {
+        std::vector<KeyValTxn> msg( 1 );
+        msg[ 0 ].k = k;
+        msg[ 0 ].v = v;
+        msg[ 0 ].t = t;
+        buffer_messages( msg );
+        return;
+    }
+    apply_insert( k, v, t );
+}
+
+/**
+ * @brief Remembers a write of a transaction so it can be shipped to the
+ * commit hook, or undone in the aggregates if it aborts. Nothing is kept
+ * when there is no hook and aggregates are disabled.
+ *
+ * @param k
+ * @param v
+ * @param t
+ */
+void B_Tree::record_write( const Key& k, const Val& v, Txn t )
+{
+    if( _mCommitHook || aggregates_enabled() )
+    {
+        KeyVal kv;
+        kv.k = k;
+        kv.v = v;
+        _mTxnWrites[ t ].push_back( kv );
+    }
+}
+
+/**
+ * @brief Inserts a key value pair into the tree itself, see insert
+ *
+ * @param k
+ * @param v
+ * @param t
+ */
+void B_Tree::apply_insert( const Key& k, const Val& v, Txn t )
+{
+    _mSequentialRun = k > _mLastInsertKey ? _mSequentialRun + 1 : 0;
+    _mLastInsertKey = k;
+
+    Leaf_Node* leaf = (Leaf_Node*)unswizzle( _mRightmostLeaf );
+    if( leaf->size() && k > leaf->largest() && !leaf->full() )
+    {
+        leaf->insert( k, v, t );
+        refresh_aggregates( k );
+        return;
+    }
+
     if( _mRoot()->_mSize == Tree_Node_Order )
     {
         Node* a;
         Node* b;
 
         a = _mRoot();
-        a->split( b );
+        a->split( b, split_point( a, k ) );
 
         Tree_Node* temp_root =  new_tree_node( _mHeader._mRootId );
         sync_header_txns();
@@ -118,11 +243,414 @@ void B_Tree::insert( const Key& k, const Val& v, Txn t )
         temp_root->_mSize = 2;
 
         temp_root->_mKeys[0] = unswizzle( _mRoot()->_mChildNodes[1] )->smallest();
+        temp_root->refresh( 0 );
+        temp_root->refresh( 1 );
     }
 
     _mRoot()->insert( k, v, t );
 }
 
+/**
+ * @brief Inserts many key value pairs under one transaction. The batch is
+ * sorted and every run of keys that lands in the same leaf is applied to
+ * that leaf in one visit. No file system sync happens during the batch,
+ * node allocations only mark the header dirty and evicted leaves are written
+ * without syncing. Everything is made durable by txn_commit.
+ * 
+ * @param kvs Key value pairs, in any order. For repeated keys the last wins.
+ * With write buffering the batch is queued in the root's buffer instead.
+ * @param t 
+ */
+void B_Tree::insert_batch( const std::vector<KeyVal>& kvs, Txn t )
+{
+    TRACE_SPAN( "b_tree_insert_batch" );
+    Page_Table::Guard guard( _mLeafNodeMap );
+    std::vector<KeyVal> sorted( kvs );
+    std::stable_sort( sorted.begin(), sorted.end(), []( const KeyVal& a, const KeyVal& b ) { return a.k < b.k; } );
+
+    invalidate_aggregates();
+
+    std::vector<KeyValTxn> msgs( sorted.size() );
+    for( size_t i=0; i<sorted.size(); i++ )
+    {
+        if( i + 1 == sorted.size() || sorted[ i + 1 ].k != sorted[ i ].k )
+        {
+            record_write( sorted[ i ].k, sorted[ i ].v, t );
+        }
+        msgs[ i ].k = sorted[ i ].k;
+        msgs[ i ].v = sorted[ i ].v;
+        msgs[ i ].t = t;
+    }
+
+    if( _mWriteBuffering )
+    {
+        buffer_messages( msgs );
+    }
+    else
+    {
+        apply_batch( msgs );
+    }
+}
+
+/**
+ * @brief Applies sorted upserts to the leaves, see insert_batch
+ *
+ * @param sorted Stably sorted by key. For a key repeated by one transaction
+ * the last wins. Upserts of different transactions are never merged, each
+ * reaches the leaf log as it would without buffering.
+ */
+void B_Tree::apply_batch( const std::vector<KeyValTxn>& sorted )
+{
+    _mSyncDeferred++;
+
+    uint32_t n = sorted.size();
+    auto superseded = [&]( uint32_t j ) { return j + 1 < n && sorted[ j + 1 ].k == sorted[ j ].k && sorted[ j + 1 ].t == sorted[ j ].t; };
+    uint32_t i = 0;
+    while( i < n )
+    {
+        Key upper;
+        bool bounded;
+        Leaf_Node* leaf = find_leaf( sorted[ i ].k, upper, bounded );
+        leaf->_mInUse++;
+
+        uint32_t j = i;
+        while( j < n && ( !bounded || sorted[ j ].k < upper ) && !leaf->full() )
+        {
+            // Skip over all but the last of repeated keys
+            if( !superseded( j ) )
+            {
+                leaf->insert( sorted[ j ].k, sorted[ j ].v, sorted[ j ].t );
+            }
+            j++;
+        }
+        leaf->_mInUse--;
+        if( j != i )
+        {
+            refresh_aggregates( sorted[ i ].k );
+        }
+
+        if( j == i )
+        {
+            // Leaf has no room, the regular insert path splits it
+            if( !superseded( j ) )
+            {
+                apply_insert( sorted[ j ].k, sorted[ j ].v, sorted[ j ].t );
+            }
+            j++;
+        }
+        i = j;
+    }
+
+    _mSyncDeferred--;
+}
+
+/**
+ * @brief Turns write buffering on or off. With it on, inserts are queued
+ * as upserts in the root's buffer and move down the tree in batches as
+ * buffers fill, so each leaf is written once per batch instead of once per
+ * key. Lookups check the buffers on the way down, scans, multi_find and
+ * aggregates drain them first, and so does every flush, which keeps commits
+ * durable. Since every commit flushes, upserts only batch up within the
+ * open transactions, and the buffers never hold a committed write. As
+ * without buffering, two open transactions must not write the same key.
+ *
+ * @param on
+ */
+void B_Tree::set_write_buffering( bool on )
+{
+    if( !on )
+    {
+        drain_buffers();
+    }
+    _mWriteBuffering = on;
+}
+
+void B_Tree::buffer_messages( const std::vector<KeyValTxn>& msgs )
+{
+    Tree_Node* root = _mRoot();
+    root->_mBuffer.insert( root->_mBuffer.end(), msgs.begin(), msgs.end() );
+    if( root->_mBuffer.size() > Message_Buffer_Size )
+    {
+        root->flush_buffer();
+    }
+}
+
+/**
+ * @brief Applies every pending upsert to the leaves
+ */
+void B_Tree::drain_buffers()
+{
+    bool pending = true;
+    while( pending )
+    {
+        pending = false;
+        for( uint32_t i=0; i<_mHeader._mNumTreeNodes; i++ )
+        {
+            if( _mTreeNodes[ i ]->_mBuffer.size() )
+            {
+                _mTreeNodes[ i ]->flush_buffer();
+                pending = true;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Starts keeping per child aggregates in the tree nodes. They are
+ * rebuilt from every leaf unless the file already holds current ones, which
+ * must have been made with the same reduction. Writes made while aggregates
+ * are disabled mark the stored ones stale.
+ *
+ * @param r
+ */
+void B_Tree::enable_aggregates( const Reduction& r )
+{
+    assert( r.map && r.combine );
+    _mReduction = r;
+    _mAggregatesSince = _mHeader._mRecentTransaction;
+    if( !_mHeader._mAggregates )
+    {
+        _mRoot()->rebuild_aggregates();
+        _mHeader._mAggregates = 1;
+        sync_header_txns();
+    }
+}
+
+/**
+ * @brief Count and reduced value of the entries with lo <= key <= hi, as
+ * find sees them. Touches only the nodes on the paths to lo and hi.
+ *
+ * @param lo
+ * @param hi
+ * @return B_Tree::Aggregate
+ */
+B_Tree::Aggregate B_Tree::aggregate( const Key& lo, const Key& hi )
+{
+    assert( aggregates_enabled() );
+    Page_Table::Guard guard( _mLeafNodeMap );
+    Aggregate a = { 0, _mReduction.identity };
+    drain_buffers();
+    if( lo <= hi )
+    {
+        _mRoot()->aggregate( lo, hi, a );
+    }
+    return a;
+}
+
+void B_Tree::combine( Aggregate& a, uint32_t count, uint64_t value ) const
+{
+    a.count += count;
+    a.value = _mReduction.combine( a.value, value );
+}
+
+void B_Tree::refresh_aggregates( const Key& k )
+{
+    if( aggregates_enabled() )
+    {
+        _mRoot()->refresh_path( k );
+    }
+}
+
+/**
+ * @brief Called before a write, marks the stored aggregates stale if they
+ * are not being kept
+ */
+void B_Tree::invalidate_aggregates()
+{
+    if( _mHeader._mAggregates && !aggregates_enabled() )
+    {
+        _mHeader._mAggregates = 0;
+        sync_header_txns();
+    }
+}
+
+/**
+ * @brief Descends from the root to the leaf that k belongs in
+ * 
+ * @param k 
+ * @param upper Set to the smallest key belonging to a leaf right of the result
+ * @param bounded Set to false if the result is the rightmost leaf
+ * @return B_Tree::Leaf_Node* 
+ */
+B_Tree::Leaf_Node* B_Tree::find_leaf( const Key& k, Key& upper, bool& bounded )
+{
+    return (Leaf_Node*)unswizzle( leaf_id( k, upper, bounded ) );
+}
+
+/**
+ * @brief Id of the leaf that holds k, found through the tree nodes alone
+ * without loading the leaf. See find_leaf.
+ */
+uint32_t B_Tree::leaf_id( const Key& k, Key& upper, bool& bounded ) const
+{
+    bounded = false;
+    uint32_t id = _mHeader._mRootId;
+    while( id < Max_Num_Tree_Nodes )
+    {
+        Tree_Node* n = _mTreeNodes[ id ];
+        uint32_t idx = n->index( k );
+        if( idx != n->_mSize - 1 )
+        {
+            upper = n->_mKeys[ idx ];
+            bounded = true;
+        }
+        id = n->_mChildNodes[ idx ];
+    }
+    return id;
+}
+
+/**
+ * @brief Chooses how many entries a full node keeps when it splits ahead of
+ * inserting k. Normally the node is split in half, but during a run of
+ * ascending inserts a node receiving a key past its largest will never see
+ * a smaller key again, so it keeps all but one entry.
+ * 
+ * @param n Node about to split
+ * @param k Key being inserted
+ * @return uint32_t Number of entries left in n
+ */
+uint32_t B_Tree::split_point( Node* n, const Key& k )
+{
+    if( n->node_id() >= Max_Num_Tree_Nodes && n->size() != n->max_size() )
+    {
+        // Leaf split because its log is full of uncommitted entries, split
+        // between those entries so both halves get room in their logs
+        Leaf_Node* leaf = (Leaf_Node*)n;
+        return leaf->_mCurrent.index( ( *leaf->_mDelta )[ Log_Size / 2 ].kvt.k );
+    }
+    if( _mSequentialRun >= Sequential_Insert_Run && k > n->largest() )
+    {
+        return n->max_size() - 1;
+    }
+    return n->max_size() / 2;
+}
+
+/**
+ * @brief Follows the last child of each tree node down from the root
+ * 
+ * @return uint32_t Node id of the leaf holding the largest keys
+ */
+uint32_t B_Tree::find_rightmost_leaf()
+{
+    uint32_t id = _mHeader._mRootId;
+    while( id < Max_Num_Tree_Nodes )
+    {
+        id = _mTreeNodes[ id ]->_mChildNodes[ _mTreeNodes[ id ]->_mSize - 1 ];
+    }
+    return id;
+}
+
+/**
+ * @brief Looks up a batch of keys at once. The batch is sorted so that each
+ * node on a shared path is only descended once. Before any key is probed
+ * the leaves of the whole batch are prefetched, up to Max_Read_Aheads of
+ * them, so reads of leaves that are not resident are in flight together.
+ * The children of each tree node are prefetched again as a group before
+ * any of them are visited.
+ * 
+ * @param keys Keys to look up, in any order
+ * @param vals Resized to keys.size(), vals[i] is set if keys[i] is found
+ * @param found Resized to keys.size(), found[i] is set if keys[i] is found
+ * @return uint32_t Number of keys found
+ */
+uint32_t B_Tree::multi_find( const std::vector<Key>& keys, std::vector<Val>& vals, std::vector<bool>& found )
+{
+    TRACE_SPAN( "b_tree_multi_find" );
+    Page_Table::Guard guard( _mLeafNodeMap );
+    uint32_t n = keys.size();
+    vals.resize( n );
+    found.assign( n, false );
+    if( !n ) return 0;
+    drain_buffers();
+
+    std::vector<uint32_t> order( n );
+    for( uint32_t i=0; i<n; i++ )
+    {
+        order[ i ] = i;
+    }
+    std::sort( order.begin(), order.end(), [&]( uint32_t a, uint32_t b ) { return keys[ a ] < keys[ b ]; } );
+
+    std::vector<Key> sorted_keys( n );
+    std::vector<Val> sorted_vals( n );
+    std::vector<uint8_t> sorted_found( n, 0 );
+    for( uint32_t i=0; i<n; i++ )
+    {
+        sorted_keys[ i ] = keys[ order[ i ] ];
+    }
+
+    uint32_t num_leaves = 0;
+    for( uint32_t i=0; i<n && num_leaves<Page_IO::Max_Read_Aheads; num_leaves++ )
+    {
+        Key upper;
+        bool bounded;
+        prefetch_node( leaf_id( sorted_keys[ i ], upper, bounded ) );
+        do
+        {
+            i++;
+        } while( i < n && ( !bounded || sorted_keys[ i ] < upper ) );
+    }
+
+    _mRoot()->multi_find( sorted_keys.data(), n, sorted_vals.data(), sorted_found.data() );
+
+    uint32_t num_found = 0;
+    for( uint32_t i=0; i<n; i++ )
+    {
+        if( sorted_found[ i ] )
+        {
+            vals[ order[ i ] ] = sorted_vals[ i ];
+            found[ order[ i ] ] = true;
+            num_found++;
+        }
+    }
+    return num_found;
+}
+
+/**
+ * @brief Collects every key value pair with lo <= key <= hi, in key order
+ * 
+ * @param lo 
+ * @param hi 
+ * @param kvs Matching pairs are appended
+ */
+void B_Tree::scan( const Key& lo, const Key& hi, std::vector<KeyVal>& kvs )
+{
+    TRACE_SPAN( "b_tree_scan" );
+    Page_Table::Guard guard( _mLeafNodeMap );
+    if( lo > hi ) return;
+    drain_buffers();
+    _mRoot()->scan( lo, hi, kvs );
+}
+
+/**
+ * @brief Looks up a key as of a snapshot taken with snapshot(). Nodes are
+ * read straight from the frames the snapshot records, bypassing the nodes
+ * in memory, so uncommitted changes are never seen. Shadow paging only
+ * keeps two frames per node, so a snapshot stays readable until the next
+ * commit; check snapshot_valid() after reading.
+ * 
+ * @param s 
+ * @param k 
+ * @param v 
+ * @return true Key was found
+ */
+bool B_Tree::find( const Snapshot& s, const Key& k, Val& v )
+{
+    assert( s._mShadowPaging );
+
+    uint32_t id = s._mRootId;
+    while( id < Max_Num_Tree_Nodes )
+    {
+        Tree_Node n( this, id );
+        n._mDirty = false;
+        _mTreeFile.read( &n._mPage, sizeof( Page ), frame_offset( id, node_frame( s._mFrames, id ) ) );
+        id = n._mChildNodes[ n.index( k ) ];
+    }
+
+    Leaf_Node::Data d;
+    _mTreeFile.read( &d._mPage, sizeof( Page ), frame_offset( id, node_frame( s._mFrames, id ) ) );
+    return d.find( k, v );
+}
+
 /**
  * @brief Prints the B_Tree
  * 
@@ -130,6 +658,7 @@ void B_Tree::insert( const Key& k, const Val& v, Txn t )
 void B_Tree::print()
 {
     std::cout << "B_Tree" << std::endl;
+    Page_Table::Guard guard( _mLeafNodeMap );
     ( (Tree_Node*)unswizzle( _mHeader._mRootId ) )->print();
 }
 
@@ -150,23 +679,69 @@ B_Tree::Node* B_Tree::unswizzle( uint32_t node_id )
     }
     else
     {
-        Hash_Map<uint32_t,Leaf_Node*>::Hash_Table_Data data = _mLeafNodeMap.find( node_id );
+        // The leaf returned stays valid under the caller's guard
+        Page_Table::Guard guard( _mLeafNodeMap );
+        Page_Table::Hash_Table_Data data = _mLeafNodeMap.find( node_id );
         if( data.exists )
         {
             return data.val;
         }
         else
         {
-            Leaf_Node* n = new Leaf_Node( this, node_id, true );
+            claim_leaf( node_id );
+            Leaf_Node* n = new ( _mLeafPool ) Leaf_Node( this, node_id, true );
             n->_mInUse++;
             _mLeafNodeMap.insert( node_id, n );
-            clamp_size( 0.5F );
+            clamp_cache();
             n->_mInUse--;
             return n;
         }
     }
 }
 
+/**
+ * @brief Issues software prefetches for the page of a node. Leaf nodes that
+ * are not resident get an asynchronous read-ahead instead, so their fetch
+ * overlaps with the rest of the batch.
+ * 
+ * @param node_id Node Identification Number
+ */
+void B_Tree::prefetch_node( uint32_t node_id )
+{
+    const char* ptr;
+    if( node_id < Max_Num_Tree_Nodes )
+    {
+        ptr = (const char*)&_mTreeNodes[ node_id ]->_mPage;
+    }
+    else
+    {
+        Page_Table::Guard guard( _mLeafNodeMap );
+        Page_Table::Hash_Table_Data data = _mLeafNodeMap.find( node_id );
+        if( !data.exists )
+        {
+            read_ahead_node( node_id );
+            return;
+        }
+        ptr = (const char*)&data.val->_mCurrent._mPage;
+    }
+    for( size_t i=0; i<sizeof( Page ); i+=64 )
+    {
+        __builtin_prefetch( ptr + i );
+    }
+}
+
+/**
+ * @brief Sets how much memory resident leaves may take, at least one leaf
+ * is always kept. The page table grows to fit on its own.
+ *
+ * @param bytes
+ */
+void B_Tree::set_cache_budget( size_t bytes )
+{
+    _mLeafCacheSize = std::max<size_t>( 1, bytes / _mLeafPool._mFrameSize );
+    clamp_cache();
+}
+
 /**
  * @brief Contructs a tree node with next available ID, and returns
  * a pointer to the new node
@@ -181,7 +756,7 @@ B_Tree::Tree_Node* B_Tree::new_tree_node( uint32_t& node_id )
     node_id = _mHeader._mNumTreeNodes;
     _mHeader._mNumTreeNodes++;
     sync_header_txns();
-    _mTreeNodes[ node_id ] = new Tree_Node( this, node_id );
+    _mTreeNodes[ node_id ] = new ( _mTreePool ) Tree_Node( this, node_id );
     return _mTreeNodes[node_id];
 }
 
@@ -200,10 +775,10 @@ B_Tree::Leaf_Node* B_Tree::new_leaf_node( uint32_t& node_id )
     node_id = _mHeader._mNumLeafNodes + Max_Num_Tree_Nodes;
     _mHeader._mNumLeafNodes++;
     sync_header_txns();
-    Leaf_Node* n = new Leaf_Node( this, node_id );
+    Leaf_Node* n = new ( _mLeafPool ) Leaf_Node( this, node_id );
     n->_mInUse++;
     _mLeafNodeMap.insert( node_id, n );
-    clamp_size( 0.5F );
+    clamp_cache();
     n->_mInUse--;
     return _mLeafNodeMap.find( node_id ).val;
 }
@@ -235,66 +810,465 @@ std::ostream& operator<<( std::ostream& os, const B_Tree::Page& p )
  */
 void B_Tree::store_node( Tree_Node* n, uint32_t idx )
 {
-    _mTreeFile.seekp( Tree_Node_Offset + idx * sizeof( Tree_Node::_mPage ), std::ios::beg );
-    _mTreeFile.write( (char*)&n->_mPage, sizeof( Tree_Node::_mPage ) );
-    _mTreeFile.sync();
+    if( shadow_paging() )
+    {
+        store_frame( n->_mPage, idx );
+        return;
+    }
+    write_file( &n->_mPage, sizeof( Tree_Node::_mPage ), Tree_Node_Offset + idx * sizeof( Tree_Node::_mPage ) );
+    sync_file();
 }
 
 void B_Tree::store_node( Leaf_Node* n, uint32_t idx )
 {
+    TRACE_SPAN( "b_tree_store_leaf" );
     assert( idx >= Max_Num_Tree_Nodes );
-    if( n->_mDataModified )
+
+    Leaf_Node::Data stored;
+    n->stored( stored );
+    if( shadow_paging() )
     {
-        _mTreeFile.seekp( Leaf_Node_Offset + ( idx - Max_Num_Tree_Nodes ) * ( sizeof( Leaf_Node::_mStored ) + sizeof( Leaf_Node::_mLog ) ), std::ios::beg );
-        _mTreeFile.write( (char*)&n->_mStored, sizeof( Leaf_Node::_mStored ) );
-        _mTreeFile.write( (char*)&n->_mLog, sizeof( Leaf_Node::_mLog ) );
+        store_frame( stored._mPage, idx );
+        return;
     }
-    else
+
+    Leaf_Node::Log log;
+    n->log( log );
+    if( n->_mDataModified )
     {
-        _mTreeFile.seekp( Leaf_Node_Offset + ( idx - Max_Num_Tree_Nodes ) * ( sizeof( Leaf_Node::_mStored ) + sizeof( Leaf_Node::_mLog ) ) + sizeof( Leaf_Node::_mStored ), std::ios::beg );
-        _mTreeFile.write( (char*)&n->_mLog, sizeof( Leaf_Node::_mLog ) );
+        write_file( &stored, sizeof( stored ), leaf_node_offset( idx ) );
     }
+    write_file( &log, sizeof( log ), leaf_node_offset( idx ) + sizeof( Page ) );
 
-    _mTreeFile.sync();
+    sync_file();
 }
 
 void B_Tree::fetch_node( Tree_Node* n, uint32_t idx )
 {
-    _mTreeFile.seekg( Tree_Node_Offset + idx * sizeof( Tree_Node::_mPage ), std::ios::beg );
-    _mTreeFile.read( (char*)&n->_mPage, sizeof( Tree_Node::_mPage ) );
+    if( shadow_paging() )
+    {
+        _mTreeFile.read( &n->_mPage, sizeof( Page ), frame_offset( idx, read_frame( idx ) ) );
+        return;
+    }
+    _mTreeFile.read( &n->_mPage, sizeof( Tree_Node::_mPage ), Tree_Node_Offset + idx * sizeof( Tree_Node::_mPage ) );
 }
 
-void B_Tree::fetch_node( Leaf_Node* n, uint32_t idx )
+void B_Tree::fetch_node( Leaf_Node::Data& stored, Leaf_Node::Log& log, uint32_t idx )
 {
+    TRACE_SPAN( "b_tree_fetch_leaf" );
     assert( idx >= Max_Num_Tree_Nodes );
-    _mTreeFile.seekg( Leaf_Node_Offset + ( idx - Max_Num_Tree_Nodes ) * ( sizeof( Leaf_Node::_mStored ) + sizeof( Leaf_Node::_mLog ) ), std::ios::beg );
-    _mTreeFile.read( (char*)&n->_mStored, sizeof( Leaf_Node::_mStored ) );
-    _mTreeFile.read( (char*)&n->_mLog, sizeof( Leaf_Node::_mLog ) );
+    if( shadow_paging() )
+    {
+        // The frame holds only committed data, the log stays empty
+        _mTreeFile.read( &stored, sizeof( Page ), frame_offset( idx, read_frame( idx ) ) );
+        return;
+    }
+    _mTreeFile.read( &stored, sizeof( stored ), leaf_node_offset( idx ) );
+    _mTreeFile.read( &log, sizeof( log ), leaf_node_offset( idx ) + sizeof( Page ) );
+}
+
+/**
+ * @brief Starts an asynchronous read of a leaf node that is not resident, so
+ * a later fetch_node is served without blocking on the file system. Tree
+ * nodes are always resident.
+ * 
+ * @param node_id Node Identification Number
+ */
+void B_Tree::read_ahead_node( uint32_t node_id )
+{
+    if( node_id < Max_Num_Tree_Nodes ) return;
+    if( _mLeafNodeMap.find( node_id ).exists ) return;
+    // Recovery may still rewrite the pages
+    if( _mLeafRecovery[ node_id - Max_Num_Tree_Nodes ] != Recovery_Done ) return;
+    _mTreeFile.read_ahead( leaf_node_offset( node_id ), 2 * sizeof( Page ) );
 }
 
 void B_Tree::sync_header_txns()
 {
-    _mTreeFile.seekp( 0, std::ios::beg );
-    _mTreeFile.write( (char*)&_mHeader._mPage, sizeof( Header::_mPage ) );
+    // Under shadow paging the header is only ever written by publish(), and
+    // in-flight transactions never reach the published frames
+    if( shadow_paging() ) return;
+
+    if( _mSyncDeferred )
+    {
+        _mHeaderDirty = true;
+        return;
+    }
+    _mHeaderDirty = false;
+
+    write_file( &_mHeader._mPage, sizeof( Header::_mPage ), 0 );
+    write_file( &_mCurrTxns._mPage, sizeof( Transactions::_mPage ), Curr_Txns_Offset );
+    write_file( &_mAbortTxns._mPage, sizeof( Transactions::_mPage ), Abort_Txns_Offset );
+
+    _mTreeFile.sync();
+}
+
+/**
+ * @brief Resolves the logs of all leaves in the background after an open.
+ * Entries of committed transactions are folded into the stored data and
+ * entries of aborted ones are dropped. Leaves are split into contiguous
+ * ranges, one per thread. Each range is read with one request and its
+ * rewritten pages go out as one batch, and the requests of all threads are
+ * in flight together. The tree can be used meanwhile, a leaf it needs is
+ * either left to the lazy path of Leaf_Node::load or waited for if its
+ * recovery is running.
+ */
+void B_Tree::start_recovery()
+{
+    if( shadow_paging() || !_mHeader._mNumLeafNodes ) return;
+
+    std::vector<Txn> aborted( _mAbortTxns._mTransactions, _mAbortTxns._mTransactions + _mAbortTxns._mNumTransactions );
+    std::vector<Txn> current( _mCurrTxns._mTransactions, _mCurrTxns._mTransactions + _mCurrTxns._mNumTransactions );
+    std::sort( aborted.begin(), aborted.end() );
+    std::sort( current.begin(), current.end() );
+
+    uint32_t num_leaves = _mHeader._mNumLeafNodes;
+    for( uint32_t i=0; i<num_leaves; i++ )
+    {
+        _mLeafRecovery[ i ] = Recovery_Pending;
+    }
+
+    uint32_t num_threads = num_leaves < Num_Recovery_Threads ? num_leaves : Num_Recovery_Threads;
+    for( uint32_t i=0; i<num_threads; i++ )
+    {
+        uint32_t first = Max_Num_Tree_Nodes + num_leaves * i / num_threads;
+        uint32_t last = Max_Num_Tree_Nodes + num_leaves * ( i + 1 ) / num_threads;
+        _mRecoveryThreads.push_back( std::thread( &B_Tree::recover_leaves, this, first, last, aborted, current ) );
+    }
+}
+
+/**
+ * @brief Recovers the leaves with ids in [first, last). Transactions that
+ * were current at the open are left alone, they may still commit or abort.
+ *
+ * @param first
+ * @param last
+ * @param aborted Sorted aborted transactions
+ * @param current Sorted current transactions
+ */
+void B_Tree::recover_leaves( uint32_t first, uint32_t last, const std::vector<Txn>& aborted, const std::vector<Txn>& current )
+{
+    uint32_t n = last - first;
+    std::vector<Page> pages( 2 * n );
+    _mTreeFile.read( pages.data(), pages.size() * sizeof( Page ), leaf_node_offset( first ) );
+
+    std::vector<uint32_t> changed;
+    for( uint32_t i=0; i<n; i++ )
+    {
+        uint8_t state = Recovery_Pending;
+        if( !_mLeafRecovery[ first + i - Max_Num_Tree_Nodes ].compare_exchange_strong( state, Recovery_Running ) )
+        {
+            // Already loaded by the tree
+            continue;
+        }
+
+        Leaf_Node::Data& stored = (Leaf_Node::Data&)pages[ 2 * i ];
+        Leaf_Node::Log& log = (Leaf_Node::Log&)pages[ 2 * i + 1 ];
+
+        uint32_t kept = 0;
+        for( uint32_t j=0; j<log._mSize; j++ )
+        {
+            const KeyValTxn& kvt = log._mKVTs[ j ];
+            if( std::binary_search( current.begin(), current.end(), kvt.t ) )
+            {
+                log._mKVTs[ kept++ ] = kvt;
+            }
+            else if( !std::binary_search( aborted.begin(), aborted.end(), kvt.t ) )
+            {
+                Val old;
+                if( stored.find( kvt.k, old ) )
+                {
+                    stored._mKVs[ stored.index( kvt.k ) ].v = kvt.v;
+                }
+                else
+                {
+                    stored.insert( kvt.k, kvt.v );
+                }
+            }
+        }
+
+        if( kept == log._mSize )
+        {
+            _mLeafRecovery[ first + i - Max_Num_Tree_Nodes ] = Recovery_Done;
+            continue;
+        }
+        memset( &log._mKVTs[ kept ], 0, ( log._mSize - kept ) * sizeof( KeyValTxn ) );
+        log._mSize = kept;
+        changed.push_back( i );
+    }
+
+    // Data first, so a crash before the logs are written only repeats work
+    std::vector<Page_IO::Write> data( changed.size() ), logs( changed.size() );
+    for( size_t i=0; i<changed.size(); i++ )
+    {
+        data[ i ].buf = &pages[ 2 * changed[ i ] ];
+        data[ i ].len = sizeof( Page );
+        data[ i ].off = leaf_node_offset( first + changed[ i ] );
+        logs[ i ].buf = &pages[ 2 * changed[ i ] + 1 ];
+        logs[ i ].len = sizeof( Page );
+        logs[ i ].off = data[ i ].off + sizeof( Page );
+    }
+    if( changed.size() )
+    {
+        write_file( data );
+        _mTreeFile.sync();
+        write_file( logs );
+        _mTreeFile.sync();
+    }
+
+    for( size_t i=0; i<changed.size(); i++ )
+    {
+        _mLeafRecovery[ first + changed[ i ] - Max_Num_Tree_Nodes ] = Recovery_Done;
+    }
+    _mRecoveredLeaves += changed.size();
+}
+
+/**
+ * @brief Takes a leaf over from recovery before it is loaded, waiting if its
+ * recovery is running
+ *
+ * @param node_id
+ */
+void B_Tree::claim_leaf( uint32_t node_id )
+{
+    std::atomic<uint8_t>& state = _mLeafRecovery[ node_id - Max_Num_Tree_Nodes ];
+    uint8_t pending = Recovery_Pending;
+    if( state.compare_exchange_strong( pending, Recovery_Done ) ) return;
+    while( state != Recovery_Done )
+    {
+        std::this_thread::yield();
+    }
+}
+
+void B_Tree::wait_recovery()
+{
+    for( size_t i=0; i<_mRecoveryThreads.size(); i++ )
+    {
+        _mRecoveryThreads[ i ].join();
+    }
+    _mRecoveryThreads.clear();
+}
+
+/**
+ * @brief Writes to the tree file. A running backup first saves the pages
+ * about to be overwritten. Inside flush() the page is only copied into the
+ * pending batch.
+ *
+ * @param buf
+ * @param len
+ * @param off
+ */
+void B_Tree::write_file( const void* buf, size_t len, std::streamoff off )
+{
+    if( _mBackup )
+    {
+        _mBackup->before_write( off, len );
+    }
+    if( _mBatchingWrites )
+    {
+        assert( len == sizeof( Page ) );
+        _mBatchPages.emplace_back();
+        memcpy( &_mBatchPages.back(), buf, len );
+        Page_IO::Write w;
+        w.buf = &_mBatchPages.back();
+        w.len = len;
+        w.off = off;
+        _mWriteBatch.push_back( w );
+        return;
+    }
+    _mTreeFile.write( buf, len, off );
+}
+
+/**
+ * @brief Writes a batch to the tree file, all of it in flight at once.
+ * Never gathered into the flush() batch, so recovery threads may call it
+ * while the tree flushes.
+ *
+ * @param writes
+ */
+void B_Tree::write_file( const std::vector<Page_IO::Write>& writes )
+{
+    if( _mBackup )
+    {
+        for( size_t i=0; i<writes.size(); i++ )
+        {
+            _mBackup->before_write( writes[ i ].off, writes[ i ].len );
+        }
+    }
+    _mTreeFile.write( writes );
+}
+
+/**
+ * @brief Syncs the file system, unless syncs are being deferred until the
+ * next flush
+ */
+void B_Tree::sync_file()
+{
+    if( !_mSyncDeferred )
+    {
+        _mTreeFile.sync();
+    }
+}
+
+/**
+ * @brief Writes every dirty tree node and dirty resident leaf node, plus the
+ * header if it is dirty, and makes them all durable with a single sync
+ */
+void B_Tree::flush()
+{
+    TRACE_SPAN( "b_tree_flush" );
+    drain_buffers();
+    _mSyncDeferred++;
+    _mBatchingWrites = true;
+    for( uint32_t i=0; i<_mHeader._mNumTreeNodes; i++ )
+    {
+        if( _mTreeNodes[ i ]->_mDirty )
+        {
+            _mTreeNodes[ i ]->persist();
+        }
+    }
+    for( uint32_t i=0; i<_mLeafNodeMap.num_slots(); i++ )
+    {
+        Page_Table::Hash_Table_Data dat = _mLeafNodeMap.slot( i );
+        if( dat.exists && dat.val->_mDirty )
+        {
+            dat.val->persist();
+        }
+    }
+    _mBatchingWrites = false;
+    _mTreeFile.write( _mWriteBatch );
+    _mWriteBatch.clear();
+    _mBatchPages.clear();
+    _mSyncDeferred--;
+
+    if( shadow_paging() )
+    {
+        publish();
+    }
+    else if( _mHeaderDirty )
+    {
+        sync_header_txns();
+    }
+    else
+    {
+        sync_file();
+    }
+}
+
+/**
+ * @brief Location of one of the two frames of a node under shadow paging
+ * 
+ * @param node_id 
+ * @param frame 
+ * @return std::streamoff 
+ */
+std::streamoff B_Tree::frame_offset( uint32_t node_id, bool frame ) const
+{
+    if( node_id < Max_Num_Tree_Nodes )
+    {
+        return ( frame ? Tree_Shadow_Offset : Tree_Node_Offset ) + node_id * sizeof( Page );
+    }
+    return leaf_node_offset( node_id ) + ( frame ? sizeof( Page ) : 0 );
+}
 
-    _mTreeFile.seekp( Curr_Txns_Offset, std::ios::beg );
-    _mTreeFile.write( (char*)&_mCurrTxns._mPage, sizeof( Transactions::_mPage ) );
+/**
+ * @brief Writes a node to the frame that the published header does not
+ * reference, and marks it to be switched over at the next publish()
+ * 
+ * @param p 
+ * @param node_id 
+ */
+void B_Tree::store_frame( const Page& p, uint32_t node_id )
+{
+    bool frame = !node_frame( _mHeader._mFrames, node_id );
+    write_file( &p, sizeof( Page ), frame_offset( node_id, frame ) );
+    _mPendingFrames[ node_id / 8 ] |= 1 << ( node_id % 8 );
+}
+
+/**
+ * @brief Atomically switches the database over to every frame written since
+ * the last publish, by syncing those frames and then writing the header
+ * page, which records the root and the live frame of every node.
+ */
+void B_Tree::publish()
+{
+    _mTreeFile.sync();
 
-    _mTreeFile.seekp( Abort_Txns_Offset, std::ios::beg );
-    _mTreeFile.write( (char*)&_mAbortTxns._mPage, sizeof( Transactions::_mPage ) );
+    for( uint32_t i=0; i<Frame_Bitmap_Size; i++ )
+    {
+        _mHeader._mFrames[ i ] ^= _mPendingFrames[ i ];
+    }
+    memset( _mPendingFrames, 0, sizeof( _mPendingFrames ) );
+    _mHeader._mCommitSeq++;
 
+    write_file( &_mHeader._mPage, sizeof( Header::_mPage ), 0 );
     _mTreeFile.sync();
+    memcpy( &_mPublishedHeader._mPage, &_mHeader._mPage, sizeof( Header::_mPage ) );
 }
 
-void B_Tree::clamp_size( float f )
+/**
+ * @brief Discards everything since the last publish() under shadow paging.
+ * Resident leaf nodes are dropped without being written and tree nodes are
+ * reread from their published frames. The transaction lists are kept.
+ */
+void B_Tree::rollback()
 {
-    assert( f > 0.0F && f < 1.0F );
-    while( static_cast<float>( _mLeafNodeMap._mCurrSize ) / static_cast<float>( _mLeafNodeMap._mTableSize ) > f )
+    for( uint32_t i=0; i<_mLeafNodeMap.num_slots(); i++ )
     {
-        uint32_t i = rand() % _mLeafNodeMap._mTableSize;
-        Hash_Map<uint32_t,Leaf_Node*>::Hash_Table_Data dat = _mLeafNodeMap._mMapTable[ i ];
-        if( dat.exists && !_mLeafNodeMap._mMapTable[ i ].val->_mInUse )
+        Page_Table::Hash_Table_Data dat = _mLeafNodeMap.slot( i );
+        if( dat.exists )
         {
+            dat.val->_mDirty = false;
+            delete dat.val;
+        }
+    }
+    _mLeafNodeMap.clear();
+
+    for( uint32_t i=_mPublishedHeader._mNumTreeNodes; i<_mHeader._mNumTreeNodes; i++ )
+    {
+        _mTreeNodes[ i ]->_mDirty = false;
+        delete _mTreeNodes[ i ];
+    }
+
+    // Transaction ids keep counting, an aborted id stays on the abort list
+    // and must never be handed out again
+    Txn recent = _mHeader._mRecentTransaction;
+    memset( _mPendingFrames, 0, sizeof( _mPendingFrames ) );
+    memcpy( &_mHeader._mPage, &_mPublishedHeader._mPage, sizeof( Header::_mPage ) );
+    _mHeader._mRecentTransaction = recent;
+
+    for( uint32_t i=0; i<_mHeader._mNumTreeNodes; i++ )
+    {
+        fetch_node( _mTreeNodes[ i ], i );
+        _mTreeNodes[ i ]->_mBuffer.clear();
+    }
+    _mRightmostLeaf = find_rightmost_leaf();
+
+    if( aggregates_enabled() && !_mHeader._mAggregates )
+    {
+        _mRoot()->rebuild_aggregates();
+        _mHeader._mAggregates = 1;
+    }
+}
+
+/**
+ * @brief Evicts random leaves that are not in use until the cache holds no
+ * more than _mLeafCacheSize of them
+ */
+void B_Tree::clamp_cache()
+{
+    while( _mLeafNodeMap._mCurrSize > _mLeafCacheSize )
+    {
+        uint32_t i = rand() % _mLeafNodeMap.num_slots();
+        Page_Table::Hash_Table_Data dat = _mLeafNodeMap.slot( i );
+        if( dat.exists && !dat.val->_mInUse )
+        {
+            // Written back before it leaves the page table, a reader may keep
+            // the retired copy alive past a reload of the page
+            if( dat.val->_mDirty )
+            {
+                dat.val->persist();
+            }
             _mLeafNodeMap.remove( dat.key );
         }
     }
@@ -306,9 +1280,7 @@ void B_Tree::remove_txn( Transactions& txns, Txn t )
     {
         if( txns._mTransactions[ i ] == t )
         {
-            Txn* txns_ptr = new Txn[ txns._mNumTransactions - i - 1 ];
-            memcpy( txns_ptr, &txns._mTransactions[ i + 1 ], ( txns._mNumTransactions - i - 1 ) * sizeof( Txn ) );
-            memcpy( &txns._mTransactions[ i ], txns_ptr, ( txns._mNumTransactions - i - 1 ) * sizeof( Txn ) );
+            memmove( &txns._mTransactions[ i ], &txns._mTransactions[ i + 1 ], ( txns._mNumTransactions - i - 1 ) * sizeof( Txn ) );
             txns._mNumTransactions--;
             break;
         }
@@ -324,23 +1296,169 @@ void B_Tree::add_txn( Transactions& txns, Txn t )
 
 B_Tree::Txn B_Tree::new_txn()
 {
+    // Shadow paging publishes whole trees, so it has a single writer
+    assert( !shadow_paging() || !_mCurrTxns._mNumTransactions );
     _mHeader._mRecentTransaction++;
     add_txn( _mCurrTxns, _mHeader._mRecentTransaction );
     sync_header_txns();
     return _mHeader._mRecentTransaction;
 }
 
+/**
+ * @brief First phase of a two-phase commit. Makes the entries of the
+ * transaction durable and records it as prepared under the coordinator's
+ * global id, after which it survives a crash as current until the
+ * coordinator commits or aborts it. Needs the per leaf logs to undo, so is
+ * not available with shadow paging.
+ *
+ * @param t
+ * @param gtid Global transaction id assigned by the coordinator
+ * @return true Prepared, false if there is no room to record it
+ */
+bool B_Tree::txn_prepare( Txn t, uint32_t gtid )
+{
+    assert( !shadow_paging() );
+    assert( txn_state( t ) == TxnState_Current );
+
+    drop_stale_prepared();
+    if( _mHeader._mNumPrepared == Max_Prepared_Txns )
+    {
+        return false;
+    }
+
+    flush();
+    _mHeader._mPrepared[ _mHeader._mNumPrepared ].t = t;
+    _mHeader._mPrepared[ _mHeader._mNumPrepared ].gtid = gtid;
+    _mHeader._mNumPrepared++;
+    sync_header_txns();
+    return true;
+}
+
+/**
+ * @brief Lists the prepared transactions that are still in doubt
+ *
+ * @param prepared
+ */
+void B_Tree::prepared_txns( std::vector<Prepared>& prepared )
+{
+    drop_stale_prepared();
+    prepared.assign( _mHeader._mPrepared, _mHeader._mPrepared + _mHeader._mNumPrepared );
+}
+
+bool B_Tree::is_prepared( Txn t ) const
+{
+    for( uint32_t i=0; i<_mHeader._mNumPrepared; i++ )
+    {
+        if( _mHeader._mPrepared[ i ].t == t )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Forgets prepared entries of transactions that have finished. Commit
+ * and abort leave the entry behind, so ending a transaction only ever
+ * depends on the transaction pages.
+ */
+void B_Tree::drop_stale_prepared()
+{
+    uint32_t n = 0;
+    for( uint32_t i=0; i<_mHeader._mNumPrepared; i++ )
+    {
+        if( txn_state( _mHeader._mPrepared[ i ].t ) == TxnState_Current )
+        {
+            _mHeader._mPrepared[ n++ ] = _mHeader._mPrepared[ i ];
+        }
+    }
+    _mHeader._mNumPrepared = n;
+}
+
 void B_Tree::txn_commit( Txn t )
 {
+    TRACE_SPAN( "b_tree_txn_commit" );
+    if( _mCommitHook )
+    {
+        _mHeader._mReplicationSeq++;
+    }
+
+    // Entries of the transaction must be durable before the commit is
+    // recorded in the transaction pages
+    flush();
     remove_txn( _mCurrTxns, t );
     sync_header_txns();
+
+    if( _mCommitHook )
+    {
+        std::vector<KeyVal> writes;
+        std::map<Txn, std::vector<KeyVal>>::iterator it = _mTxnWrites.find( t );
+        if( it != _mTxnWrites.end() )
+        {
+            writes.swap( it->second );
+            _mTxnWrites.erase( it );
+        }
+        _mCommitHook( _mHeader._mReplicationSeq, writes );
+    }
+    else
+    {
+        _mTxnWrites.erase( t );
+    }
 }
 
 void B_Tree::txn_abort( Txn t )
 {
+    TRACE_SPAN( "b_tree_txn_abort" );
+    invalidate_aggregates();
     remove_txn( _mCurrTxns, t );
     add_txn( _mAbortTxns, t );
     sync_header_txns();
+    std::vector<KeyVal> writes;
+    std::map<Txn, std::vector<KeyVal>>::iterator it = _mTxnWrites.find( t );
+    if( it != _mTxnWrites.end() )
+    {
+        writes.swap( it->second );
+        _mTxnWrites.erase( it );
+    }
+
+    // Pending upserts of the transaction never reached a leaf
+    for( uint32_t i=0; i<_mHeader._mNumTreeNodes; i++ )
+    {
+        std::vector<KeyValTxn>& buffer = _mTreeNodes[ i ]->_mBuffer;
+        buffer.erase( std::remove_if( buffer.begin(), buffer.end(), [t]( const KeyValTxn& m ) { return m.t == t; } ), buffer.end() );
+    }
+
+    if( shadow_paging() )
+    {
+        rollback();
+        return;
+    }
+
+    // Undo the transaction in resident leaves, others drop it when loaded
+    for( uint32_t i=0; i<_mLeafNodeMap.num_slots(); i++ )
+    {
+        Page_Table::Hash_Table_Data dat = _mLeafNodeMap.slot( i );
+        if( dat.exists && dat.val->log_size() )
+        {
+            dat.val->_mDirty = true;
+            dat.val->shorten_log();
+        }
+    }
+
+    // Leaves the transaction wrote are loaded if they were evicted, which
+    // drops its entries, and their paths refreshed. Writes from before the
+    // aggregates were enabled are unknown.
+    if( aggregates_enabled() )
+    {
+        if( t <= _mAggregatesSince )
+        {
+            _mRoot()->rebuild_aggregates();
+        }
+        for( size_t i=0; i<writes.size(); i++ )
+        {
+            refresh_aggregates( writes[ i ].k );
+        }
+    }
 }
 
 B_Tree::TxnState B_Tree::txn_state( Txn t )
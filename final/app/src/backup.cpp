@@ -0,0 +1,134 @@
+#include "distr_log_db/backup.hpp"
+
+#include <cassert>
+
+constexpr uint32_t Backup::Chunk_Pages;
+
+/**
+ * @brief Takes the checkpoint and starts tracking writes to the tree
+ *
+ * @param _aTree
+ * @param file_name Backup file, overwritten
+ */
+Backup::Backup( B_Tree& _aTree, const std::string& file_name )
+    : _mTree( _aTree ),
+      _mNumCopied( 0 ),
+      _mNextPage( 0 )
+{
+    assert( !_mTree._mBackup );
+    assert( !_mTree._mSyncDeferred );
+    _mTree.wait_recovery();
+
+    // With shadow paging the file already holds the last commit, flushing
+    // would publish uncommitted changes
+    if( !_mTree.shadow_paging() )
+    {
+        _mTree.flush();
+        _mTree.sync_header_txns();
+    }
+
+    bool opened = _mFile.open( file_name );
+    assert( opened );
+    (void)opened;
+
+    off_t size = _mTree._mTreeFile.size();
+    _mFile.resize( 0 );
+    _mFile.resize( size );
+
+    _mNumPages = size / sizeof( B_Tree::Page );
+    _mCopied.assign( _mNumPages, false );
+    _mTree._mBackup = this;
+}
+
+/**
+ * @brief Finishes the copy if it is not done yet and stops tracking writes
+ */
+Backup::~Backup()
+{
+    run();
+    _mFile.sync();
+    _mTree._mBackup = nullptr;
+}
+
+/**
+ * @brief Copies the next chunk of pages
+ *
+ * @return true More pages are left, false once the copy is complete
+ */
+bool Backup::step()
+{
+    std::lock_guard<std::mutex> lock( _mMutex );
+    if( _mNextPage >= _mNumPages ) return false;
+
+    uint32_t count = std::min( Chunk_Pages, _mNumPages - _mNextPage );
+    copy_pages( _mNextPage, count );
+    _mNextPage += count;
+    return _mNextPage < _mNumPages;
+}
+
+void Backup::run()
+{
+    while( step() );
+}
+
+bool Backup::done()
+{
+    std::lock_guard<std::mutex> lock( _mMutex );
+    return _mNumCopied == _mNumPages;
+}
+
+uint32_t Backup::pages_copied()
+{
+    std::lock_guard<std::mutex> lock( _mMutex );
+    return _mNumCopied;
+}
+
+/**
+ * @brief Called by the tree before it writes, saves the checkpoint image of
+ * pages in the range that were not copied yet
+ *
+ * @param off
+ * @param len
+ */
+void Backup::before_write( std::streamoff off, size_t len )
+{
+    if( !len ) return;
+
+    std::lock_guard<std::mutex> lock( _mMutex );
+    uint32_t first = off / sizeof( B_Tree::Page );
+    uint32_t last = ( off + len - 1 ) / sizeof( B_Tree::Page );
+    if( first >= _mNumPages ) return;
+    last = std::min( last, _mNumPages - 1 );
+
+    copy_pages( first, last - first + 1 );
+}
+
+/**
+ * @brief Copies the pages of a range that were not copied yet, reading the
+ * whole range at once. Called with the mutex held.
+ */
+void Backup::copy_pages( uint32_t first, uint32_t count )
+{
+    uint32_t i = 0;
+    while( i < count && _mCopied[ first + i ] ) i++;
+    if( i == count ) return;
+
+    std::vector<B_Tree::Page> pages( count );
+    _mTree._mTreeFile.read( pages.data(), count * sizeof( B_Tree::Page ), (off_t)first * sizeof( B_Tree::Page ) );
+
+    // Write each run of pages not copied yet with one request
+    while( i < count )
+    {
+        uint32_t j = i;
+        while( j < count && !_mCopied[ first + j ] )
+        {
+            _mCopied[ first + j ] = true;
+            j++;
+        }
+        _mFile.write( &pages[ i ], ( j - i ) * sizeof( B_Tree::Page ), (off_t)( first + i ) * sizeof( B_Tree::Page ) );
+        _mNumCopied += j - i;
+
+        while( j < count && _mCopied[ first + j ] ) j++;
+        i = j;
+    }
+}
@@ -0,0 +1,170 @@
+#include "distr_log_db/client.hpp"
+
+
+bool Client::connect( const std::string& address )
+{
+    _mSocket = Socket::connect( address );
+    _mOut.clear();
+    return _mSocket.valid();
+}
+
+/**
+ * @brief Queues a request, nothing is written until flush or receive
+ *
+ * @return uint32_t Request id, echoed in the response
+ */
+uint32_t Client::send( uint8_t op, B_Tree::Txn txn, B_Tree::Key k, B_Tree::Key hi, const B_Tree::Val* v )
+{
+    Protocol::Request req = Protocol::Request();
+    req.id = _mNextId++;
+    req.op = op;
+    req.txn = txn;
+    req.k = k;
+    req.hi = hi;
+    if( v )
+    {
+        req.v = *v;
+    }
+    _mOut.append( (const char*)&req, sizeof( req ) );
+    return req.id;
+}
+
+bool Client::flush()
+{
+    bool ok = _mOut.empty() || _mSocket.write_all( _mOut.data(), _mOut.size() );
+    _mOut.clear();
+    return ok;
+}
+
+/**
+ * @brief Reads the next response, flushing queued requests first
+ *
+ * @param r
+ * @param kvs Replaced with the pairs that came with the response
+ * @return true Read, false if the connection failed. A response claiming
+ * more than Protocol::Max_Count pairs closes the connection.
+ */
+bool Client::receive( Protocol::Response& r, std::vector<B_Tree::KeyVal>& kvs )
+{
+    if( !flush() || !_mSocket.read_all( &r, sizeof( r ) ) ) return false;
+    if( r.count > Protocol::Max_Count )
+    {
+        _mSocket.close();
+        return false;
+    }
+    kvs.resize( r.count );
+    return kvs.empty() || _mSocket.read_all( kvs.data(), kvs.size() * sizeof( B_Tree::KeyVal ) );
+}
+
+uint8_t Client::call( uint8_t op, B_Tree::Txn txn, B_Tree::Key k, B_Tree::Key hi, const B_Tree::Val* v,
+                      Protocol::Response& r, std::vector<B_Tree::KeyVal>& kvs )
+{
+    send( op, txn, k, hi, v );
+    if( !receive( r, kvs ) ) return Protocol::Status_Error;
+    return r.status;
+}
+
+uint8_t Client::get( const B_Tree::Key& k, B_Tree::Val& v )
+{
+    Protocol::Response r;
+    std::vector<B_Tree::KeyVal> kvs;
+    uint8_t status = call( Protocol::Op_Get, 0, k, 0, nullptr, r, kvs );
+    if( status == Protocol::Status_Ok )
+    {
+        v = kvs[ 0 ].v;
+    }
+    return status;
+}
+
+uint8_t Client::put( const B_Tree::Key& k, const B_Tree::Val& v, B_Tree::Txn txn )
+{
+    Protocol::Response r;
+    std::vector<B_Tree::KeyVal> kvs;
+    return call( Protocol::Op_Put, txn, k, 0, &v, r, kvs );
+}
+
+uint8_t Client::scan( const B_Tree::Key& lo, const B_Tree::Key& hi, std::vector<B_Tree::KeyVal>& kvs )
+{
+    Protocol::Response r;
+    return call( Protocol::Op_Scan, 0, lo, hi, nullptr, r, kvs );
+}
+
+/**
+ * @brief Starts a transaction
+ *
+ * @return B_Tree::Txn Transaction, 0 if the server has no room for another
+ */
+B_Tree::Txn Client::begin()
+{
+    Protocol::Response r;
+    std::vector<B_Tree::KeyVal> kvs;
+    if( call( Protocol::Op_Begin, 0, 0, 0, nullptr, r, kvs ) != Protocol::Status_Ok ) return 0;
+    return r.txn;
+}
+
+uint8_t Client::commit( B_Tree::Txn txn )
+{
+    Protocol::Response r;
+    std::vector<B_Tree::KeyVal> kvs;
+    return call( Protocol::Op_Commit, txn, 0, 0, nullptr, r, kvs );
+}
+
+uint8_t Client::abort( B_Tree::Txn txn )
+{
+    Protocol::Response r;
+    std::vector<B_Tree::KeyVal> kvs;
+    return call( Protocol::Op_Abort, txn, 0, 0, nullptr, r, kvs );
+}
+
+/**
+ * @brief Sends all gets before reading any response, so the server can
+ * answer them with one multi_find
+ *
+ * @return uint32_t Number of keys found
+ */
+uint32_t Client::multi_get( const std::vector<B_Tree::Key>& keys, std::vector<B_Tree::Val>& vals, std::vector<bool>& found )
+{
+    for( size_t i=0; i<keys.size(); i++ )
+    {
+        send( Protocol::Op_Get, 0, keys[ i ] );
+    }
+
+    vals.resize( keys.size() );
+    found.assign( keys.size(), false );
+    uint32_t num_found = 0;
+    Protocol::Response r;
+    std::vector<B_Tree::KeyVal> kvs;
+    for( size_t i=0; i<keys.size() && receive( r, kvs ); i++ )
+    {
+        if( r.status == Protocol::Status_Ok )
+        {
+            vals[ i ] = kvs[ 0 ].v;
+            found[ i ] = true;
+            num_found++;
+        }
+    }
+    return num_found;
+}
+
+/**
+ * @brief Sends all puts before reading any response. Without a transaction
+ * the server commits puts that arrive together as one group.
+ *
+ * @return uint32_t Number of puts that succeeded
+ */
+uint32_t Client::put_batch( const std::vector<B_Tree::KeyVal>& kvs, B_Tree::Txn txn )
+{
+    for( size_t i=0; i<kvs.size(); i++ )
+    {
+        send( Protocol::Op_Put, txn, kvs[ i ].k, 0, &kvs[ i ].v );
+    }
+
+    uint32_t num_ok = 0;
+    Protocol::Response r;
+    std::vector<B_Tree::KeyVal> unused;
+    for( size_t i=0; i<kvs.size() && receive( r, unused ); i++ )
+    {
+        num_ok += r.status == Protocol::Status_Ok;
+    }
+    return num_ok;
+}
@@ -0,0 +1,230 @@
+#include "distr_log_db/coordinator.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <set>
+
+/**
+ * @brief Opens the coordinator's log and resolves in-doubt transactions
+ *
+ * @param _aShards
+ * @param log_name
+ */
+Txn_Coordinator::Txn_Coordinator( Sharded_B_Tree& _aShards, const std::string& log_name )
+    : _mShards( _aShards ),
+      _mNextGtid( 1 )
+{
+    bool opened = _mLog.open( log_name );
+    assert( opened );
+    (void)opened;
+
+    recover();
+}
+
+/**
+ * @brief Starts a global transaction
+ *
+ * @return uint32_t Global transaction id
+ */
+uint32_t Txn_Coordinator::begin()
+{
+    std::lock_guard<std::mutex> lock( _mMutex );
+    uint32_t gtid = _mNextGtid++;
+    _mOpen[ gtid ];
+    return gtid;
+}
+
+/**
+ * @brief Adds a write to a global transaction, shards see it at commit
+ *
+ * @param gtid
+ * @param k
+ * @param v
+ */
+void Txn_Coordinator::insert( uint32_t gtid, const Key& k, const Val& v )
+{
+    std::lock_guard<std::mutex> lock( _mMutex );
+    std::map<uint32_t, std::vector<KeyVal>>::iterator it = _mOpen.find( gtid );
+    assert( it != _mOpen.end() );
+
+    KeyVal kv;
+    kv.k = k;
+    kv.v = v;
+    it->second.push_back( kv );
+}
+
+/**
+ * @brief Commits the transaction on every shard it wrote to, or on none
+ *
+ * @param gtid
+ * @return true Committed, false if a shard could not prepare and the
+ * transaction was aborted
+ */
+bool Txn_Coordinator::commit( uint32_t gtid )
+{
+    std::vector<KeyVal> writes;
+    {
+        std::lock_guard<std::mutex> lock( _mMutex );
+        std::map<uint32_t, std::vector<KeyVal>>::iterator it = _mOpen.find( gtid );
+        assert( it != _mOpen.end() );
+        writes.swap( it->second );
+        _mOpen.erase( it );
+    }
+    if( writes.empty() ) return true;
+
+    std::stable_sort( writes.begin(), writes.end(), []( const KeyVal& a, const KeyVal& b ) { return a.k < b.k; } );
+
+    bool committed = prepare( gtid, writes );
+    if( committed )
+    {
+        log_decision( gtid, Decision_Commit, true );
+    }
+    complete( gtid, writes, committed );
+    if( committed )
+    {
+        log_decision( gtid, Decision_Done, false );
+    }
+    return committed;
+}
+
+void Txn_Coordinator::abort( uint32_t gtid )
+{
+    std::lock_guard<std::mutex> lock( _mMutex );
+    _mOpen.erase( gtid );
+}
+
+/**
+ * @brief First phase, every shard holding part of the write set writes it
+ * as a local transaction and prepares it
+ *
+ * @param gtid
+ * @param writes Sorted by key
+ * @return true Every shard voted to commit
+ */
+bool Txn_Coordinator::prepare( uint32_t gtid, const std::vector<KeyVal>& writes )
+{
+    std::atomic<bool> vote( true );
+    _mShards.for_range( writes.front().k, writes.back().k, [&]( B_Tree& tree, Key lo, Key hi )
+    {
+        std::vector<KeyVal>::const_iterator first = std::lower_bound( writes.begin(), writes.end(), lo,
+            []( const KeyVal& a, const Key& k ) { return a.k < k; } );
+        std::vector<KeyVal>::const_iterator last = std::upper_bound( writes.begin(), writes.end(), hi,
+            []( const Key& k, const KeyVal& a ) { return k < a.k; } );
+        if( first == last ) return;
+
+        B_Tree::Txn t = tree.new_txn();
+        tree.insert_batch( std::vector<KeyVal>( first, last ), t );
+        if( !tree.txn_prepare( t, gtid ) )
+        {
+            tree.txn_abort( t );
+            vote = false;
+        }
+    } );
+    return vote;
+}
+
+/**
+ * @brief Second phase, every shard commits or aborts its prepared part
+ *
+ * @param gtid
+ * @param writes Sorted by key
+ * @param committed
+ */
+void Txn_Coordinator::complete( uint32_t gtid, const std::vector<KeyVal>& writes, bool committed )
+{
+    _mShards.for_range( writes.front().k, writes.back().k, [&]( B_Tree& tree, Key, Key )
+    {
+        std::vector<B_Tree::Prepared> prepared;
+        tree.prepared_txns( prepared );
+        for( size_t i=0; i<prepared.size(); i++ )
+        {
+            if( prepared[ i ].gtid != gtid ) continue;
+
+            if( committed )
+            {
+                tree.txn_commit( prepared[ i ].t );
+            }
+            else
+            {
+                tree.txn_abort( prepared[ i ].t );
+            }
+        }
+    } );
+}
+
+/**
+ * @brief Appends a record to the coordinator's log
+ *
+ * @param gtid
+ * @param d
+ * @param sync If set to true, returns once the record is durable
+ */
+void Txn_Coordinator::log_decision( uint32_t gtid, Decision d, bool sync )
+{
+    Log_Record r;
+    r.gtid = gtid;
+    r.decision = d;
+
+    std::lock_guard<std::mutex> lock( _mMutex );
+    _mLog.write( &r, sizeof( r ), _mLog.size() );
+    if( sync )
+    {
+        _mLog.sync();
+    }
+}
+
+/**
+ * @brief Commits prepared transactions whose commit was logged and aborts the
+ * rest, then restarts the log with a record that keeps ids increasing
+ */
+void Txn_Coordinator::recover()
+{
+    std::set<uint32_t> committed;
+    uint32_t max_gtid = 0;
+
+    uint32_t num_records = _mLog.size() / sizeof( Log_Record );
+    for( uint32_t i=0; i<num_records; i++ )
+    {
+        Log_Record r;
+        _mLog.read( &r, sizeof( r ), i * sizeof( r ) );
+        max_gtid = std::max( max_gtid, r.gtid );
+        if( r.decision == Decision_Commit )
+        {
+            committed.insert( r.gtid );
+        }
+    }
+
+    std::mutex m;
+    _mShards.for_range( 0, ~(Key)0, [&]( B_Tree& tree, Key, Key )
+    {
+        std::vector<B_Tree::Prepared> prepared;
+        tree.prepared_txns( prepared );
+        for( size_t i=0; i<prepared.size(); i++ )
+        {
+            if( committed.count( prepared[ i ].gtid ) )
+            {
+                tree.txn_commit( prepared[ i ].t );
+            }
+            else
+            {
+                tree.txn_abort( prepared[ i ].t );
+            }
+            std::lock_guard<std::mutex> lock( m );
+            max_gtid = std::max( max_gtid, prepared[ i ].gtid );
+        }
+    } );
+
+    // Every prepared transaction is settled, so the old records are only
+    // needed for max_gtid. The record that keeps it goes first over the
+    // oldest one and the rest is cut off once it is durable, a crash in
+    // between still finds it.
+    _mNextGtid = max_gtid + 1;
+    Log_Record r;
+    r.gtid = max_gtid;
+    r.decision = Decision_Done;
+    _mLog.write( &r, sizeof( r ), 0 );
+    _mLog.sync();
+    _mLog.resize( sizeof( r ) );
+    _mLog.sync();
+}
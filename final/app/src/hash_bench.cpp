@@ -0,0 +1,93 @@
+#include "distr_log_db/hash_map.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+/**
+ * @brief The hash the map used before hash policies, kept to compare
+ * against. Its low 7 bits were the fragment and the rest picked the slot.
+ */
+struct Legacy_Hash
+{
+    uint64_t operator()( uint32_t k ) const
+    {
+        uint64_t h = std::hash<uint32_t>()( k * ( k + 1 ) * ( k + 2 ) );
+        return ( h >> 7 ) | ( h << 57 );
+    }
+};
+
+/**
+ * @brief Fills a map with the ids and prints the probe distances and the
+ * lookup time
+ */
+template <typename Hash>
+void run( const char* name, const std::vector<uint32_t>& ids )
+{
+    Hash_Map<uint32_t, uint32_t*, Hash> map( 8 );
+    for( uint32_t i=0; i<ids.size(); i++ )
+    {
+        map.insert( ids[ i ], new uint32_t( i ) );
+    }
+    map.finish_rehash();
+
+    uint64_t total = 0;
+    unsigned max = 0;
+    for( unsigned i=0; i<map._mTable.size; i++ )
+    {
+        if( map._mTable.ctrl[ i ] == map.Ctrl_Empty ) continue;
+        total += map._mTable.dists[ i ];
+        if( map._mTable.dists[ i ] > max ) max = map._mTable.dists[ i ];
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t found = 0;
+    for( uint32_t r=0; r<8; r++ )
+    {
+        for( uint32_t i=0; i<ids.size(); i++ )
+        {
+            found += map.find( ids[ i ] ).val != nullptr;
+        }
+    }
+    std::chrono::nanoseconds elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << "  " << name
+              << ": mean probe " << (double)total / map._mCurrSize
+              << ", max probe " << max
+              << ", " << (double)elapsed.count() / ( 8 * ids.size() ) << " ns per find"
+              << " (" << found / 8 << " found)" << std::endl;
+}
+
+/**
+ * @brief Compares probe lengths of the hash policies on node ids
+ *
+ * Usage: distr_log_db_hash_bench [number of ids]
+ */
+int main( int argc, char** argv )
+{
+    uint32_t num = argc > 1 ? atoi( argv[ 1 ] ) : 1 << 20;
+
+    std::vector<uint32_t> sequential( num );
+    for( uint32_t i=0; i<num; i++ )
+    {
+        sequential[ i ] = i;
+    }
+
+    std::mt19937 gen( 4961 );
+    std::vector<uint32_t> random( num );
+    for( uint32_t i=0; i<num; i++ )
+    {
+        random[ i ] = gen();
+    }
+
+    std::cout << "Sequential ids (" << num << ")" << std::endl;
+    run<Legacy_Hash>( "legacy ", sequential );
+    run<Default_Hash<uint32_t>>( "default", sequential );
+
+    std::cout << "Random ids (" << num << ")" << std::endl;
+    run<Legacy_Hash>( "legacy ", random );
+    run<Default_Hash<uint32_t>>( "default", random );
+    return 0;
+}
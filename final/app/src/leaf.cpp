@@ -10,30 +10,25 @@
 ****************************************************************************/
 
 B_Tree::Leaf_Node::Leaf_Node( B_Tree* _aPar, uint32_t _aNodeId, bool exists )
-    : _mDataModified( 0 ),
-      _mNodeId( _aNodeId )
+    : _mDelta( nullptr ),
+      _mNodeId( _aNodeId ),
+      _mDataModified( 0 )
 {
     _mPar = _aPar;
     _mInUse = 0;
     _mDirty = true;
-    memset( &_mStored, 0, sizeof( _mStored ) );
     memset( &_mCurrent, 0, sizeof( _mCurrent ) );
-    memset( &_mLog, 0, sizeof( _mLog ) );
 
     if( exists )
     {
         _mDirty = false;
-        _mPar->fetch_node( this, _aNodeId );
-        memcpy( &_mCurrent, &_mStored, sizeof( _mStored ) );
 
-        for( uint32_t i=0; i<_mLog._mSize; i++ )
-        {
-            KeyValTxn& kvt = _mLog._mKVTs[i];
-            if( _mPar->txn_state( kvt.t ) == TxnState_Committed )
-            {
-                _mCurrent.insert( kvt.k, kvt.v );
-            }
-        }
+        Data stored;
+        Log log;
+        memset( &stored, 0, sizeof( stored ) );
+        memset( &log, 0, sizeof( log ) );
+        _mPar->fetch_node( stored, log, _aNodeId );
+        load( stored, log );
     }
 }
 
@@ -43,19 +38,130 @@ B_Tree::Leaf_Node::~Leaf_Node()
     {
         persist();
     }
+    if( _mDelta )
+    {
+        Frame_Pool::release( _mDelta );
+    }
 }
 
 void B_Tree::Leaf_Node::persist()
 {
-    snprintf( _mStored.foo, sizeof( _mStored.foo ), "\nLeafData: %02x\n", _mNodeId );
-    snprintf( _mLog.foo, sizeof( _mLog.foo ), "\nLeafLog: %02x\n", _mNodeId );
     _mPar->store_node( this, _mNodeId );
     _mDirty = false;
 }
 
-void B_Tree::Leaf_Node::split( Node*& n )
+/**
+ * @brief Builds the current image from the stored data and the log read from
+ * the file system. Logged changes of aborted transactions are dropped.
+ * 
+ * @param stored 
+ * @param log 
+ */
+void B_Tree::Leaf_Node::load( const Data& stored, const Log& log )
 {
-    assert( _mCurrent._mSize == Leaf_Node_Order );
+    memcpy( &_mCurrent, &stored, sizeof( _mCurrent ) );
+    if( _mDelta )
+    {
+        _mDelta->clear();
+    }
+
+    for( uint32_t i=0; i<log._mSize; i++ )
+    {
+        const KeyValTxn& kvt = log._mKVTs[ i ];
+        if( _mPar->txn_state( kvt.t ) == TxnState_Aborted )
+        {
+            continue;
+        }
+
+        Delta d;
+        d.kvt = kvt;
+        d.replaced = _mCurrent.find( kvt.k, d.old );
+        deltas().push_back( d );
+        _mCurrent.insert( kvt.k, kvt.v );
+    }
+    trim_deltas();
+}
+
+/**
+ * @brief Rebuilds the stored data, the current image with every logged
+ * change undone
+ * 
+ * @param d 
+ */
+void B_Tree::Leaf_Node::stored( Data& d ) const
+{
+    memcpy( &d, &_mCurrent, sizeof( d ) );
+    for( uint32_t i=0; i<log_size(); i++ )
+    {
+        const Delta& delta = ( *_mDelta )[ i ];
+        if( delta.replaced )
+        {
+            d.insert( delta.kvt.k, delta.old );
+        }
+        else
+        {
+            d.remove( delta.kvt.k );
+        }
+    }
+    snprintf( d.foo, sizeof( d.foo ), "\nLeafData: %02x\n", _mNodeId );
+}
+
+void B_Tree::Leaf_Node::log( Log& l ) const
+{
+    memset( &l, 0, sizeof( l ) );
+    snprintf( l.foo, sizeof( l.foo ), "\nLeafLog: %02x\n", _mNodeId );
+    l._mSize = log_size();
+    for( uint32_t i=0; i<log_size(); i++ )
+    {
+        l._mKVTs[ i ] = ( *_mDelta )[ i ].kvt;
+    }
+}
+
+uint32_t B_Tree::Leaf_Node::delta_index( Key k ) const
+{
+    uint32_t start = 0, end = log_size();
+    while( start != end )
+    {
+        uint32_t mid = ( start + end ) / 2;
+        if( ( *_mDelta )[ mid ].kvt.k < k )
+        {
+            start = mid + 1;
+        }
+        else
+        {
+            end = mid;
+        }
+    }
+    return start;
+}
+
+/**
+ * @brief The deltas, taking a frame from the delta pool if the log is empty
+ */
+B_Tree::Leaf_Node::Delta_Log& B_Tree::Leaf_Node::deltas()
+{
+    if( !_mDelta )
+    {
+        _mDelta = new ( _mPar->_mDeltaPool.allocate() ) Delta_Log();
+    }
+    return *_mDelta;
+}
+
+/**
+ * @brief Gives the frame of the deltas back once every change was resolved
+ */
+void B_Tree::Leaf_Node::trim_deltas()
+{
+    if( _mDelta && _mDelta->empty() )
+    {
+        Frame_Pool::release( _mDelta );
+        _mDelta = nullptr;
+    }
+}
+
+void B_Tree::Leaf_Node::split( Node*& n, uint32_t at )
+{
+    assert( at && at < _mCurrent._mSize );
     assert( _mNodeId );
     _mInUse++;
     _mDirty = true;
@@ -63,27 +169,23 @@ void B_Tree::Leaf_Node::split( Node*& n )
     uint32_t id;
     Leaf_Node* ptr = _mPar->new_leaf_node( id );
     n = ptr;
+    if( _mPar->_mRightmostLeaf == _mNodeId )
+    {
+        _mPar->_mRightmostLeaf = id;
+    }
 
-    _mCurrent._mSize = Leaf_Node_Order / 2;
-    ptr->_mCurrent._mSize = Leaf_Node_Order - _mCurrent._mSize;
+    ptr->_mCurrent._mSize = _mCurrent._mSize - at;
+    _mCurrent._mSize = at;
     memcpy( &ptr->_mCurrent._mKVs[ 0 ], &_mCurrent._mKVs[ _mCurrent._mSize ], sizeof( KeyVal ) * ptr->_mCurrent._mSize );
     memset( &_mCurrent._mKVs[ _mCurrent._mSize ], 0, ptr->_mCurrent._mSize * sizeof( KeyVal ) );
 
-    uint32_t l_idx = _mLog.index( ptr->_mCurrent._mKVs[ 0 ].k );
-
-    ptr->_mLog._mSize = _mLog._mSize - l_idx;
-    _mLog._mSize = l_idx;
-
-    memcpy( &ptr->_mLog._mKVTs[ 0 ], &_mLog._mKVTs[ l_idx ], ptr->_mLog._mSize * sizeof( KeyValTxn ) );
-    memset( &_mLog._mKVTs[ _mLog._mSize], 0, ptr->_mLog._mSize * sizeof( KeyValTxn ) );
-
-    uint32_t s_idx = _mStored.index( ptr->_mCurrent._mKVs[ 0 ].k );
-
-    ptr->_mStored._mSize = _mStored._mSize - s_idx;
-    _mStored._mSize = s_idx;
-
-    memcpy( &ptr->_mStored._mKVs[ 0 ], &_mStored._mKVs[ s_idx ], ptr->_mStored._mSize * sizeof( KeyVal ) );
-    memset( &_mStored._mKVs[ _mStored._mSize], 0, ptr->_mStored._mSize * sizeof( KeyVal ) );
+    uint32_t d_idx = delta_index( ptr->_mCurrent._mKVs[ 0 ].k );
+    if( d_idx < log_size() )
+    {
+        ptr->deltas().assign( _mDelta->begin() + d_idx, _mDelta->end() );
+        _mDelta->resize( d_idx );
+        trim_deltas();
+    }
 
     _mDataModified = true;
     ptr->_mDataModified = true;
@@ -98,38 +200,150 @@ bool B_Tree::Leaf_Node::find( const Key& k, Val& v ) const
     return _mCurrent.find( k, v );
 }
 
+void B_Tree::Leaf_Node::multi_find( const Key* k, uint32_t n, Val* v, uint8_t* found ) const
+{
+    for( uint32_t i=0; i<n; i++ )
+    {
+        found[ i ] = _mCurrent.find( k[ i ], v[ i ] );
+    }
+}
+
+void B_Tree::Leaf_Node::scan( const Key& lo, const Key& hi, std::vector<KeyVal>& kvs ) const
+{
+    for( uint32_t i=_mCurrent.index( lo ); i<_mCurrent._mSize && _mCurrent._mKVs[ i ].k <= hi; i++ )
+    {
+        kvs.push_back( _mCurrent._mKVs[ i ] );
+    }
+}
+
+void B_Tree::Leaf_Node::totals( Aggregate& a ) const
+{
+    for( uint32_t i=0; i<_mCurrent._mSize; i++ )
+    {
+        _mPar->combine( a, 1, _mPar->_mReduction.map( _mCurrent._mKVs[ i ].v ) );
+    }
+}
+
+void B_Tree::Leaf_Node::aggregate( const Key& lo, const Key& hi, Aggregate& a ) const
+{
+    for( uint32_t i=_mCurrent.index( lo ); i<_mCurrent._mSize && _mCurrent._mKVs[ i ].k <= hi; i++ )
+    {
+        _mPar->combine( a, 1, _mPar->_mReduction.map( _mCurrent._mKVs[ i ].v ) );
+    }
+}
+
 void B_Tree::Leaf_Node::insert( const Key& k, const Val& v, Txn t )
 {
     _mDirty = true;
+    if( _mPar->shadow_paging() )
+    {
+        // Uncommitted entries only ever reach unpublished frames
+        _mCurrent.insert( k, v );
+        return;
+    }
+
+    uint32_t idx = delta_index( k );
+    if( idx < log_size() && ( *_mDelta )[ idx ].kvt.k == k )
+    {
+        if( ( *_mDelta )[ idx ].kvt.t == t )
+        {
+            ( *_mDelta )[ idx ].kvt.v = v;
+            _mCurrent.insert( k, v );
+            return;
+        }
+
+        // We cannot add a log to the same element for different current
+        // transactions, a finished one is settled first
+        bool settled = settle( idx );
+        assert( settled );
+        (void)settled;
+    }
+
+    if( log_size() == Log_Size )
+    {
+        shorten_log();
+        idx = delta_index( k );
+    }
+    assert( log_size() != Log_Size );
+
+    Delta d;
+    d.kvt.k = k;
+    d.kvt.v = v;
+    d.kvt.t = t;
+    d.replaced = _mCurrent.find( k, d.old );
+    Delta_Log& dl = deltas();
+    dl.insert( dl.begin() + idx, d );
     _mCurrent.insert( k, v );
-    if( _mLog._mSize == Log_Size )
+}
+
+/**
+ * @brief Resolves a logged change whose transaction has finished. Committed
+ * changes become part of the stored data, aborted ones are undone in the
+ * current image.
+ * 
+ * @param idx Index into the deltas
+ * @return true The change was resolved and removed, false if its
+ * transaction is still current
+ */
+bool B_Tree::Leaf_Node::settle( uint32_t idx )
+{
+    Delta& d = ( *_mDelta )[ idx ];
+    switch( _mPar->txn_state( d.kvt.t ) )
+    {
+    case TxnState_Aborted:
+        if( d.replaced )
+        {
+            _mCurrent.insert( d.kvt.k, d.old );
+        }
+        else
+        {
+            _mCurrent.remove( d.kvt.k );
+        }
+        break;
+    case TxnState_Committed:
+        _mDataModified = true;
+        break;
+    case TxnState_Current:
+        // Transaction is still current, we need to keep this in the log
+        return false;
+    case TxnState_Invalid:
+    default:
+        assert( 0 );
+        return false;
+    }
+    _mDelta->erase( _mDelta->begin() + idx );
+    trim_deltas();
+    return true;
+}
+
+/**
+ * @brief Removes changes of finished transactions from the log, folding
+ * committed ones into the stored data
+ */
+void B_Tree::Leaf_Node::shorten_log()
+{
+    for( uint32_t i=0; i<log_size(); )
     {
-        for( uint32_t i=0; i<_mLog._mSize; i++ )
+        if( !settle( i ) )
         {
-            KeyValTxn& kvt = _mLog._mKVTs[ i ];
-            switch( _mPar->txn_state( kvt.t ) )
-            {
-            case TxnState_Aborted:
-                _mLog.remove( kvt.k );
-                i--;
-                break;
-            case TxnState_Committed:
-                _mDataModified = true;
-                _mStored.insert( kvt.k, kvt.v );
-                _mLog.remove( kvt.k );
-                i--;
-                break;
-            case TxnState_Current:
-                // Transaction is still current, we need to keep this in the log
-                break;
-            case TxnState_Invalid:
-            default:
-                assert( 0 );
-                break;
-            }
+            i++;
         }
     }
-    _mLog.insert( k, v, t );
+}
+
+/**
+ * @brief A leaf is full when either its data or its log has no room left,
+ * after finished transactions have been cleared from the log
+ */
+bool B_Tree::Leaf_Node::full()
+{
+    if( _mCurrent._mSize == Leaf_Node_Order ) return true;
+    if( log_size() == Log_Size )
+    {
+        _mDirty = true;
+        shorten_log();
+    }
+    return log_size() == Log_Size;
 }
 
 void B_Tree::Leaf_Node::print( size_t depth ) const
@@ -137,11 +351,13 @@ void B_Tree::Leaf_Node::print( size_t depth ) const
     std::string s( depth, ' ' );
     std::cout << s << "Leaf_Node" << std::endl;
     std::cout << s << "   ID: " << _mNodeId << std::endl;
+    Data st;
+    stored( st );
     std::cout << s << "   Stored:" << std::endl;
-    std::cout << s << "      Size: " << _mStored._mSize << std::endl;
-    for( size_t i=0; i<_mStored._mSize; i++ )
+    std::cout << s << "      Size: " << st._mSize << std::endl;
+    for( size_t i=0; i<st._mSize; i++ )
     {
-        switch( state( _mStored._mKVs[ i ].k ) )
+        switch( state( st._mKVs[ i ].k ) )
         {
         case TxnState_Aborted:
             std::cout << Color::Yellow;
@@ -155,8 +371,8 @@ void B_Tree::Leaf_Node::print( size_t depth ) const
         case TxnState_Invalid:
             break;
         }
-        std::cout << s << "      " << std::hex << std::setw(8) << std::setfill( '0' ) << _mStored._mKVs[ i ].k
-                                   << "   \"" << (char*)_mStored._mKVs[ i ].v.val << "\"" << Color::Reset << std::endl;
+        std::cout << s << "      " << std::hex << std::setw(8) << std::setfill( '0' ) << st._mKVs[ i ].k
+                                   << "   \"" << (char*)st._mKVs[ i ].v.val << "\"" << Color::Reset << std::endl;
     }
     std::cout << s << "   Current:" << std::endl;
     std::cout << s << "      Size: " << _mCurrent._mSize << std::endl;
@@ -180,10 +396,11 @@ void B_Tree::Leaf_Node::print( size_t depth ) const
                                    << "   \"" << (char*)_mCurrent._mKVs[ i ].v.val << "\"" << Color::Reset << std::endl;
     }
     std::cout << s << "   Log:" << std::endl;
-    std::cout << s << "      Size: " << _mLog._mSize << std::endl;
-    for( size_t i=0; i<_mLog._mSize; i++ )
+    std::cout << s << "      Size: " << log_size() << std::endl;
+    for( size_t i=0; i<log_size(); i++ )
     {
-        switch( _mPar->txn_state( _mLog._mKVTs[ i ].t ) )
+        const KeyValTxn& kvt = ( *_mDelta )[ i ].kvt;
+        switch( _mPar->txn_state( kvt.t ) )
         {
         case TxnState_Aborted:
             std::cout << Color::Yellow;
@@ -197,19 +414,19 @@ void B_Tree::Leaf_Node::print( size_t depth ) const
         case TxnState_Invalid:
             break;
         }
-        std::cout << s << "      " << std::hex << std::setw(8) << std::setfill( '0' ) << _mLog._mKVTs[ i ].k
-                                   << "   \"" << (char*)_mLog._mKVTs[ i ].v.val << "\" " << _mLog._mKVTs[ i ].t << Color::Reset << std::endl;
+        std::cout << s << "      " << std::hex << std::setw(8) << std::setfill( '0' ) << kvt.k
+                                   << "   \"" << (char*)kvt.v.val << "\" " << kvt.t << Color::Reset << std::endl;
     }
 }
 
 B_Tree::TxnState B_Tree::Leaf_Node::state( Key k ) const
 {
-    uint32_t idx = _mLog.index( k );
-    if( _mLog._mKVTs[ idx ].k != k )
+    uint32_t idx = delta_index( k );
+    if( idx == log_size() || ( *_mDelta )[ idx ].kvt.k != k )
     {
         return TxnState_Invalid;
     }
-    return _mPar->txn_state( _mLog._mKVTs[ idx ].t );
+    return _mPar->txn_state( ( *_mDelta )[ idx ].kvt.t );
 }
 
 /****************************************************************************
@@ -229,17 +446,17 @@ bool B_Tree::Leaf_Node::Data::find( const Key& k, Val& v ) const
 
 void B_Tree::Leaf_Node::Data::insert( const Key& k, const Val& v )
 {
-    assert( _mSize != Leaf_Node_Order );
-
     uint32_t idx = index( k );
 
-    if( k == _mKVs[ idx ].k )
+    if( idx < _mSize && k == _mKVs[ idx ].k )
     {
         // Entry already exists
         _mKVs[ idx ].v = v;
         return;
     }
 
+    assert( _mSize != Leaf_Node_Order );
+
     memmove( &_mKVs[ idx + 1 ], &_mKVs[ idx ], ( _mSize - idx ) * sizeof( KeyVal ) );
 
     _mKVs[ idx ].k = k;
@@ -289,74 +506,3 @@ void B_Tree::Leaf_Node::Data::remove( Key k )
 
     _mSize--;
 }
-
-/****************************************************************************
-*                                 LOG
-****************************************************************************/
-
-void B_Tree::Leaf_Node::Log::insert( const Key& k, const Val& v, Txn t )
-{
-    assert( _mSize != Log_Size );
-
-    uint32_t idx = index( k );
-
-    if( k == _mKVTs[ idx ].k && t == _mKVTs[ idx ].t )
-    {
-        _mKVTs[ idx ].v = v;
-        return;
-    }
-
-    // We cannot add a log to the same element for different transactions
-    assert( k != _mKVTs[ idx ].k );
-
-    memmove( &_mKVTs[ idx + 1 ], &_mKVTs[ idx ], ( _mSize - idx ) * sizeof( KeyValTxn ) );
-
-    _mKVTs[ idx ].k = k;
-    _mKVTs[ idx ].v = v;
-    _mKVTs[ idx ].t = t;
-
-    _mSize++;
-}
-
-uint32_t B_Tree::Leaf_Node::Log::index( Key k, uint32_t start, uint32_t end ) const
-{
-    if( start == end ) return start;
-
-    uint32_t mid = ( start + end ) / 2;
-
-    if( k <= _mKVTs[ mid ].k )
-    {
-        return index( k, start, mid );
-    }
-    else
-    {
-        return index( k, mid + 1, end );
-    }
-}
-
-uint32_t B_Tree::Leaf_Node::Log::index( Key k ) const
-{
-    if( !_mSize ) return 0;
-    // If target lies beyond the max element, than the index of strictly smaller
-    // value than target should be (end - 1)
-    if( k > _mKVTs[ _mSize - 1 ].k ) return _mSize;
-
-    return index( k, 0, _mSize - 1 );
-}
-
-void B_Tree::Leaf_Node::Log::remove( Key k )
-{
-    uint32_t idx = index( k );
-
-    if( k != _mKVTs[ idx ].k )
-    {
-        // Entry doesn't exist
-        return;
-    }
-
-    memmove( &_mKVTs[ idx ], &_mKVTs[ idx + 1 ], ( _mSize - idx ) * sizeof( KeyValTxn ) );
-    memset( &_mKVTs[ _mSize - 1 ], 0, sizeof( KeyValTxn ) );
-
-    _mSize--;
-}
-
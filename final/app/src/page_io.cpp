@@ -0,0 +1,825 @@
+#include "distr_log_db/page_io.hpp"
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifdef DISTR_LOG_DB_HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+static void* aligned_buffer( size_t len )
+{
+    void* ptr = nullptr;
+    int ret = posix_memalign( &ptr, Page_IO::Direct_Alignment, len );
+    assert( !ret );
+    (void)ret;
+    return ptr;
+}
+
+static off_t align_down( off_t off )
+{
+    return off & ~static_cast<off_t>( Page_IO::Direct_Alignment - 1 );
+}
+
+static off_t align_up( off_t off )
+{
+    return align_down( off + Page_IO::Direct_Alignment - 1 );
+}
+
+Page_IO::Page_IO()
+    : _mFd( -1 ),
+      _mDirect( false ),
+      _mSize( 0 ),
+      _mBackend( Backend_None ),
+      _mReaping( false ),
+      _mInFlight( 0 ),
+      _mRingFd( -1 ),
+      _mStopping( false )
+{
+}
+
+Page_IO::~Page_IO()
+{
+    close();
+}
+
+/**
+ * @brief Opens (creating if necessary) the file and starts the I/O backend.
+ *
+ * @param file_name
+ * @param direct Attempt to bypass the page cache with O_DIRECT. Falls back to
+ * buffered I/O if the file system does not support it.
+ * @param force_thread_pool Skip io_uring even when it is available
+ * @return true File was opened
+ */
+bool Page_IO::open( const std::string& file_name, bool direct, bool force_thread_pool )
+{
+    close();
+
+    _mDirect = false;
+    if( direct )
+    {
+        _mFd = ::open( file_name.c_str(), O_RDWR | O_CREAT | O_DIRECT, 0644 );
+        _mDirect = _mFd >= 0;
+    }
+    if( _mFd < 0 )
+    {
+        _mFd = ::open( file_name.c_str(), O_RDWR | O_CREAT, 0644 );
+    }
+    if( _mFd < 0 )
+    {
+        return false;
+    }
+
+    struct stat st;
+    fstat( _mFd, &st );
+    _mSize = st.st_size;
+
+    if( !force_thread_pool && uring_setup() )
+    {
+        _mBackend = Backend_IO_Uring;
+    }
+    else
+    {
+        _mBackend = Backend_Thread_Pool;
+        _mStopping = false;
+        for( uint32_t i=0; i<Num_IO_Threads; i++ )
+        {
+            _mThreads.emplace_back( &Page_IO::worker, this );
+        }
+    }
+    return true;
+}
+
+void Page_IO::close()
+{
+    if( _mFd < 0 ) return;
+
+    {
+        std::lock_guard<std::mutex> guard( _mMutex );
+        drop_read_aheads( 0, static_cast<size_t>( -1 ) / 2 );
+    }
+
+    if( _mBackend == Backend_IO_Uring )
+    {
+        uring_teardown();
+    }
+    else if( _mBackend == Backend_Thread_Pool )
+    {
+        {
+            std::lock_guard<std::mutex> guard( _mQueueMutex );
+            _mStopping = true;
+        }
+        _mQueueCond.notify_all();
+        for( size_t i=0; i<_mThreads.size(); i++ )
+        {
+            _mThreads[ i ].join();
+        }
+        _mThreads.clear();
+    }
+    _mBackend = Backend_None;
+
+    ::close( _mFd );
+    _mFd = -1;
+}
+
+off_t Page_IO::size()
+{
+    std::lock_guard<std::mutex> guard( _mMutex );
+    return _mSize;
+}
+
+void Page_IO::resize( off_t size )
+{
+    std::unique_lock<std::mutex> lock( _mMutex );
+    while( !_mBusyBlocks.empty() )
+    {
+        _mBusyCond.wait( lock );
+    }
+    drop_read_aheads( 0, static_cast<size_t>( -1 ) / 2 );
+    int ret = ftruncate( _mFd, size );
+    assert( !ret );
+    (void)ret;
+    _mSize = size;
+}
+
+/**
+ * @brief Reads len bytes at off into buf, waiting for completion. Bytes past
+ * the end of the file read as zero. If an earlier read_ahead() covers the
+ * range it is used instead of issuing a new request.
+ */
+void Page_IO::read( void* buf, size_t len, off_t off )
+{
+    {
+        std::lock_guard<std::mutex> guard( _mMutex );
+
+        for( auto itr=_mReadAheads.begin(); itr!=_mReadAheads.end(); itr++ )
+        {
+            Request* r = *itr;
+            if( off >= r->off && off + static_cast<off_t>( len ) <= r->off + static_cast<off_t>( r->iov.iov_len ) )
+            {
+                wait( r );
+                copy_out( r, buf, len, off );
+                return;
+            }
+        }
+    }
+
+    if( _mDirect )
+    {
+        Request r;
+        r.off = align_down( off );
+        r.iov.iov_len = align_up( off + len ) - r.off;
+        r.iov.iov_base = aligned_buffer( r.iov.iov_len );
+        r.res = transfer( Opcode_Read, r.iov.iov_base, r.iov.iov_len, r.off );
+        copy_out( &r, buf, len, off );
+        free( r.iov.iov_base );
+    }
+    else
+    {
+        ssize_t res = transfer( Opcode_Read, buf, len, off );
+        assert( res >= 0 );
+        if( static_cast<size_t>( res ) < len )
+        {
+            memset( (char*)buf + res, 0, len - res );
+        }
+    }
+}
+
+/**
+ * @brief Writes len bytes from buf at off, waiting for completion. Any
+ * read-ahead overlapping the range is discarded.
+ */
+void Page_IO::write( const void* buf, size_t len, off_t off )
+{
+    std::vector<Write> writes( 1 );
+    writes[ 0 ].buf = buf;
+    writes[ 0 ].len = len;
+    writes[ 0 ].off = off;
+    write( writes );
+}
+
+/**
+ * @brief Submits all the writes before waiting for any of them. Writes to
+ * overlapping ranges land in the order given. Any read-ahead overlapping
+ * one of the ranges is discarded.
+ */
+void Page_IO::write( const std::vector<Write>& writes )
+{
+    if( writes.empty() ) return;
+
+    {
+        std::lock_guard<std::mutex> guard( _mMutex );
+        for( size_t i=0; i<writes.size(); i++ )
+        {
+            drop_read_aheads( writes[ i ].off, writes[ i ].len );
+        }
+    }
+
+    if( _mDirect )
+    {
+        write_direct( writes );
+        return;
+    }
+
+    // Overlapping writes can't be in flight together, their order would be
+    // up to the device
+    off_t end = 0;
+    size_t i = 0;
+    while( i < writes.size() )
+    {
+        std::vector<Request> reqs;
+        reqs.reserve( writes.size() - i );
+        for( ; i<writes.size(); i++ )
+        {
+            const Write& w = writes[ i ];
+            bool overlaps = false;
+            for( size_t j=0; j<reqs.size() && !overlaps; j++ )
+            {
+                overlaps = w.off < reqs[ j ].off + static_cast<off_t>( reqs[ j ].iov.iov_len ) &&
+                           reqs[ j ].off < w.off + static_cast<off_t>( w.len );
+            }
+            if( overlaps ) break;
+
+            reqs.emplace_back();
+            Request& r = reqs.back();
+            r.op = Opcode_Write;
+            r.iov.iov_base = const_cast<void*>( w.buf );
+            r.iov.iov_len = w.len;
+            r.off = w.off;
+            r.res = 0;
+            r.done = false;
+            end = std::max<off_t>( end, w.off + w.len );
+        }
+        for( size_t j=0; j<reqs.size(); j++ )
+        {
+            submit( &reqs[ j ] );
+        }
+        for( size_t j=0; j<reqs.size(); j++ )
+        {
+            wait( &reqs[ j ] );
+            assert( reqs[ j ].res == static_cast<ssize_t>( reqs[ j ].iov.iov_len ) );
+        }
+    }
+
+    std::lock_guard<std::mutex> guard( _mMutex );
+    _mSize = std::max( _mSize, end );
+}
+
+/**
+ * @brief O_DIRECT needs aligned offsets, lengths and buffers. The writes are
+ * gathered into runs of whole blocks, only the blocks a write covers in part
+ * are read first, then each run goes out as one write.
+ */
+void Page_IO::write_direct( const std::vector<Write>& writes )
+{
+    struct Extent
+    {
+        off_t off;
+        off_t end;
+        char* buf;
+        // Bytes the writes cover, as sorted disjoint ranges
+        std::vector<std::pair<off_t, off_t>> covered;
+    };
+
+    std::vector<size_t> order( writes.size() );
+    for( size_t i=0; i<order.size(); i++ ) order[ i ] = i;
+    std::sort( order.begin(), order.end(), [&]( size_t a, size_t b ) { return writes[ a ].off < writes[ b ].off; } );
+
+    std::vector<Extent> extents;
+    std::vector<size_t> extent_of( writes.size() );
+    off_t end = 0;
+    for( size_t i=0; i<order.size(); i++ )
+    {
+        const Write& w = writes[ order[ i ] ];
+        off_t w_end = w.off + w.len;
+        off_t a_off = align_down( w.off );
+        off_t a_end = align_up( w_end );
+        if( extents.empty() || a_off > extents.back().end )
+        {
+            extents.emplace_back();
+            extents.back().off = a_off;
+            extents.back().end = a_end;
+        }
+        Extent& e = extents.back();
+        e.end = std::max( e.end, a_end );
+        if( !e.covered.empty() && w.off <= e.covered.back().second )
+        {
+            e.covered.back().second = std::max( e.covered.back().second, w_end );
+        }
+        else
+        {
+            e.covered.emplace_back( w.off, w_end );
+        }
+        extent_of[ order[ i ] ] = extents.size() - 1;
+        end = std::max( end, w_end );
+    }
+
+    // Claim the blocks, a run reaching past the end of the file claims
+    // everything after it as well
+    std::vector<std::pair<off_t, off_t>> claimed( extents.size() );
+    off_t file_size;
+    {
+        std::unique_lock<std::mutex> lock( _mMutex );
+        while( true )
+        {
+            bool busy = false;
+            for( size_t i=0; i<extents.size() && !busy; i++ )
+            {
+                claimed[ i ].first = extents[ i ].off;
+                claimed[ i ].second = extents[ i ].end > _mSize ? std::numeric_limits<off_t>::max() : extents[ i ].end;
+                busy = blocks_busy( claimed[ i ].first, claimed[ i ].second );
+            }
+            if( !busy ) break;
+            _mBusyCond.wait( lock );
+        }
+        _mBusyBlocks.insert( _mBusyBlocks.end(), claimed.begin(), claimed.end() );
+        file_size = _mSize;
+    }
+
+    // Read the blocks that are only partly written, adjacent ones together
+    std::vector<Request> reqs;
+    for( size_t i=0; i<extents.size(); i++ )
+    {
+        Extent& e = extents[ i ];
+        size_t len = e.end - e.off;
+        e.buf = (char*)aligned_buffer( len );
+        memset( e.buf, 0, len );
+
+        size_t c = 0;
+        for( off_t blk=e.off; blk<e.end && blk<file_size; blk+=Direct_Alignment )
+        {
+            off_t blk_end = blk + Direct_Alignment;
+            while( c < e.covered.size() && e.covered[ c ].second <= blk ) c++;
+            bool full = c < e.covered.size() && e.covered[ c ].first <= blk && e.covered[ c ].second >= blk_end;
+            if( full ) continue;
+
+            if( !reqs.empty() && reqs.back().off + static_cast<off_t>( reqs.back().iov.iov_len ) == blk )
+            {
+                reqs.back().iov.iov_len += Direct_Alignment;
+                continue;
+            }
+            reqs.emplace_back();
+            Request& r = reqs.back();
+            r.op = Opcode_Read;
+            r.iov.iov_base = e.buf + ( blk - e.off );
+            r.iov.iov_len = Direct_Alignment;
+            r.off = blk;
+            r.res = 0;
+            r.done = false;
+        }
+    }
+    for( size_t i=0; i<reqs.size(); i++ )
+    {
+        submit( &reqs[ i ] );
+    }
+    for( size_t i=0; i<reqs.size(); i++ )
+    {
+        wait( &reqs[ i ] );
+        assert( reqs[ i ].res >= 0 );
+    }
+
+    for( size_t i=0; i<writes.size(); i++ )
+    {
+        const Write& w = writes[ i ];
+        const Extent& e = extents[ extent_of[ i ] ];
+        memcpy( e.buf + ( w.off - e.off ), w.buf, w.len );
+    }
+
+    reqs.clear();
+    reqs.resize( extents.size() );
+    for( size_t i=0; i<extents.size(); i++ )
+    {
+        Request& r = reqs[ i ];
+        r.op = Opcode_Write;
+        r.iov.iov_base = extents[ i ].buf;
+        r.iov.iov_len = extents[ i ].end - extents[ i ].off;
+        r.off = extents[ i ].off;
+        r.res = 0;
+        r.done = false;
+        submit( &r );
+    }
+    for( size_t i=0; i<reqs.size(); i++ )
+    {
+        wait( &reqs[ i ] );
+        assert( reqs[ i ].res == static_cast<ssize_t>( reqs[ i ].iov.iov_len ) );
+        free( extents[ i ].buf );
+    }
+
+    {
+        std::lock_guard<std::mutex> guard( _mMutex );
+        // The last block may reach past the logical end of the file
+        if( extents.back().end > _mSize )
+        {
+            _mSize = std::max( _mSize, end );
+            int ret = ftruncate( _mFd, _mSize );
+            assert( !ret );
+            (void)ret;
+        }
+        for( size_t i=0; i<claimed.size(); i++ )
+        {
+            _mBusyBlocks.erase( std::find( _mBusyBlocks.begin(), _mBusyBlocks.end(), claimed[ i ] ) );
+        }
+    }
+    _mBusyCond.notify_all();
+}
+
+bool Page_IO::blocks_busy( off_t off, off_t end ) const
+{
+    for( size_t i=0; i<_mBusyBlocks.size(); i++ )
+    {
+        if( off < _mBusyBlocks[ i ].second && _mBusyBlocks[ i ].first < end )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Makes all completed writes durable
+ */
+void Page_IO::sync()
+{
+    ssize_t res = transfer( Opcode_Sync, nullptr, 0, 0 );
+    assert( res >= 0 );
+    (void)res;
+}
+
+/**
+ * @brief Starts an asynchronous read of the range without waiting for it.
+ * Up to Max_Read_Aheads ranges are kept, the oldest is dropped first.
+ */
+void Page_IO::read_ahead( off_t off, size_t len )
+{
+    if( !len ) return;
+
+    std::lock_guard<std::mutex> guard( _mMutex );
+
+    if( off >= _mSize ) return;
+
+    for( auto itr=_mReadAheads.begin(); itr!=_mReadAheads.end(); itr++ )
+    {
+        Request* r = *itr;
+        if( off >= r->off && off + static_cast<off_t>( len ) <= r->off + static_cast<off_t>( r->iov.iov_len ) )
+        {
+            return;
+        }
+    }
+
+    if( _mReadAheads.size() == Max_Read_Aheads )
+    {
+        Request* r = _mReadAheads.front();
+        wait( r );
+        free( r->iov.iov_base );
+        delete r;
+        _mReadAheads.pop_front();
+    }
+
+    Request* r = new Request;
+    r->op = Opcode_Read;
+    r->off = _mDirect ? align_down( off ) : off;
+    r->iov.iov_len = ( _mDirect ? align_up( off + len ) : off + static_cast<off_t>( len ) ) - r->off;
+    r->iov.iov_base = aligned_buffer( r->iov.iov_len );
+    r->res = 0;
+    r->done = false;
+    submit( r );
+    _mReadAheads.push_back( r );
+}
+
+void Page_IO::copy_out( const Request* r, void* buf, size_t len, off_t off )
+{
+    assert( r->res >= 0 );
+    off_t skip = off - r->off;
+    size_t avail = r->res > skip ? r->res - skip : 0;
+    size_t n = std::min( avail, len );
+    memcpy( buf, (const char*)r->iov.iov_base + skip, n );
+    memset( (char*)buf + n, 0, len - n );
+}
+
+void Page_IO::drop_read_aheads( off_t off, size_t len )
+{
+    for( auto itr=_mReadAheads.begin(); itr!=_mReadAheads.end(); )
+    {
+        Request* r = *itr;
+        if( off < r->off + static_cast<off_t>( r->iov.iov_len ) && r->off < off + static_cast<off_t>( len ) )
+        {
+            wait( r );
+            free( r->iov.iov_base );
+            delete r;
+            itr = _mReadAheads.erase( itr );
+        }
+        else
+        {
+            itr++;
+        }
+    }
+}
+
+ssize_t Page_IO::transfer( Opcode op, void* buf, size_t len, off_t off )
+{
+    Request r;
+    r.op = op;
+    r.iov.iov_base = buf;
+    r.iov.iov_len = len;
+    r.off = off;
+    r.res = 0;
+    r.done = false;
+    submit( &r );
+    wait( &r );
+    return r.res;
+}
+
+/****************************************************************************
+*                              IO_URING
+****************************************************************************/
+
+#ifdef DISTR_LOG_DB_HAVE_IO_URING
+
+bool Page_IO::uring_setup()
+{
+    struct io_uring_params p;
+    memset( &p, 0, sizeof( p ) );
+
+    _mRingFd = syscall( __NR_io_uring_setup, Queue_Depth, &p );
+    if( _mRingFd < 0 )
+    {
+        return false;
+    }
+
+    _mSqRingSize = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    _mCqRingSize = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+    if( p.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        _mSqRingSize = _mCqRingSize = std::max( _mSqRingSize, _mCqRingSize );
+    }
+
+    _mSqRing = mmap( nullptr, _mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _mRingFd, IORING_OFF_SQ_RING );
+    if( p.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        _mCqRing = _mSqRing;
+    }
+    else
+    {
+        _mCqRing = mmap( nullptr, _mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _mRingFd, IORING_OFF_CQ_RING );
+    }
+    _mSqesSize = p.sq_entries * sizeof( struct io_uring_sqe );
+    _mSqes = (struct io_uring_sqe*)mmap( nullptr, _mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _mRingFd, IORING_OFF_SQES );
+
+    if( _mSqRing == MAP_FAILED || _mCqRing == MAP_FAILED || _mSqes == MAP_FAILED )
+    {
+        ::close( _mRingFd );
+        _mRingFd = -1;
+        return false;
+    }
+
+    char* sq = (char*)_mSqRing;
+    char* cq = (char*)_mCqRing;
+    _mSqHead = (unsigned*)( sq + p.sq_off.head );
+    _mSqTail = (unsigned*)( sq + p.sq_off.tail );
+    _mSqMask = (unsigned*)( sq + p.sq_off.ring_mask );
+    _mSqArray = (unsigned*)( sq + p.sq_off.array );
+    _mCqHead = (unsigned*)( cq + p.cq_off.head );
+    _mCqTail = (unsigned*)( cq + p.cq_off.tail );
+    _mCqMask = (unsigned*)( cq + p.cq_off.ring_mask );
+    _mCqes = (struct io_uring_cqe*)( cq + p.cq_off.cqes );
+    return true;
+}
+
+void Page_IO::uring_teardown()
+{
+    munmap( _mSqes, _mSqesSize );
+    if( _mCqRing != _mSqRing )
+    {
+        munmap( _mCqRing, _mCqRingSize );
+    }
+    munmap( _mSqRing, _mSqRingSize );
+    ::close( _mRingFd );
+    _mRingFd = -1;
+}
+
+/**
+ * @brief Marks every posted completion done, with _mRingMutex held
+ *
+ * @return unsigned Number of completions
+ */
+unsigned Page_IO::uring_reap()
+{
+    unsigned head = *_mCqHead;
+    unsigned count = 0;
+    while( head != __atomic_load_n( _mCqTail, __ATOMIC_ACQUIRE ) )
+    {
+        struct io_uring_cqe* cqe = &_mCqes[ head & *_mCqMask ];
+        Request* r = (Request*)cqe->user_data;
+        r->res = cqe->res;
+        r->done = true;
+        head++;
+        count++;
+    }
+    __atomic_store_n( _mCqHead, head, __ATOMIC_RELEASE );
+    _mInFlight -= count;
+    return count;
+}
+
+/**
+ * @brief Waits until r is done, or with a null r until there is room in
+ * the queue. One waiter at a time blocks in io_uring_enter, outside the
+ * lock, and reaps for everybody when it returns.
+ */
+void Page_IO::uring_wait( std::unique_lock<std::mutex>& lock, Request* r )
+{
+    while( r ? !r->done : _mInFlight == Queue_Depth )
+    {
+        if( _mReaping )
+        {
+            // The completions are left for the thread in the kernel, which
+            // would otherwise sleep on one somebody else already took
+            _mReapCond.wait( lock );
+            continue;
+        }
+        if( uring_reap() )
+        {
+            _mReapCond.notify_all();
+            continue;
+        }
+
+        _mReaping = true;
+        lock.unlock();
+        int ret = syscall( __NR_io_uring_enter, _mRingFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0 );
+        int err = errno;
+        lock.lock();
+        _mReaping = false;
+        _mReapCond.notify_all();
+
+        if( ret < 0 && err != EINTR && err != EAGAIN && err != EBUSY )
+        {
+            // Requests in flight point into the callers' buffers, there is
+            // no way to give up on them
+            errno = err;
+            perror( "io_uring_enter" );
+            abort();
+        }
+    }
+}
+
+#else
+
+bool Page_IO::uring_setup() { return false; }
+void Page_IO::uring_teardown() {}
+unsigned Page_IO::uring_reap() { return 0; }
+void Page_IO::uring_wait( std::unique_lock<std::mutex>&, Request* ) {}
+
+#endif
+
+/****************************************************************************
+*                              THREAD POOL
+****************************************************************************/
+
+void Page_IO::worker()
+{
+    while( true )
+    {
+        Request* r;
+        {
+            std::unique_lock<std::mutex> lock( _mQueueMutex );
+            while( !_mStopping && _mQueue.empty() )
+            {
+                _mQueueCond.wait( lock );
+            }
+            if( _mQueue.empty() )
+            {
+                return;
+            }
+            r = _mQueue.front();
+            _mQueue.pop_front();
+        }
+
+        ssize_t res = execute( r );
+        {
+            std::lock_guard<std::mutex> guard( _mQueueMutex );
+            r->res = res;
+            r->done = true;
+        }
+        _mDoneCond.notify_all();
+    }
+}
+
+/**
+ * @brief Runs the request on the calling thread
+ *
+ * @return ssize_t Bytes transferred, or -errno
+ */
+ssize_t Page_IO::execute( const Request* r )
+{
+    ssize_t res;
+    switch( r->op )
+    {
+    case Opcode_Read:
+        res = pread( _mFd, r->iov.iov_base, r->iov.iov_len, r->off );
+        break;
+    case Opcode_Write:
+        res = pwrite( _mFd, r->iov.iov_base, r->iov.iov_len, r->off );
+        break;
+    case Opcode_Sync:
+    default:
+        res = fdatasync( _mFd );
+        break;
+    }
+    return res < 0 ? -errno : res;
+}
+
+/****************************************************************************
+*                              SUBMISSION
+****************************************************************************/
+
+void Page_IO::submit( Request* r )
+{
+#ifdef DISTR_LOG_DB_HAVE_IO_URING
+    if( _mBackend == Backend_IO_Uring )
+    {
+        std::unique_lock<std::mutex> lock( _mRingMutex );
+        // Every request in flight must have room in the completion queue
+        uring_wait( lock, nullptr );
+
+        unsigned tail = *_mSqTail;
+        unsigned idx = tail & *_mSqMask;
+        struct io_uring_sqe* sqe = &_mSqes[ idx ];
+        memset( sqe, 0, sizeof( *sqe ) );
+        sqe->fd = _mFd;
+        sqe->user_data = (uint64_t)r;
+        switch( r->op )
+        {
+        case Opcode_Read:
+            sqe->opcode = IORING_OP_READV;
+            sqe->addr = (uint64_t)&r->iov;
+            sqe->len = 1;
+            sqe->off = r->off;
+            break;
+        case Opcode_Write:
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->addr = (uint64_t)&r->iov;
+            sqe->len = 1;
+            sqe->off = r->off;
+            break;
+        case Opcode_Sync:
+        default:
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            break;
+        }
+        _mSqArray[ idx ] = idx;
+        __atomic_store_n( _mSqTail, tail + 1, __ATOMIC_RELEASE );
+        _mInFlight++;
+
+        int ret;
+        do
+        {
+            ret = syscall( __NR_io_uring_enter, _mRingFd, 1, 0, 0, nullptr, 0 );
+        } while( ret < 0 && errno == EINTR );
+
+        if( ret != 1 && __atomic_load_n( _mSqHead, __ATOMIC_ACQUIRE ) == tail )
+        {
+            // The kernel didn't take the entry (out of memory, too many
+            // requests), so it is pulled back and run here instead
+            __atomic_store_n( _mSqTail, tail, __ATOMIC_RELEASE );
+            _mInFlight--;
+            r->res = execute( r );
+            r->done = true;
+        }
+        return;
+    }
+#endif
+    {
+        std::lock_guard<std::mutex> guard( _mQueueMutex );
+        _mQueue.push_back( r );
+    }
+    _mQueueCond.notify_one();
+}
+
+void Page_IO::wait( Request* r )
+{
+#ifdef DISTR_LOG_DB_HAVE_IO_URING
+    if( _mBackend == Backend_IO_Uring )
+    {
+        std::unique_lock<std::mutex> lock( _mRingMutex );
+        uring_wait( lock, r );
+        return;
+    }
+#endif
+    std::unique_lock<std::mutex> lock( _mQueueMutex );
+    while( !r->done )
+    {
+        _mDoneCond.wait( lock );
+    }
+}
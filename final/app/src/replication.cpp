@@ -0,0 +1,400 @@
+#include "distr_log_db/replication.hpp"
+
+#include <cassert>
+#include <chrono>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+
+constexpr size_t Replication_Primary::Max_History;
+constexpr int Replication_Primary::Send_Timeout_Ms;
+constexpr int Replication_Follower::Reconnect_Ms;
+
+/**
+ * @brief Starts listening for followers and attaches to the commits of the
+ * tree. Only transactions begun after this are shipped whole.
+ *
+ * @param _aTree
+ * @param address See Socket
+ */
+Replication_Primary::Replication_Primary( B_Tree& _aTree, const std::string& address )
+    : _mTree( _aTree ),
+      _mListener( Socket::listen( address ) ),
+      _mStopping( false ),
+      _mNumFollowers( 0 )
+{
+    assert( _mListener.valid() );
+    _mTree.set_commit_hook( [this]( uint32_t seq, const std::vector<B_Tree::KeyVal>& kvs ) { ship( seq, kvs ); } );
+    _mAcceptThread = std::thread( &Replication_Primary::accept_loop, this );
+    _mSendThread = std::thread( &Replication_Primary::send_loop, this );
+}
+
+/**
+ * @brief Detaches from the tree. Records already queued are still sent.
+ */
+Replication_Primary::~Replication_Primary()
+{
+    _mTree.set_commit_hook( B_Tree::Commit_Hook() );
+    {
+        std::lock_guard<std::mutex> lock( _mJobMutex );
+        _mStopping = true;
+    }
+    _mJobCond.notify_all();
+    _mListener.shutdown();
+    _mAcceptThread.join();
+    _mSendThread.join();
+}
+
+size_t Replication_Primary::num_followers()
+{
+    return _mNumFollowers;
+}
+
+/**
+ * @brief Brings followers that connected since the last commit up to date.
+ * Must be called from the thread that uses the tree.
+ */
+void Replication_Primary::poll()
+{
+    std::vector<Follower> pending;
+    {
+        std::lock_guard<std::mutex> lock( _mPendingMutex );
+        pending.swap( _mPending );
+    }
+
+    for( size_t i=0; i<pending.size(); i++ )
+    {
+        Follower& f = pending[ i ];
+        uint32_t seq = _mTree._mHeader._mReplicationSeq;
+        bool in_history = f.seq < seq && !_mHistory.empty() && _mHistory.front().first <= f.seq + 1;
+
+        // A snapshot reads the current images of the leaves, which only hold
+        // committed pairs while no transaction is open
+        if( f.seq < seq && !in_history && _mTree._mCurrTxns._mNumTransactions )
+        {
+            std::lock_guard<std::mutex> lock( _mPendingMutex );
+            _mPending.push_back( std::move( f ) );
+            continue;
+        }
+
+        catch_up( f );
+    }
+}
+
+/**
+ * @brief Commit hook, queues the commit for every follower and keeps it for
+ * followers that connect later
+ *
+ * @param seq
+ * @param kvs
+ */
+void Replication_Primary::ship( uint32_t seq, const std::vector<B_Tree::KeyVal>& kvs )
+{
+    _mHistory.push_back( Commit( seq, kvs ) );
+    if( _mHistory.size() > Max_History )
+    {
+        _mHistory.pop_front();
+    }
+
+    Job job;
+    job.records.resize( 1 );
+    job.records[ 0 ].type = Replication::Record_Commit;
+    job.records[ 0 ].seq = seq;
+    job.records[ 0 ].kvs = kvs;
+    queue( job );
+
+    poll();
+}
+
+/**
+ * @brief Queues every commit after the one the follower last applied, and
+ * hands the follower over to the sender thread. A follower ahead of the
+ * primary only gets a rejection, a snapshot would leave it with pairs the
+ * primary does not have.
+ */
+void Replication_Primary::catch_up( Follower& f )
+{
+    uint32_t seq = _mTree._mHeader._mReplicationSeq;
+    Job job;
+    if( f.seq > seq )
+    {
+        job.records.resize( 1 );
+        job.records[ 0 ].type = Replication::Record_Reject;
+        job.records[ 0 ].seq = seq;
+    }
+    else if( f.seq < seq && !_mHistory.empty() && _mHistory.front().first <= f.seq + 1 )
+    {
+        for( size_t i=f.seq + 1 - _mHistory.front().first; i<_mHistory.size(); i++ )
+        {
+            Outgoing o;
+            o.type = Replication::Record_Commit;
+            o.seq = _mHistory[ i ].first;
+            o.kvs = _mHistory[ i ].second;
+            job.records.push_back( std::move( o ) );
+        }
+    }
+    else if( f.seq < seq )
+    {
+        job.records.resize( 1 );
+        job.records[ 0 ].type = Replication::Record_Snapshot;
+        job.records[ 0 ].seq = seq;
+        _mTree.scan( 0, ~(B_Tree::Key)0, job.records[ 0 ].kvs );
+    }
+    f.seq = seq;
+    job.joining.push_back( std::move( f ) );
+    queue( job );
+}
+
+void Replication_Primary::queue( Job& job )
+{
+    {
+        std::lock_guard<std::mutex> lock( _mJobMutex );
+        _mJobs.push_back( std::move( job ) );
+    }
+    _mJobCond.notify_one();
+}
+
+/**
+ * @brief Sends the queued records in order. A follower that fails a send,
+ * or stops reading for Send_Timeout_Ms, is dropped and reconnects to catch
+ * up from its own seq. Returns once stopping with an empty queue.
+ */
+void Replication_Primary::send_loop()
+{
+    while( true )
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock( _mJobMutex );
+            while( _mJobs.empty() && !_mStopping )
+            {
+                _mJobCond.wait( lock );
+            }
+            if( _mJobs.empty() )
+            {
+                return;
+            }
+            job = std::move( _mJobs.front() );
+            _mJobs.pop_front();
+        }
+
+        if( job.joining.empty() )
+        {
+            for( size_t i=0; i<_mFollowers.size(); )
+            {
+                Follower& f = _mFollowers[ i ];
+                bool ok = true;
+                for( size_t j=0; j<job.records.size() && ok; j++ )
+                {
+                    // Already part of the follower's catch up
+                    if( job.records[ j ].seq <= f.seq ) continue;
+                    ok = send_record( f.sock, job.records[ j ].type, job.records[ j ].seq, job.records[ j ].kvs );
+                    f.seq = job.records[ j ].seq;
+                }
+                if( ok )
+                {
+                    i++;
+                }
+                else
+                {
+                    _mFollowers.erase( _mFollowers.begin() + i );
+                }
+            }
+        }
+        else
+        {
+            for( size_t i=0; i<job.joining.size(); i++ )
+            {
+                bool ok = true;
+                for( size_t j=0; j<job.records.size() && ok; j++ )
+                {
+                    ok = send_record( job.joining[ i ].sock, job.records[ j ].type, job.records[ j ].seq, job.records[ j ].kvs ) &&
+                         job.records[ j ].type != Replication::Record_Reject;
+                }
+                if( ok )
+                {
+                    _mFollowers.push_back( std::move( job.joining[ i ] ) );
+                }
+            }
+        }
+        _mNumFollowers = _mFollowers.size();
+    }
+}
+
+/**
+ * @brief Accepts followers and reads their hello, they are handed to the
+ * tree's thread through the pending list
+ */
+void Replication_Primary::accept_loop()
+{
+    while( !_mStopping )
+    {
+        Follower f;
+        f.sock = _mListener.accept();
+        if( !f.sock.valid() )
+        {
+            if( _mStopping ) break;
+            continue;
+        }
+
+        Replication::Hello h;
+        if( !f.sock.read_all( &h, sizeof( h ) ) || h.magic != Replication::Magic )
+        {
+            continue;
+        }
+        f.seq = h.seq;
+
+        // A follower that stops reading is dropped rather than stalling commits
+        timeval tv;
+        tv.tv_sec = Send_Timeout_Ms / 1000;
+        tv.tv_usec = ( Send_Timeout_Ms % 1000 ) * 1000;
+        setsockopt( f.sock.fd(), SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) );
+
+        std::lock_guard<std::mutex> lock( _mPendingMutex );
+        _mPending.push_back( std::move( f ) );
+    }
+}
+
+bool Replication_Primary::send_record( Socket& s, uint32_t type, uint32_t seq, const std::vector<B_Tree::KeyVal>& kvs )
+{
+    Replication::Record r;
+    r.magic = Replication::Magic;
+    r.type = type;
+    r.seq = seq;
+    r.count = kvs.size();
+    return s.write_all( &r, sizeof( r ) ) &&
+           ( kvs.empty() || s.write_all( kvs.data(), kvs.size() * sizeof( B_Tree::KeyVal ) ) );
+}
+
+/**
+ * @brief Opens the local copy and starts following the primary
+ *
+ * @param file_name Local database file
+ * @param address Primary's address, see Socket
+ * @param reset If set to true, the local copy is rebuilt from scratch
+ */
+Replication_Follower::Replication_Follower( const std::string& file_name, const std::string& address, bool reset )
+    : _mAddress( address ),
+      _mTree( file_name, reset ),
+      _mStopping( false ),
+      _mRejected( false )
+{
+    _mThread = std::thread( &Replication_Follower::run, this );
+}
+
+Replication_Follower::~Replication_Follower()
+{
+    {
+        std::lock_guard<std::mutex> lock( _mMutex );
+        _mStopping = true;
+        _mSocket.shutdown();
+    }
+    _mThread.join();
+}
+
+bool Replication_Follower::find( const B_Tree::Key& k, B_Tree::Val& v )
+{
+    std::lock_guard<std::mutex> lock( _mMutex );
+    return _mTree.find( k, v );
+}
+
+uint32_t Replication_Follower::multi_find( const std::vector<B_Tree::Key>& keys, std::vector<B_Tree::Val>& vals, std::vector<bool>& found )
+{
+    std::lock_guard<std::mutex> lock( _mMutex );
+    return _mTree.multi_find( keys, vals, found );
+}
+
+void Replication_Follower::scan( const B_Tree::Key& lo, const B_Tree::Key& hi, std::vector<B_Tree::KeyVal>& kvs )
+{
+    std::lock_guard<std::mutex> lock( _mMutex );
+    _mTree.scan( lo, hi, kvs );
+}
+
+uint32_t Replication_Follower::applied_seq()
+{
+    std::lock_guard<std::mutex> lock( _mMutex );
+    return _mTree._mHeader._mReplicationSeq;
+}
+
+/**
+ * @brief Waits until the commit with the given sequence number is applied
+ *
+ * @return true Applied, false if the timeout ran out first
+ */
+bool Replication_Follower::wait_for( uint32_t seq, uint32_t timeout_ms )
+{
+    std::unique_lock<std::mutex> lock( _mMutex );
+    return _mApplied.wait_for( lock, std::chrono::milliseconds( timeout_ms ),
+                               [this, seq]() { return _mTree._mHeader._mReplicationSeq >= seq; } );
+}
+
+/**
+ * @brief Connects to the primary, asks for the commits after the last one
+ * applied and applies records as they arrive, reconnecting when the
+ * connection drops or a record is malformed. Gives up for good if the
+ * primary rejects the follower.
+ */
+void Replication_Follower::run()
+{
+    while( !_mStopping )
+    {
+        Socket s = Socket::connect( _mAddress );
+        if( !s.valid() )
+        {
+            std::this_thread::sleep_for( std::chrono::milliseconds( Reconnect_Ms ) );
+            continue;
+        }
+
+        Replication::Hello h;
+        {
+            std::lock_guard<std::mutex> lock( _mMutex );
+            if( _mStopping ) break;
+            _mSocket = std::move( s );
+            h.magic = Replication::Magic;
+            h.seq = _mTree._mHeader._mReplicationSeq;
+        }
+
+        Replication::Record r;
+        std::vector<B_Tree::KeyVal> kvs;
+        bool ok = _mSocket.write_all( &h, sizeof( h ) );
+        while( ok && _mSocket.read_all( &r, sizeof( r ) ) && r.magic == Replication::Magic && r.count <= Replication::Max_Count )
+        {
+            if( r.type == Replication::Record_Reject )
+            {
+                _mRejected = true;
+                break;
+            }
+            kvs.resize( r.count );
+            ok = kvs.empty() || _mSocket.read_all( kvs.data(), kvs.size() * sizeof( B_Tree::KeyVal ) );
+            if( ok )
+            {
+                apply( r, kvs );
+            }
+        }
+
+        std::lock_guard<std::mutex> lock( _mMutex );
+        _mSocket.close();
+        if( _mRejected ) break;
+    }
+}
+
+/**
+ * @brief Applies one record as a local transaction that also stores its
+ * sequence number. Trees never delete, so a snapshot is applied by writing
+ * every pair in it.
+ */
+void Replication_Follower::apply( const Replication::Record& r, const std::vector<B_Tree::KeyVal>& kvs )
+{
+    std::lock_guard<std::mutex> lock( _mMutex );
+    if( r.type == Replication::Record_Commit && r.seq <= _mTree._mHeader._mReplicationSeq )
+    {
+        return;
+    }
+
+    B_Tree::Txn t = _mTree.new_txn();
+    _mTree.insert_batch( kvs, t );
+    _mTree._mHeader._mReplicationSeq = r.seq;
+    _mTree.txn_commit( t );
+    _mApplied.notify_all();
+}
@@ -0,0 +1,534 @@
+#include "distr_log_db/server.hpp"
+
+#include <cassert>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+constexpr uint32_t Server::Max_Events;
+constexpr size_t Server::Read_Chunk;
+
+/**
+ * @brief Starts listening and the event loop and engine threads
+ *
+ * @param _aTree Only used by the engine thread until the server stops
+ * @param address See Socket
+ * @param num_loops Number of event loop threads
+ */
+Server::Server( B_Tree& _aTree, const std::string& address, uint32_t num_loops )
+    : _mTree( _aTree ),
+      _mListener( Socket::listen( address ) ),
+      _mStopping( false ),
+      _mNextLoop( 0 ),
+      _mEngineStopping( false )
+{
+    assert( _mListener.valid() );
+    assert( num_loops );
+    fcntl( _mListener.fd(), F_SETFL, fcntl( _mListener.fd(), F_GETFL ) | O_NONBLOCK );
+
+    _mLoops.resize( num_loops );
+    for( size_t i=0; i<_mLoops.size(); i++ )
+    {
+        Event_Loop& loop = _mLoops[ i ];
+        loop.epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+        loop.wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+        assert( loop.epoll_fd >= 0 && loop.wake_fd >= 0 );
+
+        epoll_event e;
+        e.events = EPOLLIN;
+        e.data.ptr = nullptr;
+        epoll_ctl( loop.epoll_fd, EPOLL_CTL_ADD, loop.wake_fd, &e );
+    }
+
+    epoll_event e;
+    e.events = EPOLLIN;
+    e.data.ptr = this;
+    epoll_ctl( _mLoops[ 0 ].epoll_fd, EPOLL_CTL_ADD, _mListener.fd(), &e );
+
+    _mEngine = std::thread( &Server::run_engine, this );
+    for( size_t i=0; i<_mLoops.size(); i++ )
+    {
+        _mLoops[ i ].thread = std::thread( &Server::run_loop, this, std::ref( _mLoops[ i ] ) );
+    }
+}
+
+Server::~Server()
+{
+    stop();
+    for( size_t i=0; i<_mLoops.size(); i++ )
+    {
+        close( _mLoops[ i ].epoll_fd );
+        close( _mLoops[ i ].wake_fd );
+    }
+}
+
+/**
+ * @brief Closes every connection, aborting their open transactions, and
+ * stops all threads once queued requests are answered
+ */
+void Server::stop()
+{
+    if( _mStopping.exchange( true ) ) return;
+
+    for( size_t i=0; i<_mLoops.size(); i++ )
+    {
+        uint64_t one = 1;
+        ssize_t ret = write( _mLoops[ i ].wake_fd, &one, sizeof( one ) );
+        (void)ret;
+    }
+    for( size_t i=0; i<_mLoops.size(); i++ )
+    {
+        _mLoops[ i ].thread.join();
+    }
+
+    std::vector<Connection*> conns;
+    {
+        std::lock_guard<std::mutex> lock( _mConnsMutex );
+        for( std::map<Connection*, std::shared_ptr<Connection>>::iterator it=_mConns.begin(); it!=_mConns.end(); it++ )
+        {
+            conns.push_back( it->first );
+        }
+    }
+    for( size_t i=0; i<conns.size(); i++ )
+    {
+        close_connection( conns[ i ] );
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( _mQueueMutex );
+        _mEngineStopping = true;
+        _mQueueCond.notify_one();
+    }
+    _mEngine.join();
+}
+
+void Server::run_loop( Event_Loop& loop )
+{
+    epoll_event events[ Max_Events ];
+    while( !_mStopping )
+    {
+        int n = epoll_wait( loop.epoll_fd, events, Max_Events, -1 );
+        for( int i=0; i<n; i++ )
+        {
+            void* ptr = events[ i ].data.ptr;
+            if( !ptr )
+            {
+                uint64_t count;
+                ssize_t ret = read( loop.wake_fd, &count, sizeof( count ) );
+                (void)ret;
+                continue;
+            }
+            if( ptr == this )
+            {
+                accept_connections();
+                continue;
+            }
+
+            Connection* c = (Connection*)ptr;
+            if( events[ i ].events & EPOLLOUT )
+            {
+                write_connection( c );
+            }
+            if( events[ i ].events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) )
+            {
+                read_connection( c );
+            }
+        }
+    }
+}
+
+/**
+ * @brief Accepts pending connections and spreads them over the event loops
+ */
+void Server::accept_connections()
+{
+    while( true )
+    {
+        int fd = accept4( _mListener.fd(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC );
+        if( fd < 0 )
+        {
+            if( errno == EINTR ) continue;
+            return;
+        }
+        int one = 1;
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+
+        std::shared_ptr<Connection> conn = std::make_shared<Connection>();
+        conn->fd = fd;
+        conn->epoll_fd = _mLoops[ _mNextLoop++ % _mLoops.size() ].epoll_fd;
+        conn->closed = false;
+        {
+            std::lock_guard<std::mutex> lock( _mConnsMutex );
+            _mConns[ conn.get() ] = conn;
+        }
+
+        epoll_event e;
+        e.events = EPOLLIN;
+        e.data.ptr = conn.get();
+        epoll_ctl( conn->epoll_fd, EPOLL_CTL_ADD, fd, &e );
+    }
+}
+
+/**
+ * @brief Reads everything available and queues each complete request, all
+ * requests from one read are queued together
+ */
+void Server::read_connection( Connection* c )
+{
+    char buf[ Read_Chunk ];
+    bool eof = false;
+    while( true )
+    {
+        ssize_t n = recv( c->fd, buf, sizeof( buf ), 0 );
+        if( n > 0 )
+        {
+            c->in.append( buf, n );
+            continue;
+        }
+        if( n < 0 && errno == EINTR ) continue;
+        eof = n == 0 || ( errno != EAGAIN && errno != EWOULDBLOCK );
+        break;
+    }
+
+    size_t num_requests = c->in.size() / sizeof( Protocol::Request );
+    if( num_requests )
+    {
+        std::shared_ptr<Connection> conn;
+        {
+            std::lock_guard<std::mutex> lock( _mConnsMutex );
+            conn = _mConns[ c ];
+        }
+
+        const Protocol::Request* reqs = (const Protocol::Request*)c->in.data();
+        std::lock_guard<std::mutex> lock( _mQueueMutex );
+        for( size_t i=0; i<num_requests; i++ )
+        {
+            Work w;
+            w.conn = conn;
+            w.req = reqs[ i ];
+            w.close = false;
+            _mQueue.push_back( w );
+        }
+        c->in.erase( 0, num_requests * sizeof( Protocol::Request ) );
+        _mQueueCond.notify_one();
+    }
+
+    // Requests that arrived before the end of the stream still run
+    if( eof )
+    {
+        close_connection( c );
+    }
+}
+
+/**
+ * @brief Sends as much pending output as the socket takes, and stops
+ * waiting for the socket to drain once nothing is left
+ */
+void Server::write_connection( Connection* c )
+{
+    std::lock_guard<std::mutex> lock( c->mutex );
+    if( c->closed ) return;
+
+    while( !c->out.empty() )
+    {
+        ssize_t n = send( c->fd, c->out.data(), c->out.size(), MSG_NOSIGNAL );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) break;
+        c->out.erase( 0, n );
+    }
+
+    epoll_event e;
+    e.events = c->out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+    e.data.ptr = c;
+    epoll_ctl( c->epoll_fd, EPOLL_CTL_MOD, c->fd, &e );
+}
+
+/**
+ * @brief Closes the socket and has the engine abort the connection's open
+ * transactions
+ */
+void Server::close_connection( Connection* c )
+{
+    Work w;
+    {
+        std::lock_guard<std::mutex> lock( _mConnsMutex );
+        std::map<Connection*, std::shared_ptr<Connection>>::iterator it = _mConns.find( c );
+        if( it == _mConns.end() ) return;
+        w.conn = it->second;
+        _mConns.erase( it );
+    }
+    {
+        std::lock_guard<std::mutex> lock( c->mutex );
+        c->closed = true;
+        epoll_ctl( c->epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr );
+        close( c->fd );
+    }
+
+    w.req = Protocol::Request();
+    w.close = true;
+    std::lock_guard<std::mutex> lock( _mQueueMutex );
+    _mQueue.push_back( w );
+    _mQueueCond.notify_one();
+}
+
+void Server::run_engine()
+{
+    std::vector<Work> batch;
+    while( true )
+    {
+        {
+            std::unique_lock<std::mutex> lock( _mQueueMutex );
+            _mQueueCond.wait( lock, [this]() { return _mEngineStopping || !_mQueue.empty(); } );
+            if( _mQueue.empty() ) break;
+            batch.swap( _mQueue );
+        }
+
+        for( size_t i=0; i<batch.size(); i++ )
+        {
+            execute( batch[ i ] );
+        }
+        flush_gets();
+        flush_puts();
+        send_responses();
+        batch.clear();
+    }
+}
+
+/**
+ * @brief Runs one request. Gets and standalone puts are held back and run
+ * in groups, a request of any other kind first runs the held back groups so
+ * each connection sees its requests take effect in order.
+ */
+void Server::execute( Work& w )
+{
+    Connection* c = w.conn.get();
+    const Protocol::Request& req = w.req;
+
+    if( w.close )
+    {
+        flush_gets();
+        flush_puts();
+        while( !c->txns.empty() )
+        {
+            end_txn( c, *c->txns.begin(), false );
+        }
+        return;
+    }
+
+    switch( req.op )
+    {
+    case Protocol::Op_Get:
+        flush_puts();
+        _mGets.push_back( w );
+        return;
+
+    case Protocol::Op_Put:
+        flush_gets();
+        if( !req.txn )
+        {
+            if( _mLocks.count( req.k ) )
+            {
+                respond( w.conn, req, Protocol::Status_Conflict );
+                return;
+            }
+            _mPuts.push_back( w );
+            return;
+        }
+        flush_puts();
+        if( !c->txns.count( req.txn ) )
+        {
+            respond( w.conn, req, Protocol::Status_Error );
+        }
+        else if( !lock_key( req.k, req.txn ) )
+        {
+            respond( w.conn, req, Protocol::Status_Conflict );
+        }
+        else
+        {
+            _mTree.insert( req.k, req.v, req.txn );
+            respond( w.conn, req, Protocol::Status_Ok, req.txn );
+        }
+        return;
+
+    case Protocol::Op_Scan:
+    {
+        flush_gets();
+        flush_puts();
+        std::vector<B_Tree::KeyVal> kvs;
+        _mTree.scan( req.k, req.hi, kvs );
+        respond( w.conn, req, Protocol::Status_Ok, 0, kvs.data(), kvs.size() );
+        return;
+    }
+
+    case Protocol::Op_Begin:
+    {
+        flush_puts();
+        // Every open transaction must be able to abort into the abort list,
+        // and group commits need a transaction of their own
+        uint32_t open = _mTree._mCurrTxns._mNumTransactions;
+        if( open + 1 >= B_Tree::Max_Num_Txns || _mTree._mAbortTxns._mNumTransactions + open + 1 >= B_Tree::Max_Num_Txns )
+        {
+            respond( w.conn, req, Protocol::Status_Error );
+            return;
+        }
+        B_Tree::Txn t = _mTree.new_txn();
+        c->txns.insert( t );
+        respond( w.conn, req, Protocol::Status_Ok, t );
+        return;
+    }
+
+    case Protocol::Op_Commit:
+    case Protocol::Op_Abort:
+        flush_gets();
+        flush_puts();
+        if( !c->txns.count( req.txn ) )
+        {
+            respond( w.conn, req, Protocol::Status_Error );
+            return;
+        }
+        end_txn( c, req.txn, req.op == Protocol::Op_Commit );
+        respond( w.conn, req, Protocol::Status_Ok, req.txn );
+        return;
+
+    default:
+        respond( w.conn, req, Protocol::Status_Error );
+        return;
+    }
+}
+
+/**
+ * @brief Looks up the held back gets with one multi_find
+ */
+void Server::flush_gets()
+{
+    if( _mGets.empty() ) return;
+
+    std::vector<B_Tree::Key> keys( _mGets.size() );
+    for( size_t i=0; i<_mGets.size(); i++ )
+    {
+        keys[ i ] = _mGets[ i ].req.k;
+    }
+    std::vector<B_Tree::Val> vals;
+    std::vector<bool> found;
+    _mTree.multi_find( keys, vals, found );
+
+    for( size_t i=0; i<_mGets.size(); i++ )
+    {
+        if( found[ i ] )
+        {
+            B_Tree::KeyVal kv;
+            kv.k = keys[ i ];
+            kv.v = vals[ i ];
+            respond( _mGets[ i ].conn, _mGets[ i ].req, Protocol::Status_Ok, 0, &kv, 1 );
+        }
+        else
+        {
+            respond( _mGets[ i ].conn, _mGets[ i ].req, Protocol::Status_Not_Found );
+        }
+    }
+    _mGets.clear();
+}
+
+/**
+ * @brief Writes the held back standalone puts as one transaction, they are
+ * answered once it has committed
+ */
+void Server::flush_puts()
+{
+    if( _mPuts.empty() ) return;
+
+    std::vector<B_Tree::KeyVal> kvs( _mPuts.size() );
+    for( size_t i=0; i<_mPuts.size(); i++ )
+    {
+        kvs[ i ].k = _mPuts[ i ].req.k;
+        kvs[ i ].v = _mPuts[ i ].req.v;
+    }
+    B_Tree::Txn t = _mTree.new_txn();
+    _mTree.insert_batch( kvs, t );
+    _mTree.txn_commit( t );
+
+    for( size_t i=0; i<_mPuts.size(); i++ )
+    {
+        respond( _mPuts[ i ].conn, _mPuts[ i ].req, Protocol::Status_Ok );
+    }
+    _mPuts.clear();
+}
+
+/**
+ * @brief Locks a key to a transaction
+ *
+ * @return true Locked, false if another transaction holds it
+ */
+bool Server::lock_key( const B_Tree::Key& k, B_Tree::Txn t )
+{
+    std::map<B_Tree::Key, B_Tree::Txn>::iterator it = _mLocks.find( k );
+    if( it != _mLocks.end() )
+    {
+        return it->second == t;
+    }
+    _mLocks[ k ] = t;
+    return true;
+}
+
+void Server::end_txn( Connection* c, B_Tree::Txn t, bool commit )
+{
+    if( commit )
+    {
+        _mTree.txn_commit( t );
+    }
+    else
+    {
+        _mTree.txn_abort( t );
+    }
+
+    for( std::map<B_Tree::Key, B_Tree::Txn>::iterator it=_mLocks.begin(); it!=_mLocks.end(); )
+    {
+        if( it->second == t )
+        {
+            _mLocks.erase( it++ );
+        }
+        else
+        {
+            it++;
+        }
+    }
+    c->txns.erase( t );
+}
+
+/**
+ * @brief Queues a response, responses are sent together once the batch is
+ * done
+ */
+void Server::respond( const std::shared_ptr<Connection>& conn, const Protocol::Request& req, uint8_t status,
+                      B_Tree::Txn txn, const B_Tree::KeyVal* kvs, uint32_t count )
+{
+    Protocol::Response r = Protocol::Response();
+    r.id = req.id;
+    r.status = status;
+    r.txn = txn;
+    r.count = count;
+
+    std::lock_guard<std::mutex> lock( conn->mutex );
+    if( conn->closed ) return;
+    if( conn->out.empty() )
+    {
+        _mTouched.push_back( conn );
+    }
+    conn->out.append( (const char*)&r, sizeof( r ) );
+    conn->out.append( (const char*)kvs, count * sizeof( B_Tree::KeyVal ) );
+}
+
+void Server::send_responses()
+{
+    for( size_t i=0; i<_mTouched.size(); i++ )
+    {
+        write_connection( _mTouched[ i ].get() );
+    }
+    _mTouched.clear();
+}
@@ -0,0 +1,47 @@
+#include "distr_log_db/b_plus.hpp"
+#include "distr_log_db/server.hpp"
+
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+
+#include <pthread.h>
+
+/**
+ * @brief Serves a database until interrupted
+ *
+ * Usage: distr_log_db_server <database file> <address> [event loop threads]
+ */
+int main( int argc, char** argv )
+{
+    if( argc < 3 )
+    {
+        std::cerr << "Usage: " << argv[ 0 ] << " <database file> <address> [event loop threads]" << std::endl;
+        std::cerr << "  address is unix:<path> or tcp:<host>:<port>" << std::endl;
+        return 1;
+    }
+    uint32_t num_loops = argc > 3 ? atoi( argv[ 3 ] ) : 2;
+
+    // Signals are taken synchronously below, threads started after this
+    // inherit the mask
+    sigset_t signals;
+    sigemptyset( &signals );
+    sigaddset( &signals, SIGINT );
+    sigaddset( &signals, SIGTERM );
+    pthread_sigmask( SIG_BLOCK, &signals, nullptr );
+
+    B_Tree tree( argv[ 1 ] );
+    {
+        Server server( tree, argv[ 2 ], num_loops ? num_loops : 1 );
+        std::cout << "Serving " << argv[ 1 ] << " on " << argv[ 2 ];
+        if( server.port() )
+        {
+            std::cout << " (port " << server.port() << ")";
+        }
+        std::cout << std::endl;
+
+        int sig;
+        sigwait( &signals, &sig );
+    }
+    return 0;
+}
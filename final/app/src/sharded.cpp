@@ -0,0 +1,501 @@
+#include "distr_log_db/sharded.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * @brief Opens the shard's tree and starts its worker
+ *
+ * @param file_name
+ * @param _aLo Smallest key routed to the shard
+ * @param _aHi Largest key routed to the shard
+ * @param _aFileId
+ * @param reset If set to true, the shard file is overwritten
+ */
+Sharded_B_Tree::Shard::Shard( const std::string& file_name, Key _aLo, Key _aHi, uint32_t _aFileId, bool reset )
+    : _mLo( _aLo ),
+      _mHi( _aHi ),
+      _mFileId( _aFileId ),
+      _mTree( new B_Tree( file_name, reset ) ),
+      _mRetired( false ),
+      _mStopping( false ),
+      _mOps( 0 )
+{
+    _mWorker = std::thread( &Shard::run, this );
+}
+
+Sharded_B_Tree::Shard::~Shard()
+{
+    stop();
+    delete _mTree;
+}
+
+void Sharded_B_Tree::Shard::submit( const std::function<void()>& task )
+{
+    std::lock_guard<std::mutex> lock( _mMutex );
+    _mTasks.push_back( task );
+    _mCond.notify_one();
+}
+
+/**
+ * @brief Worker loop, the shard's tree is only ever used from here
+ */
+void Sharded_B_Tree::Shard::run()
+{
+    std::unique_lock<std::mutex> lock( _mMutex );
+    while( true )
+    {
+        _mCond.wait( lock, [this]() { return _mStopping || !_mTasks.empty(); } );
+        if( _mTasks.empty() )
+        {
+            break;
+        }
+        std::function<void()> task = _mTasks.front();
+        _mTasks.pop_front();
+
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+/**
+ * @brief Runs the queued operations and stops the worker
+ */
+void Sharded_B_Tree::Shard::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock( _mMutex );
+        _mStopping = true;
+        _mCond.notify_one();
+    }
+    if( _mWorker.joinable() )
+    {
+        _mWorker.join();
+    }
+}
+
+/**
+ * @brief Opens the shards listed in the manifest, or creates a new set of
+ * shards that split the key space evenly
+ *
+ * @param base_name Manifest and shard files are named after it
+ * @param num_shards Number of shards when creating
+ * @param reset If set to true, existing shards are dropped
+ */
+Sharded_B_Tree::Sharded_B_Tree( const std::string& base_name, uint32_t num_shards, bool reset )
+    : _mBaseName( base_name ),
+      _mNextFileId( 0 )
+{
+    assert( num_shards );
+    if( !reset && load_manifest() )
+    {
+        return;
+    }
+
+    uint64_t span = ( (uint64_t)1 << 32 ) / num_shards;
+    for( uint32_t i=0; i<num_shards; i++ )
+    {
+        Key lo = i * span;
+        Key hi = i + 1 == num_shards ? ~(Key)0 : ( i + 1 ) * span - 1;
+        _mShards.push_back( std::make_shared<Shard>( shard_file( _mNextFileId ), lo, hi, _mNextFileId, true ) );
+        _mNextFileId++;
+    }
+    store_manifest();
+}
+
+Sharded_B_Tree::~Sharded_B_Tree()
+{
+    _mShards.clear();
+    _mRetiredShards.clear();
+}
+
+/**
+ * @brief Inserts the pair as a transaction of its own on the owning shard
+ *
+ * @param k
+ * @param v
+ */
+void Sharded_B_Tree::insert( const Key& k, const Val& v )
+{
+    for_range( k, k, [&]( B_Tree& tree, Key, Key )
+    {
+        B_Tree::Txn t = tree.new_txn();
+        tree.insert( k, v, t );
+        tree.txn_commit( t );
+    } );
+}
+
+/**
+ * @brief Inserts all pairs, each shard writes its part as one transaction and
+ * the shards work in parallel
+ *
+ * @param kvs
+ */
+void Sharded_B_Tree::insert_batch( const std::vector<KeyVal>& kvs )
+{
+    if( kvs.empty() ) return;
+
+    std::vector<KeyVal> sorted( kvs );
+    std::stable_sort( sorted.begin(), sorted.end(), []( const KeyVal& a, const KeyVal& b ) { return a.k < b.k; } );
+
+    for_range( sorted.front().k, sorted.back().k, [&]( B_Tree& tree, Key lo, Key hi )
+    {
+        std::vector<KeyVal>::const_iterator first = std::lower_bound( sorted.begin(), sorted.end(), lo,
+            []( const KeyVal& a, const Key& k ) { return a.k < k; } );
+        std::vector<KeyVal>::const_iterator last = std::upper_bound( sorted.begin(), sorted.end(), hi,
+            []( const Key& k, const KeyVal& a ) { return k < a.k; } );
+        if( first == last ) return;
+
+        B_Tree::Txn t = tree.new_txn();
+        tree.insert_batch( std::vector<KeyVal>( first, last ), t );
+        tree.txn_commit( t );
+    } );
+}
+
+bool Sharded_B_Tree::find( const Key& k, Val& v )
+{
+    bool found = false;
+    for_range( k, k, [&]( B_Tree& tree, Key, Key )
+    {
+        found = tree.find( k, v );
+    } );
+    return found;
+}
+
+/**
+ * @brief Looks up many keys, each shard looks up its keys in parallel
+ *
+ * @return uint32_t Number of keys found
+ */
+uint32_t Sharded_B_Tree::multi_find( const std::vector<Key>& keys, std::vector<Val>& vals, std::vector<bool>& found )
+{
+    uint32_t n = keys.size();
+    vals.resize( n );
+    found.assign( n, false );
+    if( !n ) return 0;
+
+    std::vector<uint32_t> order( n );
+    for( uint32_t i=0; i<n; i++ )
+    {
+        order[ i ] = i;
+    }
+    std::sort( order.begin(), order.end(), [&]( uint32_t a, uint32_t b ) { return keys[ a ] < keys[ b ]; } );
+
+    // Shards write disjoint entries, vector<bool> packs bits so is avoided
+    std::vector<uint8_t> hit( n, 0 );
+    for_range( keys[ order.front() ], keys[ order.back() ], [&]( B_Tree& tree, Key lo, Key hi )
+    {
+        std::vector<uint32_t>::const_iterator first = std::lower_bound( order.begin(), order.end(), lo,
+            [&]( uint32_t a, const Key& k ) { return keys[ a ] < k; } );
+        std::vector<uint32_t>::const_iterator last = std::upper_bound( order.begin(), order.end(), hi,
+            [&]( const Key& k, uint32_t a ) { return k < keys[ a ]; } );
+        if( first == last ) return;
+
+        std::vector<Key> part;
+        for( std::vector<uint32_t>::const_iterator it=first; it!=last; it++ )
+        {
+            part.push_back( keys[ *it ] );
+        }
+        std::vector<Val> part_vals;
+        std::vector<bool> part_found;
+        tree.multi_find( part, part_vals, part_found );
+        for( size_t i=0; i<part.size(); i++ )
+        {
+            vals[ first[ i ] ] = part_vals[ i ];
+            hit[ first[ i ] ] = part_found[ i ];
+        }
+    } );
+
+    uint32_t num_found = 0;
+    for( uint32_t i=0; i<n; i++ )
+    {
+        found[ i ] = hit[ i ];
+        num_found += hit[ i ];
+    }
+    return num_found;
+}
+
+/**
+ * @brief Collects every pair with lo <= key <= hi in key order, shards are
+ * scanned in parallel
+ *
+ * @param lo
+ * @param hi
+ * @param kvs Matching pairs are appended
+ */
+void Sharded_B_Tree::scan( const Key& lo, const Key& hi, std::vector<KeyVal>& kvs )
+{
+    if( lo > hi ) return;
+
+    std::mutex m;
+    std::vector<std::pair<Key, std::vector<KeyVal>>> parts;
+    for_range( lo, hi, [&]( B_Tree& tree, Key part_lo, Key part_hi )
+    {
+        std::vector<KeyVal> part;
+        tree.scan( part_lo, part_hi, part );
+        std::lock_guard<std::mutex> lock( m );
+        parts.push_back( std::make_pair( part_lo, std::vector<KeyVal>() ) );
+        parts.back().second.swap( part );
+    } );
+
+    std::sort( parts.begin(), parts.end(),
+        []( const std::pair<Key, std::vector<KeyVal>>& a, const std::pair<Key, std::vector<KeyVal>>& b ) { return a.first < b.first; } );
+    for( size_t i=0; i<parts.size(); i++ )
+    {
+        kvs.insert( kvs.end(), parts[ i ].second.begin(), parts[ i ].second.end() );
+    }
+}
+
+/**
+ * @brief Runs an operation on every shard holding part of [lo, hi], in
+ * parallel, and waits for all of them. Parts that reached a shard after it
+ * was split are routed again.
+ *
+ * @param lo
+ * @param hi
+ * @param op Called on each shard's worker with the part of the range it holds
+ */
+void Sharded_B_Tree::for_range( Key lo, Key hi, const Range_Op& op )
+{
+    struct Part
+    {
+        std::shared_ptr<Shard> shard;
+        Key lo;
+        Key hi;
+    };
+    std::vector<Part> parts;
+    {
+        std::lock_guard<std::mutex> lock( _mRouteMutex );
+        for( size_t i=0; i<_mShards.size(); i++ )
+        {
+            const std::shared_ptr<Shard>& s = _mShards[ i ];
+            if( s->_mHi < lo || s->_mLo > hi ) continue;
+
+            Part p;
+            p.shard = s;
+            p.lo = std::max( lo, s->_mLo );
+            p.hi = std::min( hi, s->_mHi );
+            parts.push_back( p );
+        }
+    }
+
+    std::vector<std::promise<bool>> done( parts.size() );
+    for( size_t i=0; i<parts.size(); i++ )
+    {
+        Shard* s = parts[ i ].shard.get();
+        std::promise<bool>* p = &done[ i ];
+        Key part_lo = parts[ i ].lo;
+        Key part_hi = parts[ i ].hi;
+        s->submit( [s, p, part_lo, part_hi, &op]()
+        {
+            if( s->_mRetired )
+            {
+                p->set_value( false );
+                return;
+            }
+            s->_mOps++;
+            op( *s->_mTree, part_lo, part_hi );
+            p->set_value( true );
+        } );
+    }
+
+    for( size_t i=0; i<parts.size(); i++ )
+    {
+        if( !done[ i ].get_future().get() )
+        {
+            for_range( parts[ i ].lo, parts[ i ].hi, op );
+        }
+    }
+}
+
+/**
+ * @brief Splits a shard in two at its median key. The shard's pairs are
+ * copied into two new shard files on its own worker, so only operations on
+ * this shard wait, and the manifest is then switched over to the new files.
+ *
+ * @param idx
+ * @return true Split, false if the shard holds fewer than two keys or has a
+ * transaction open
+ */
+bool Sharded_B_Tree::split_shard( size_t idx )
+{
+    std::shared_ptr<Shard> s;
+    {
+        std::lock_guard<std::mutex> lock( _mRouteMutex );
+        if( idx >= _mShards.size() ) return false;
+        s = _mShards[ idx ];
+    }
+
+    std::promise<bool> done;
+    s->submit( [this, &s, &done]()
+    {
+        bool split_done = false;
+        if( !s->_mRetired )
+        {
+            split( s.get(), split_done );
+        }
+        done.set_value( split_done );
+    } );
+    return done.get_future().get();
+}
+
+/**
+ * @brief Shard that served the most operations
+ */
+size_t Sharded_B_Tree::hottest_shard()
+{
+    std::lock_guard<std::mutex> lock( _mRouteMutex );
+    size_t hottest = 0;
+    for( size_t i=1; i<_mShards.size(); i++ )
+    {
+        if( _mShards[ i ]->_mOps > _mShards[ hottest ]->_mOps )
+        {
+            hottest = i;
+        }
+    }
+    return hottest;
+}
+
+size_t Sharded_B_Tree::num_shards()
+{
+    std::lock_guard<std::mutex> lock( _mRouteMutex );
+    return _mShards.size();
+}
+
+/**
+ * @brief Does the work of split_shard, runs on the worker of the shard
+ */
+void Sharded_B_Tree::split( Shard* s, bool& split_done )
+{
+    // Scans read uncommitted entries, and prepared transactions must stay
+    // in the shard file their coordinator expects
+    if( s->_mTree->_mCurrTxns._mNumTransactions ) return;
+
+    std::vector<KeyVal> kvs;
+    s->_mTree->scan( s->_mLo, s->_mHi, kvs );
+    if( kvs.size() < 2 ) return;
+
+    size_t mid = kvs.size() / 2;
+    Key at = kvs[ mid ].k;
+
+    uint32_t lower_id, upper_id;
+    {
+        std::lock_guard<std::mutex> lock( _mRouteMutex );
+        lower_id = _mNextFileId++;
+        upper_id = _mNextFileId++;
+    }
+
+    // The new shards are not routed to yet, so they are filled from here
+    std::shared_ptr<Shard> lower = std::make_shared<Shard>( shard_file( lower_id ), s->_mLo, at - 1, lower_id, true );
+    std::shared_ptr<Shard> upper = std::make_shared<Shard>( shard_file( upper_id ), at, s->_mHi, upper_id, true );
+
+    B_Tree::Txn t = lower->_mTree->new_txn();
+    lower->_mTree->insert_batch( std::vector<KeyVal>( kvs.begin(), kvs.begin() + mid ), t );
+    lower->_mTree->txn_commit( t );
+
+    t = upper->_mTree->new_txn();
+    upper->_mTree->insert_batch( std::vector<KeyVal>( kvs.begin() + mid, kvs.end() ), t );
+    upper->_mTree->txn_commit( t );
+
+    {
+        std::lock_guard<std::mutex> lock( _mRouteMutex );
+        for( size_t i=0; i<_mShards.size(); i++ )
+        {
+            if( _mShards[ i ].get() == s )
+            {
+                _mRetiredShards.push_back( _mShards[ i ] );
+                _mShards[ i ] = lower;
+                _mShards.insert( _mShards.begin() + i + 1, upper );
+                break;
+            }
+        }
+        store_manifest();
+    }
+
+    // Queued operations see the flag and are routed to the new shards. The
+    // old file goes only now that the manifest naming its successors is
+    // durable.
+    s->_mRetired = true;
+    delete s->_mTree;
+    s->_mTree = nullptr;
+    std::remove( shard_file( s->_mFileId ).c_str() );
+    split_done = true;
+}
+
+std::string Sharded_B_Tree::shard_file( uint32_t file_id ) const
+{
+    return _mBaseName + "." + std::to_string( file_id ) + ".dtb";
+}
+
+/**
+ * @brief Opens the shards listed in the manifest
+ *
+ * @return true Loaded, false if there is no valid manifest
+ */
+bool Sharded_B_Tree::load_manifest()
+{
+    std::ifstream f( manifest_file() );
+    uint32_t num_shards;
+    if( !( f >> _mNextFileId >> num_shards ) || !num_shards ) return false;
+
+    for( uint32_t i=0; i<num_shards; i++ )
+    {
+        Key lo, hi;
+        uint32_t file_id;
+        if( !( f >> lo >> hi >> file_id ) )
+        {
+            _mShards.clear();
+            return false;
+        }
+        _mShards.push_back( std::make_shared<Shard>( shard_file( file_id ), lo, hi, file_id, false ) );
+    }
+    return true;
+}
+
+/**
+ * @brief Writes the manifest to a temporary file and renames it over the old
+ * one, so a crash leaves either the old or the new set of shards. Returns
+ * once the rename is durable, only then may files the old manifest names be
+ * removed.
+ */
+void Sharded_B_Tree::store_manifest()
+{
+    std::ostringstream m;
+    m << _mNextFileId << " " << _mShards.size() << "\n";
+    for( size_t i=0; i<_mShards.size(); i++ )
+    {
+        m << _mShards[ i ]->_mLo << " " << _mShards[ i ]->_mHi << " " << _mShards[ i ]->_mFileId << "\n";
+    }
+    std::string contents = m.str();
+
+    std::string tmp = manifest_file() + ".tmp";
+    int fd = ::open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    assert( fd >= 0 );
+    ssize_t n = ::write( fd, contents.data(), contents.size() );
+    assert( n == (ssize_t)contents.size() );
+    (void)n;
+    int ret = fsync( fd );
+    assert( !ret );
+    close( fd );
+
+    ret = std::rename( tmp.c_str(), manifest_file().c_str() );
+    assert( !ret );
+
+    // The rename itself is only durable once the directory is
+    std::string::size_type slash = _mBaseName.rfind( '/' );
+    std::string dir = slash == std::string::npos ? "." : _mBaseName.substr( 0, slash + 1 );
+    fd = ::open( dir.c_str(), O_RDONLY | O_DIRECTORY );
+    assert( fd >= 0 );
+    ret = fsync( fd );
+    assert( !ret );
+    (void)ret;
+    close( fd );
+}
@@ -0,0 +1,188 @@
+#include "distr_log_db/socket.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * @brief Resolves an address string into a socket address
+ *
+ * @return int Address family, or -1 if the address is malformed
+ */
+static int parse_address( const std::string& address, sockaddr_storage& sa, socklen_t& len )
+{
+    memset( &sa, 0, sizeof( sa ) );
+    if( address.compare( 0, 5, "unix:" ) == 0 )
+    {
+        sockaddr_un* un = (sockaddr_un*)&sa;
+        std::string path = address.substr( 5 );
+        if( path.size() >= sizeof( un->sun_path ) ) return -1;
+        un->sun_family = AF_UNIX;
+        memcpy( un->sun_path, path.c_str(), path.size() + 1 );
+        len = sizeof( sockaddr_un );
+        return AF_UNIX;
+    }
+    if( address.compare( 0, 4, "tcp:" ) == 0 )
+    {
+        size_t colon = address.rfind( ':' );
+        if( colon <= 4 ) return -1;
+        std::string host = address.substr( 4, colon - 4 );
+        std::string port = address.substr( colon + 1 );
+
+        addrinfo hints;
+        memset( &hints, 0, sizeof( hints ) );
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* res;
+        if( getaddrinfo( host.c_str(), port.c_str(), &hints, &res ) ) return -1;
+        memcpy( &sa, res->ai_addr, res->ai_addrlen );
+        len = res->ai_addrlen;
+        freeaddrinfo( res );
+        return AF_INET;
+    }
+    return -1;
+}
+
+Socket Socket::listen( const std::string& address )
+{
+    sockaddr_storage sa;
+    socklen_t len;
+    int family = parse_address( address, sa, len );
+    if( family < 0 ) return Socket();
+
+    Socket s( ::socket( family, SOCK_STREAM | SOCK_CLOEXEC, 0 ) );
+    if( !s.valid() ) return s;
+
+    if( family == AF_UNIX )
+    {
+        unlink( ( (sockaddr_un*)&sa )->sun_path );
+    }
+    else
+    {
+        int one = 1;
+        setsockopt( s._mFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+    }
+
+    if( ::bind( s._mFd, (sockaddr*)&sa, len ) || ::listen( s._mFd, 64 ) )
+    {
+        s.close();
+    }
+    return s;
+}
+
+Socket Socket::connect( const std::string& address )
+{
+    sockaddr_storage sa;
+    socklen_t len;
+    int family = parse_address( address, sa, len );
+    if( family < 0 ) return Socket();
+
+    Socket s( ::socket( family, SOCK_STREAM | SOCK_CLOEXEC, 0 ) );
+    if( !s.valid() ) return s;
+
+    if( ::connect( s._mFd, (sockaddr*)&sa, len ) )
+    {
+        s.close();
+        return s;
+    }
+    if( family == AF_INET )
+    {
+        int one = 1;
+        setsockopt( s._mFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    }
+    return s;
+}
+
+Socket Socket::accept()
+{
+    int fd;
+    do
+    {
+        fd = ::accept4( _mFd, nullptr, nullptr, SOCK_CLOEXEC );
+    } while( fd < 0 && errno == EINTR );
+    return Socket( fd );
+}
+
+/**
+ * @brief Writes the whole buffer, retrying short writes
+ *
+ * @return true Everything was written, false if the peer went away
+ */
+bool Socket::write_all( const void* buf, size_t len )
+{
+    const char* ptr = (const char*)buf;
+    while( len )
+    {
+        ssize_t n = ::send( _mFd, ptr, len, MSG_NOSIGNAL );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) return false;
+        ptr += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Reads exactly len bytes, retrying short reads
+ *
+ * @return true Everything was read, false on end of stream or error
+ */
+bool Socket::read_all( void* buf, size_t len )
+{
+    char* ptr = (char*)buf;
+    while( len )
+    {
+        ssize_t n = ::recv( _mFd, ptr, len, 0 );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) return false;
+        ptr += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * @brief Wakes up any thread blocked on the socket without releasing it
+ */
+void Socket::shutdown()
+{
+    if( _mFd >= 0 )
+    {
+        ::shutdown( _mFd, SHUT_RDWR );
+    }
+}
+
+void Socket::close()
+{
+    if( _mFd >= 0 )
+    {
+        ::close( _mFd );
+        _mFd = -1;
+    }
+}
+
+uint16_t Socket::port() const
+{
+    sockaddr_storage sa;
+    socklen_t len = sizeof( sa );
+    if( getsockname( _mFd, (sockaddr*)&sa, &len ) || sa.ss_family != AF_INET ) return 0;
+    return ntohs( ( (sockaddr_in*)&sa )->sin_port );
+}
+
+Socket& Socket::operator=( Socket&& s )
+{
+    if( this != &s )
+    {
+        close();
+        _mFd = s._mFd;
+        s._mFd = -1;
+    }
+    return *this;
+}
@@ -1,5 +1,6 @@
 #include "distr_log_db/b_plus.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <string>
@@ -7,6 +8,8 @@
 B_Tree::Tree_Node::Tree_Node( B_Tree* _aPar, uint32_t _aNodeId, bool exists )
 {
     _mPar = _aPar;
+    // A new node has never been written
+    _mDirty = !exists;
     if( exists )
     {
         _mPar->fetch_node( this, _aNodeId );
@@ -20,23 +23,56 @@ B_Tree::Tree_Node::Tree_Node( B_Tree* _aPar, uint32_t _aNodeId, bool exists )
 }
 
 B_Tree::Tree_Node::~Tree_Node()
+{
+    if( _mDirty )
+    {
+        persist();
+    }
+}
+
+void B_Tree::Tree_Node::persist()
 {
     snprintf( foo, sizeof( foo ), "\nTree: %02x\n", _mNodeId );
     _mPar->store_node( this, _mNodeId );
+    _mDirty = false;
 }
 
-void B_Tree::Tree_Node::split( Node*& n )
+void B_Tree::Tree_Node::split( Node*& n, uint32_t at )
 {
     assert( _mSize == Tree_Node_Order );
+    assert( at && at < Tree_Node_Order );
     uint32_t id;
     Tree_Node* ptr = _mPar->new_tree_node( id );
     n = ptr;
 
-    _mSize = Leaf_Node_Order / 2;
-    ptr->_mSize = Leaf_Node_Order - _mSize;
+    _mDirty = true;
+    _mSize = at;
+    ptr->_mSize = Tree_Node_Order - _mSize;
 
     memcpy( &ptr->_mChildNodes[ 0 ], &_mChildNodes[ _mSize ], sizeof( uint32_t ) * ptr->_mSize );
     memcpy( &ptr->_mKeys[ 0 ], &_mKeys[ _mSize ], sizeof( Key ) * ( ptr->_mSize - 1 ) );
+    memcpy( &ptr->_mCounts[ 0 ], &_mCounts[ _mSize ], sizeof( uint32_t ) * ptr->_mSize );
+    memcpy( &ptr->_mReduced[ 0 ], &_mReduced[ _mSize ], sizeof( uint64_t ) * ptr->_mSize );
+
+    // Pending upserts follow their keys, split at the key the parent will
+    // route by
+    if( _mBuffer.size() )
+    {
+        Key boundary = ptr->smallest();
+        size_t kept = 0;
+        for( size_t i=0; i<_mBuffer.size(); i++ )
+        {
+            if( _mBuffer[ i ].k < boundary )
+            {
+                _mBuffer[ kept++ ] = _mBuffer[ i ];
+            }
+            else
+            {
+                ptr->_mBuffer.push_back( _mBuffer[ i ] );
+            }
+        }
+        _mBuffer.resize( kept );
+    }
 }
 
 B_Tree::Node* B_Tree::Tree_Node::find( const Key& k ) const
@@ -47,20 +83,137 @@ B_Tree::Node* B_Tree::Tree_Node::find( const Key& k ) const
 
 bool B_Tree::Tree_Node::find( const Key& k, Val& v ) const
 {
+    if( buffered_find( k, v ) ) return true;
+
     uint32_t idx = index( k );
     return _mPar->unswizzle( _mChildNodes[idx] )->find( k, v );
 }
 
-void B_Tree::Tree_Node::insert( const Key& k, const Val& v, Txn t )
+/**
+ * @brief Looks for the newest pending upsert of k in the buffer
+ *
+ * @param k
+ * @param v
+ * @return true Found, buffers above this node hold nothing newer
+ */
+bool B_Tree::Tree_Node::buffered_find( const Key& k, Val& v ) const
 {
-    uint32_t i;
+    for( size_t i=_mBuffer.size(); i--; )
+    {
+        if( _mBuffer[ i ].k == k )
+        {
+            v = _mBuffer[ i ].v;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Moves every pending upsert one level down. Upserts for leaf
+ * children are applied to the leaves as one sorted batch, so each leaf is
+ * visited once. Otherwise they are appended to the buffers of the children,
+ * and children whose buffers overflow are flushed in turn.
+ */
+void B_Tree::Tree_Node::flush_buffer()
+{
+    std::vector<KeyValTxn> msgs;
+    msgs.swap( _mBuffer );
+    std::stable_sort( msgs.begin(), msgs.end(), []( const KeyValTxn& a, const KeyValTxn& b ) { return a.k < b.k; } );
+
+    if( _mChildNodes[ 0 ] >= Max_Num_Tree_Nodes )
+    {
+        _mPar->apply_batch( msgs );
+        return;
+    }
 
-    Node* ptr = find( k );
+    for( size_t i=0; i<msgs.size(); i++ )
+    {
+        Tree_Node* child = (Tree_Node*)_mPar->unswizzle( _mChildNodes[ index( msgs[ i ].k ) ] );
+        child->_mBuffer.push_back( msgs[ i ] );
+    }
+
+    // Flushing a child can split this node, so its children are taken first
+    uint32_t children[ Tree_Node_Order ];
+    uint32_t num_children = _mSize;
+    memcpy( children, _mChildNodes, num_children * sizeof( uint32_t ) );
+    for( uint32_t i=0; i<num_children; i++ )
+    {
+        Tree_Node* child = (Tree_Node*)_mPar->unswizzle( children[ i ] );
+        if( child->_mBuffer.size() > Message_Buffer_Size )
+        {
+            child->flush_buffer();
+        }
+    }
+}
+
+/**
+ * @brief Looks up a sorted batch of keys. The batch is split into one run per
+ * child, all children are prefetched, and then each child is descended once
+ * for its whole run.
+ * 
+ * @param k Sorted keys
+ * @param n Number of keys
+ * @param v Values of found keys
+ * @param found Set to 1 for each key that was found
+ */
+void B_Tree::Tree_Node::multi_find( const Key* k, uint32_t n, Val* v, uint8_t* found ) const
+{
+    uint32_t run_child[ Tree_Node_Order ];
+    uint32_t run_start[ Tree_Node_Order + 1 ];
+    uint32_t num_runs = 0;
+
+    for( uint32_t i=0; i<n; )
+    {
+        uint32_t idx = index( k[ i ] );
+        uint32_t j = i + 1;
+        while( j < n && ( idx == _mSize - 1 || k[ j ] < _mKeys[ idx ] ) )
+        {
+            j++;
+        }
+        run_child[ num_runs ] = _mChildNodes[ idx ];
+        run_start[ num_runs ] = i;
+        num_runs++;
+        _mPar->prefetch_node( _mChildNodes[ idx ] );
+        i = j;
+    }
+    run_start[ num_runs ] = n;
+
+    for( uint32_t r=0; r<num_runs; r++ )
+    {
+        uint32_t start = run_start[ r ];
+        _mPar->unswizzle( run_child[ r ] )->multi_find( k + start, run_start[ r + 1 ] - start, v + start, found + start );
+    }
+}
+
+/**
+ * @brief Collects every pair with lo <= key <= hi. Leaf children in the range
+ * that are not resident are all read ahead before the first one is visited.
+ */
+void B_Tree::Tree_Node::scan( const Key& lo, const Key& hi, std::vector<KeyVal>& kvs ) const
+{
+    uint32_t first = index( lo );
+    uint32_t last = index( hi );
 
-    if( ptr->size() == ptr->max_size() )
+    for( uint32_t i=first; i<=last; i++ )
+    {
+        _mPar->read_ahead_node( _mChildNodes[ i ] );
+    }
+    for( uint32_t i=first; i<=last; i++ )
+    {
+        _mPar->unswizzle( _mChildNodes[ i ] )->scan( lo, hi, kvs );
+    }
+}
+
+void B_Tree::Tree_Node::insert( const Key& k, const Val& v, Txn t )
+{
+    uint32_t idx = index( k );
+    Node* ptr = _mPar->unswizzle( _mChildNodes[ idx ] );
+
+    if( ptr->full() )
     {
         Node* n;
-        ptr->split( n );
+        ptr->split( n, _mPar->split_point( ptr, k ) );
 
         insert( n );
         insert( k, v, t );
@@ -68,6 +221,7 @@ void B_Tree::Tree_Node::insert( const Key& k, const Val& v, Txn t )
     else
     {
         ptr->insert( k, v, t );
+        refresh( idx );
     }
 }
 
@@ -81,35 +235,114 @@ void B_Tree::Tree_Node::insert( const Node* v )
         split_index++;
     }
 
-    {
-        uint32_t* temp_nodes = new uint32_t[_mSize-split_index];
+    _mDirty = true;
+    memmove( &_mChildNodes[ split_index + 1 ], &_mChildNodes[ split_index ], ( _mSize - split_index ) * sizeof( uint32_t ) );
+    _mChildNodes[ split_index ] = v->node_id();
 
-        memcpy( temp_nodes, &_mChildNodes[split_index], ( _mSize-split_index ) * sizeof( uint32_t ) );
-        memcpy( &_mChildNodes[split_index+1], temp_nodes, ( _mSize-split_index ) * sizeof( uint32_t ) );
-        delete [] temp_nodes;
-        _mChildNodes[ split_index ] = v->node_id();
-    }
+    // The key left of the new child separates it from its left neighbour,
+    // for the first child it is the key right of the old first child
+    uint32_t key_index = split_index ? split_index - 1 : 0;
+    memmove( &_mKeys[ key_index + 1 ], &_mKeys[ key_index ], ( _mSize - 1 - key_index ) * sizeof( Key ) );
+    _mKeys[ key_index ] = _mPar->unswizzle( _mChildNodes[ key_index + 1 ] )->smallest();
+
+    memmove( &_mCounts[ split_index + 1 ], &_mCounts[ split_index ], ( _mSize - split_index ) * sizeof( uint32_t ) );
+    memmove( &_mReduced[ split_index + 1 ], &_mReduced[ split_index ], ( _mSize - split_index ) * sizeof( uint64_t ) );
+
+    _mSize++;
+
+    // The new node and the one it was split from
+    refresh( split_index );
+    refresh( split_index ? split_index - 1 : 1 );
+}
 
-    if( split_index )
+/**
+ * @brief Aggregate over every entry under the node
+ *
+ * @param a Entries are combined into it
+ */
+void B_Tree::Tree_Node::totals( Aggregate& a ) const
+{
+    for( uint32_t i=0; i<_mSize; i++ )
     {
-        Key* temp_keys = new Key[ _mSize - split_index ];
+        _mPar->combine( a, _mCounts[ i ], _mReduced[ i ] );
+    }
+}
+
+/**
+ * @brief Aggregate over the entries with lo <= key <= hi. Children strictly
+ * between the ones holding lo and hi lie entirely in the range and only
+ * their stored aggregates are read, so just the two boundary paths are
+ * descended.
+ *
+ * @param lo
+ * @param hi
+ * @param a Entries in the range are combined into it
+ */
+void B_Tree::Tree_Node::aggregate( const Key& lo, const Key& hi, Aggregate& a ) const
+{
+    uint32_t first = index( lo );
+    uint32_t last = index( hi );
 
-        memcpy( temp_keys, &_mKeys[ split_index - 1 ], ( _mSize - split_index ) * sizeof( Key ) );
-        memcpy( &_mKeys[ split_index ], temp_keys, ( _mSize - split_index ) * sizeof( Key ) );
-        delete [] temp_keys;
-        _mKeys[ split_index - 1 ] = _mPar->unswizzle( _mChildNodes[ split_index ] )->smallest();
+    _mPar->unswizzle( _mChildNodes[ first ] )->aggregate( lo, hi, a );
+    for( uint32_t i=first+1; i<last; i++ )
+    {
+        _mPar->combine( a, _mCounts[ i ], _mReduced[ i ] );
     }
-    else
+    if( last != first )
     {
-        Key* temp_keys = new Key[ _mSize - 1 ];
+        _mPar->unswizzle( _mChildNodes[ last ] )->aggregate( lo, hi, a );
+    }
+}
 
-        memcpy( temp_keys, &_mKeys[ 0 ], _mSize - 1 );
-        memcpy( &_mKeys[ 1 ], temp_keys, _mSize - 1 );
-        delete [] temp_keys;
-        _mKeys[ 0 ] = _mPar->unswizzle( _mChildNodes[ 1 ] )->smallest();
+/**
+ * @brief Recomputes the aggregate of one child from the child itself. Does
+ * nothing while aggregates are disabled.
+ *
+ * @param idx
+ */
+void B_Tree::Tree_Node::refresh( uint32_t idx )
+{
+    if( !_mPar->aggregates_enabled() ) return;
+
+    Aggregate a = { 0, _mPar->_mReduction.identity };
+    _mPar->unswizzle( _mChildNodes[ idx ] )->totals( a );
+    if( _mCounts[ idx ] != a.count || _mReduced[ idx ] != a.value )
+    {
+        _mCounts[ idx ] = a.count;
+        _mReduced[ idx ] = a.value;
+        _mDirty = true;
     }
+}
 
-    _mSize++;
+/**
+ * @brief Refreshes the aggregates along the path to the leaf holding k,
+ * bottom up
+ *
+ * @param k
+ */
+void B_Tree::Tree_Node::refresh_path( const Key& k )
+{
+    uint32_t idx = index( k );
+    if( _mChildNodes[ idx ] < Max_Num_Tree_Nodes )
+    {
+        ( (Tree_Node*)_mPar->unswizzle( _mChildNodes[ idx ] ) )->refresh_path( k );
+    }
+    refresh( idx );
+}
+
+/**
+ * @brief Recomputes every aggregate under the node, visiting every leaf
+ */
+void B_Tree::Tree_Node::rebuild_aggregates()
+{
+    for( uint32_t i=0; i<_mSize; i++ )
+    {
+        if( _mChildNodes[ i ] < Max_Num_Tree_Nodes )
+        {
+            ( (Tree_Node*)_mPar->unswizzle( _mChildNodes[ i ] ) )->rebuild_aggregates();
+        }
+        refresh( i );
+    }
 }
 
 void B_Tree::Tree_Node::print( size_t depth ) const
@@ -1,13 +1,25 @@
 #include "distr_log_db/b_plus.hpp"
+#include "distr_log_db/replication.hpp"
+#include "distr_log_db/sharded.hpp"
+#include "distr_log_db/coordinator.hpp"
+#include "distr_log_db/server.hpp"
+#include "distr_log_db/client.hpp"
+#include "distr_log_db/backup.hpp"
 
 #include "distr_log_db/tracer.hpp"
 
 #include <fstream>
 #include <cstring>
+#include <cassert>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <thread>
 
 int main()
 {
     B_Tree::Val v;
+    std::vector<B_Tree::Key> inserted;
 
     std::cout << std::hex;
     {
@@ -94,6 +106,7 @@ int main()
             B_Tree::Txn t = b.new_txn();
             b.insert( k, v, t );
             b.txn_commit( t );
+            inserted.push_back( k );
         }
     }
 
@@ -103,4 +116,1083 @@ int main()
         b.print();
         std::cout << std::endl;
     }
+
+    {
+        // Verify batched lookups agree with single lookups, including keys
+        // that were never inserted
+        B_Tree b( "foo.dtb" );
+
+        std::vector<B_Tree::Key> keys( inserted.rbegin(), inserted.rend() );
+        for( size_t i=0; i<50; i++ )
+        {
+            keys.push_back( ( rand() << 16 ) | ( rand() & 0xffff ) & 0xffffffff );
+        }
+
+        std::vector<B_Tree::Val> vals;
+        std::vector<bool> found;
+        uint32_t num_found = b.multi_find( keys, vals, found );
+
+        for( size_t i=0; i<keys.size(); i++ )
+        {
+            B_Tree::Val single;
+            assert( found[ i ] == b.find( keys[ i ], single ) );
+            if( found[ i ] ) assert( !memcmp( &single, &vals[ i ], sizeof( single ) ) );
+        }
+        assert( num_found >= inserted.size() );
+        std::cout << std::dec << "multi_find found " << num_found << " of " << keys.size() << " keys" << std::endl;
+    }
+
+    {
+        // Aborted updates are undone, and a later transaction can update a
+        // key whose committed change is still in the leaf log
+        B_Tree::Key k = inserted[ 0 ];
+        B_Tree::Val old, nv;
+        {
+            B_Tree b( "foo.dtb" );
+            assert( b.find( k, old ) );
+
+            snprintf( (char*)nv.val, sizeof( nv.val ), "aborted" );
+            B_Tree::Txn t = b.new_txn();
+            b.insert( k, nv, t );
+            b.txn_abort( t );
+            assert( b.find( k, v ) && !memcmp( &v, &old, sizeof( v ) ) );
+
+            snprintf( (char*)nv.val, sizeof( nv.val ), "updated" );
+            t = b.new_txn();
+            b.insert( k, nv, t );
+            b.txn_commit( t );
+        }
+        {
+            B_Tree b( "foo.dtb" );
+            assert( b.find( k, v ) && !memcmp( &v, &nv, sizeof( v ) ) );
+            // A leaf without pending changes costs its page and a little
+            // bookkeeping, its deltas live in the delta pool
+            assert( b._mLeafPool._mFrameSize <= sizeof( B_Tree::Page ) + 80 );
+            assert( b._mDeltaPool.in_use() <= b._mLeafPool.in_use() );
+
+            B_Tree::Txn t = b.new_txn();
+            b.insert( k, old, t );
+            b.txn_commit( t );
+        }
+    }
+
+    {
+        // Verify a range scan returns every key in the range, in order
+        B_Tree b( "foo.dtb" );
+
+        std::vector<B_Tree::Key> sorted( inserted );
+        std::sort( sorted.begin(), sorted.end() );
+        B_Tree::Key lo = sorted[ sorted.size() / 4 ];
+        B_Tree::Key hi = sorted[ sorted.size() * 3 / 4 ];
+
+        std::vector<B_Tree::KeyVal> kvs;
+        b.scan( lo, hi, kvs );
+
+        std::vector<B_Tree::Key>::iterator itr = std::lower_bound( sorted.begin(), sorted.end(), lo );
+        for( size_t i=0; i<kvs.size(); i++ )
+        {
+            if( *itr == kvs[ i ].k ) itr++;
+            assert( i == 0 || kvs[ i - 1 ].k < kvs[ i ].k );
+        }
+        assert( itr == std::upper_bound( sorted.begin(), sorted.end(), hi ) );
+        std::cout << "scan returned " << kvs.size() << " keys" << std::endl;
+    }
+
+    {
+        // Time ordered keys take the rightmost leaf fast path, and splits
+        // leave the left leaf nearly full
+        B_Tree b( "seq.dtb", true );
+
+        for( B_Tree::Key k=1; k<=600; k++ )
+        {
+            snprintf( (char*)v.val, sizeof( v.val ), "0x%08x", k );
+
+            B_Tree::Txn t = b.new_txn();
+            b.insert( k, v, t );
+            b.txn_commit( t );
+        }
+        for( B_Tree::Key k=1; k<=600; k++ )
+        {
+            assert( b.find( k, v ) );
+        }
+        std::cout << "600 sequential keys in " << b._mHeader._mNumLeafNodes << " leaves" << std::endl;
+    }
+
+    {
+        // Insert a batch under a single transaction, then verify it persisted
+        std::vector<B_Tree::KeyVal> batch( 300 );
+        {
+            B_Tree b( "batch.dtb", true );
+            for( size_t i=0; i<batch.size(); i++ )
+            {
+                batch[ i ].k = ( rand() << 16 ) | ( rand() & 0xffff ) & 0xffffffff;
+                snprintf( (char*)batch[ i ].v.val, sizeof( batch[ i ].v.val ), "0x%08x", batch[ i ].k );
+            }
+
+            B_Tree::Txn t = b.new_txn();
+            b.insert_batch( batch, t );
+            b.txn_commit( t );
+        }
+        {
+            B_Tree b( "batch.dtb" );
+            for( size_t i=0; i<batch.size(); i++ )
+            {
+                assert( b.find( batch[ i ].k, v ) );
+                assert( !memcmp( &v, &batch[ i ].v, sizeof( v ) ) );
+            }
+            std::cout << "batch of " << batch.size() << " keys in " << b._mHeader._mNumLeafNodes << " leaves" << std::endl;
+        }
+    }
+
+    {
+        // Shadow paging: committed keys survive a reopen, uncommitted and
+        // aborted ones do not, and a snapshot never sees uncommitted keys
+        std::vector<B_Tree::Key> keys;
+        {
+            B_Tree b( "cow.dtb", true, false, true );
+            for( size_t i=0; i<200; i++ )
+            {
+                B_Tree::Key k = ( rand() << 16 ) | ( rand() & 0xffff ) & 0xffffffff;
+                snprintf( (char*)v.val, sizeof( v.val ), "0x%08x", k );
+
+                B_Tree::Txn t = b.new_txn();
+                b.insert( k, v, t );
+                b.txn_commit( t );
+                keys.push_back( k );
+            }
+
+            B_Tree::Txn t = b.new_txn();
+            b.insert( 0xdead, v, t );
+            b.txn_abort( t );
+            assert( !b.find( 0xdead, v ) );
+            assert( b.txn_state( t ) == B_Tree::TxnState_Aborted );
+
+            B_Tree::Snapshot s = b.snapshot();
+            B_Tree::Txn aborted = t;
+            t = b.new_txn();
+            assert( t != aborted && b.txn_state( t ) == B_Tree::TxnState_Current );
+            b.insert( 0xbeef, v, t );
+            assert( b.find( 0xbeef, v ) );
+            assert( !b.find( s, 0xbeef, v ) );
+            assert( b.find( s, keys[ 0 ], v ) );
+            assert( b.snapshot_valid( s ) );
+
+            // Destructor emulates a crash before the transaction commits
+        }
+        {
+            B_Tree b( "cow.dtb", false, false, true );
+            for( size_t i=0; i<keys.size(); i++ )
+            {
+                assert( b.find( keys[ i ], v ) );
+            }
+            assert( !b.find( 0xbeef, v ) );
+            assert( !b.find( 0xdead, v ) );
+            std::cout << "shadow paging kept " << keys.size() << " committed keys" << std::endl;
+        }
+    }
+
+    {
+        // Exercise both I/O backends, with and without O_DIRECT
+        for( int i=0; i<4; i++ )
+        {
+            Page_IO io;
+            io.open( "bar.dtb", i & 1, i & 2 );
+            io.resize( 0 );
+            io.resize( 3 * sizeof( B_Tree::Page ) );
+
+            B_Tree::Page p, q;
+            memset( &p, 0x5a + i, sizeof( p ) );
+            io.write( &p, sizeof( p ), sizeof( p ) );
+            io.read_ahead( 0, 3 * sizeof( p ) );
+            io.read( &q, sizeof( q ), sizeof( q ) );
+            assert( !memcmp( &p, &q, sizeof( p ) ) );
+            io.sync();
+            assert( io.size() == 3 * sizeof( p ) );
+
+            // One batch, out of order, several pages to a block, the last
+            // writes replacing earlier ones and the file growing
+            std::vector<B_Tree::Page> pages( 40 );
+            std::vector<Page_IO::Write> batch( pages.size() );
+            for( size_t j=0; j<pages.size(); j++ )
+            {
+                memset( &pages[ j ], j, sizeof( p ) );
+                batch[ j ].buf = &pages[ j ];
+                batch[ j ].len = sizeof( p );
+                batch[ j ].off = ( j * 7 % 37 ) * sizeof( p );
+            }
+            io.write( batch );
+            assert( io.size() == 37 * sizeof( p ) );
+            for( size_t j=0; j<pages.size(); j++ )
+            {
+                io.read( &q, sizeof( q ), batch[ j ].off );
+                size_t last = j < 3 ? j + 37 : j;
+                assert( !memcmp( &pages[ last ], &q, sizeof( q ) ) );
+            }
+
+            // Threads writing neighbouring pages of the same blocks
+            std::vector<std::thread> writers;
+            for( int t=0; t<4; t++ )
+            {
+                writers.emplace_back( [&io, t]()
+                {
+                    B_Tree::Page w;
+                    for( int j=t; j<64; j+=4 )
+                    {
+                        memset( &w, j, sizeof( w ) );
+                        io.write( &w, sizeof( w ), j * sizeof( w ) );
+                    }
+                } );
+            }
+            for( size_t t=0; t<writers.size(); t++ )
+            {
+                writers[ t ].join();
+            }
+            assert( io.size() == 64 * sizeof( p ) );
+            for( int j=0; j<64; j++ )
+            {
+                memset( &p, j, sizeof( p ) );
+                io.read( &q, sizeof( q ), j * sizeof( q ) );
+                assert( !memcmp( &p, &q, sizeof( p ) ) );
+            }
+            std::cout << "Page_IO backend " << io.backend() << ( io.direct() ? " direct" : "" ) << " ok" << std::endl;
+        }
+    }
+    {
+        // Replication: a follower applies commits as they happen, and one
+        // that joins later catches up from history, or from a snapshot once
+        // the primary has restarted and lost its history
+        B_Tree b( "primary.dtb", true );
+        std::vector<B_Tree::Key> keys;
+        {
+            Replication_Primary p( b, "unix:primary.sock" );
+            Replication_Follower f1( "follower1.dtb", "unix:primary.sock", true );
+            for( size_t i=0; i<20; i++ )
+            {
+                B_Tree::Txn t = b.new_txn();
+                for( size_t j=0; j<5; j++ )
+                {
+                    B_Tree::Key k = ( rand() << 16 ) | ( rand() & 0xffff ) & 0xffffffff;
+                    snprintf( (char*)v.val, sizeof( v.val ), "0x%08x", k );
+                    b.insert( k, v, t );
+                    keys.push_back( k );
+                }
+                b.txn_commit( t );
+            }
+            B_Tree::Txn t = b.new_txn();
+            b.insert( 0xdead, v, t );
+            b.txn_abort( t );
+
+            Replication_Follower f2( "follower2.dtb", "unix:primary.sock", true );
+            while( !f1.wait_for( b._mHeader._mReplicationSeq, 10 ) || !f2.wait_for( b._mHeader._mReplicationSeq, 10 ) )
+            {
+                p.poll();
+            }
+            std::vector<B_Tree::KeyVal> a, c;
+            b.scan( 0, ~(B_Tree::Key)0, a );
+            f1.scan( 0, ~(B_Tree::Key)0, c );
+            assert( a.size() == c.size() && !memcmp( a.data(), c.data(), a.size() * sizeof( B_Tree::KeyVal ) ) );
+            c.clear();
+            f2.scan( 0, ~(B_Tree::Key)0, c );
+            assert( a.size() == c.size() );
+            assert( !f1.find( 0xdead, v ) );
+        }
+        {
+            Replication_Primary p( b, "tcp:127.0.0.1:0" );
+            Replication_Follower f3( "follower3.dtb", "tcp:127.0.0.1:" + std::to_string( p.port() ), true );
+            while( !f3.wait_for( b._mHeader._mReplicationSeq, 10 ) )
+            {
+                p.poll();
+            }
+            for( size_t i=0; i<keys.size(); i++ )
+            {
+                assert( f3.find( keys[ i ], v ) );
+            }
+            std::cout << "followers replicated " << keys.size() << " keys up to commit " << f3.applied_seq() << std::endl;
+        }
+        {
+            // A follower ahead of the primary is turned away, a snapshot
+            // would leave it with keys the primary never had
+            B_Tree fresh( "primary2.dtb", true );
+            Replication_Primary p( fresh, "unix:primary.sock" );
+            Replication_Follower f1( "follower1.dtb", "unix:primary.sock" );
+            uint32_t seq = f1.applied_seq();
+            assert( seq > fresh._mHeader._mReplicationSeq );
+            while( !f1.rejected() )
+            {
+                p.poll();
+                std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+            }
+            assert( f1.applied_seq() == seq && !p.num_followers() );
+            assert( f1.find( keys[ 0 ], v ) );
+            std::cout << "follower at commit " << seq << " rejected by a primary at commit " << fresh._mHeader._mReplicationSeq << std::endl;
+        }
+        {
+            // A record claiming more pairs than any tree holds drops the
+            // connection instead of being read, and the follower reconnects
+            Socket listener = Socket::listen( "unix:primary.sock" );
+            Replication_Follower f2( "follower2.dtb", "unix:primary.sock" );
+            uint32_t seq = f2.applied_seq();
+            Socket s = listener.accept();
+            Replication::Hello h;
+            assert( s.read_all( &h, sizeof( h ) ) && h.seq == seq );
+            Replication::Record r;
+            r.magic = Replication::Magic;
+            r.type = Replication::Record_Commit;
+            r.seq = seq + 1;
+            r.count = ~0u;
+            assert( s.write_all( &r, sizeof( r ) ) );
+            Socket again = listener.accept();
+            assert( again.valid() && f2.applied_seq() == seq );
+            std::cout << "follower dropped a record of " << r.count << " pairs" << std::endl;
+        }
+    }
+    {
+        // Sharding: pairs are routed by key, a shard split while another
+        // thread keeps writing loses nothing, and the layout survives a reopen
+        std::map<B_Tree::Key, std::string> expected;
+        std::vector<B_Tree::KeyVal> batch;
+        for( size_t i=0; i<400; i++ )
+        {
+            B_Tree::KeyVal kv;
+            kv.k = ( rand() << 16 ) | ( rand() & 0xffff ) & 0xffffffff;
+            snprintf( (char*)kv.v.val, sizeof( kv.v.val ), "0x%08x", kv.k );
+            expected[ kv.k ] = (char*)kv.v.val;
+            batch.push_back( kv );
+        }
+        {
+            Sharded_B_Tree s( "shard", 4, true );
+            s.insert_batch( std::vector<B_Tree::KeyVal>( batch.begin(), batch.begin() + 300 ) );
+
+            std::thread writer( [&]()
+            {
+                for( size_t i=300; i<batch.size(); i++ )
+                {
+                    s.insert( batch[ i ].k, batch[ i ].v );
+                }
+            } );
+            size_t hot = s.hottest_shard();
+            assert( s.split_shard( hot ) );
+            writer.join();
+            assert( s.num_shards() == 5 );
+
+            std::vector<B_Tree::Key> keys;
+            std::vector<B_Tree::Val> vals;
+            std::vector<bool> found;
+            for( size_t i=0; i<batch.size(); i++ )
+            {
+                keys.push_back( batch[ i ].k );
+            }
+            assert( s.multi_find( keys, vals, found ) == keys.size() );
+        }
+        {
+            Sharded_B_Tree s( "shard" );
+            assert( s.num_shards() == 5 );
+            std::vector<B_Tree::KeyVal> kvs;
+            s.scan( 0, ~(B_Tree::Key)0, kvs );
+            assert( kvs.size() == expected.size() );
+            std::map<B_Tree::Key, std::string>::const_iterator it = expected.begin();
+            for( size_t i=0; i<kvs.size(); i++, it++ )
+            {
+                assert( kvs[ i ].k == it->first && it->second == (char*)kvs[ i ].v.val );
+            }
+            std::cout << "5 shards hold " << kvs.size() << " keys" << std::endl;
+        }
+    }
+    {
+        // Two-phase commit: a transaction spanning shards commits everywhere,
+        // and after a crash one whose commit was logged is committed while
+        // one that was only prepared is aborted
+        std::vector<B_Tree::KeyVal> writes[ 3 ];
+        for( size_t i=0; i<3; i++ )
+        {
+            for( size_t j=0; j<40; j++ )
+            {
+                B_Tree::KeyVal kv;
+                kv.k = ( rand() << 16 ) | ( rand() & 0xffff ) & 0xffffffff;
+                snprintf( (char*)kv.v.val, sizeof( kv.v.val ), "0x%08x", kv.k );
+                writes[ i ].push_back( kv );
+            }
+            std::stable_sort( writes[ i ].begin(), writes[ i ].end(), []( const B_Tree::KeyVal& a, const B_Tree::KeyVal& b ) { return a.k < b.k; } );
+        }
+        uint32_t gtid;
+        {
+            Sharded_B_Tree s( "xshard", 4, true );
+            Txn_Coordinator c( s, "xshard.coord" );
+
+            gtid = c.begin();
+            for( size_t j=0; j<writes[ 0 ].size(); j++ )
+            {
+                c.insert( gtid, writes[ 0 ][ j ].k, writes[ 0 ][ j ].v );
+            }
+            assert( c.commit( gtid ) );
+
+            gtid = c.begin();
+            assert( c.prepare( gtid, writes[ 1 ] ) );
+            c.log_decision( gtid, Txn_Coordinator::Decision_Commit, true );
+
+            gtid = c.begin();
+            assert( c.prepare( gtid, writes[ 2 ] ) );
+
+            // Destructors emulate a crash before the second phase
+        }
+        {
+            Sharded_B_Tree s( "xshard" );
+            Txn_Coordinator c( s, "xshard.coord" );
+            assert( c._mNextGtid == gtid + 1 );
+            for( size_t i=0; i<3; i++ )
+            {
+                for( size_t j=0; j<writes[ i ].size(); j++ )
+                {
+                    assert( s.find( writes[ i ][ j ].k, v ) == ( i < 2 ) );
+                }
+            }
+            std::vector<B_Tree::KeyVal> kvs;
+            s.scan( 0, ~(B_Tree::Key)0, kvs );
+            std::cout << "two-phase commit kept " << kvs.size() << " keys across " << s.num_shards() << " shards" << std::endl;
+        }
+    }
+    {
+        // Server: pipelined puts commit as a group, pipelined gets are looked
+        // up together, and transactions lock the keys they write
+        B_Tree b( "server.dtb", true );
+        {
+            Server server( b, "tcp:127.0.0.1:0" );
+            std::string address = "tcp:127.0.0.1:" + std::to_string( server.port() );
+            Client c1, c2;
+            assert( c1.connect( address ) && c2.connect( address ) );
+
+            std::vector<B_Tree::KeyVal> kvs;
+            std::vector<B_Tree::Key> keys;
+            for( size_t i=0; i<200; i++ )
+            {
+                B_Tree::KeyVal kv;
+                kv.k = ( rand() << 16 ) | ( rand() & 0xffff ) & 0xffffffff;
+                snprintf( (char*)kv.v.val, sizeof( kv.v.val ), "0x%08x", kv.k );
+                kvs.push_back( kv );
+                keys.push_back( kv.k );
+            }
+            assert( c1.put_batch( kvs ) == kvs.size() );
+
+            std::vector<B_Tree::Val> vals;
+            std::vector<bool> found;
+            assert( c2.multi_get( keys, vals, found ) == keys.size() );
+            assert( !memcmp( &vals[ 7 ], &kvs[ 7 ].v, sizeof( v ) ) );
+
+            B_Tree::Txn t = c1.begin();
+            assert( t );
+            assert( c1.put( 0xbeef, v, t ) == Protocol::Status_Ok );
+            assert( c2.put( 0xbeef, v ) == Protocol::Status_Conflict );
+            assert( c2.commit( t ) == Protocol::Status_Error );
+            assert( c1.commit( t ) == Protocol::Status_Ok );
+            assert( c2.put( 0xbeef, v ) == Protocol::Status_Ok );
+
+            t = c2.begin();
+            assert( c2.put( 0xdead, v, t ) == Protocol::Status_Ok );
+            assert( c2.abort( t ) == Protocol::Status_Ok );
+            assert( c1.get( 0xdead, v ) == Protocol::Status_Not_Found );
+
+            std::vector<B_Tree::KeyVal> all;
+            assert( c1.scan( 0, ~(B_Tree::Key)0, all ) == Protocol::Status_Ok );
+            std::cout << "server holds " << all.size() << " keys" << std::endl;
+        }
+        assert( b.find( 0xbeef, v ) );
+    }
+    {
+        // Online backup: a copy taken while another thread inserts holds
+        // exactly what was committed at the checkpoint
+        std::vector<B_Tree::Key> before, after;
+        {
+            B_Tree b( "live.dtb", true );
+            for( size_t i=0; i<300; i++ )
+            {
+                B_Tree::Key k = ( rand() << 16 ) | ( rand() & 0xffff ) & 0xffffffff;
+                snprintf( (char*)v.val, sizeof( v.val ), "0x%08x", k );
+                ( i < 150 ? before : after ).push_back( k );
+            }
+            B_Tree::Txn t = b.new_txn();
+            for( size_t i=0; i<before.size(); i++ )
+            {
+                b.insert( before[ i ], v, t );
+            }
+            b.txn_commit( t );
+
+            B_Tree::Txn open = b.new_txn();
+            b.insert( 0xdead, v, open );
+            {
+                Backup bk( b, "live.bak" );
+                std::thread copier( [&]() { while( bk.step() ) std::this_thread::yield(); } );
+                for( size_t i=0; i<after.size(); i++ )
+                {
+                    t = b.new_txn();
+                    b.insert( after[ i ], v, t );
+                    b.txn_commit( t );
+                }
+                copier.join();
+                assert( bk.done() );
+            }
+            b.txn_commit( open );
+        }
+        {
+            B_Tree b( "live.bak" );
+            for( size_t i=0; i<before.size(); i++ )
+            {
+                assert( b.find( before[ i ], v ) );
+            }
+            for( size_t i=0; i<after.size(); i++ )
+            {
+                assert( !b.find( after[ i ], v ) );
+            }
+            assert( !b.find( 0xdead, v ) );
+            std::cout << "backup holds the " << before.size() << " keys committed at its checkpoint" << std::endl;
+        }
+    }
+    {
+        // Recovery: after a crash with a transaction open, reopening resolves
+        // every leaf log in the background while the tree serves reads
+        std::vector<B_Tree::Key> committed, lost;
+        {
+            B_Tree b( "recover.dtb", true );
+            for( size_t i=0; i<300; i++ )
+            {
+                B_Tree::Key k = ( rand() << 16 ) | ( rand() & 0xffff ) & 0xffffffff;
+                snprintf( (char*)v.val, sizeof( v.val ), "0x%08x", k );
+                B_Tree::Txn t = b.new_txn();
+                b.insert( k, v, t );
+                b.txn_commit( t );
+                committed.push_back( k );
+            }
+            B_Tree::Txn t = b.new_txn();
+            for( size_t i=0; i<20; i++ )
+            {
+                B_Tree::Key k = ( rand() << 16 ) | ( rand() & 0xffff ) & 0xffffffff;
+                b.insert( k, v, t );
+                lost.push_back( k );
+            }
+            // Destructor emulates a crash with the transaction open
+        }
+        {
+            B_Tree b( "recover.dtb" );
+            b.wait_recovery();
+
+            // Leaves the tree loaded itself are resolved lazily instead
+            for( uint32_t i=0; i<b._mHeader._mNumLeafNodes; i++ )
+            {
+                B_Tree::Leaf_Node::Data stored;
+                B_Tree::Leaf_Node::Log log;
+                b.fetch_node( stored, log, B_Tree::Max_Num_Tree_Nodes + i );
+                assert( !log._mSize || b._mLeafNodeMap.find( B_Tree::Max_Num_Tree_Nodes + i ).exists );
+            }
+            for( size_t i=0; i<committed.size(); i++ )
+            {
+                assert( b.find( committed[ i ], v ) );
+            }
+            for( size_t i=0; i<lost.size(); i++ )
+            {
+                assert( !b.find( lost[ i ], v ) );
+            }
+            std::cout << "recovery resolved the logs of " << b._mRecoveredLeaves << " of " << b._mHeader._mNumLeafNodes << " leaves" << std::endl;
+        }
+    }
+    {
+        // Aggregates: range counts and sums from the per child aggregates
+        // match a scan, through aborts, a reopen and a crash
+        B_Tree::Reduction sum;
+        sum.map = []( const B_Tree::Val& v ) { return (uint64_t)v.val[ 0 ]; };
+        sum.combine = []( uint64_t a, uint64_t b ) { return a + b; };
+        sum.identity = 0;
+
+        std::vector<B_Tree::Key> keys;
+        auto check = [&]( B_Tree& b )
+        {
+            for( size_t i=0; i<50; i++ )
+            {
+                B_Tree::Key lo = keys[ rand() % keys.size() ] - ( i % 2 );
+                B_Tree::Key hi = i % 5 ? keys[ rand() % keys.size() ] : 0xffffffff;
+                if( lo > hi ) std::swap( lo, hi );
+
+                std::vector<B_Tree::KeyVal> c;
+                b.scan( lo, hi, c );
+                uint64_t total = 0;
+                for( size_t j=0; j<c.size(); j++ )
+                {
+                    total += c[ j ].v.val[ 0 ];
+                }
+                B_Tree::Aggregate a = b.aggregate( lo, hi );
+                assert( a.count == c.size() );
+                assert( a.value == total );
+                assert( b.range_count( lo, hi ) == c.size() );
+            }
+        };
+        {
+            B_Tree b( "agg.dtb", true );
+            b.enable_aggregates( sum );
+            for( size_t i=0; i<30; i++ )
+            {
+                B_Tree::Txn t = b.new_txn();
+                std::vector<B_Tree::KeyVal> batch;
+                for( size_t j=0; j<10; j++ )
+                {
+                    B_Tree::KeyVal kv;
+                    kv.k = j % 3 == 0 && keys.size() ? keys[ rand() % keys.size() ] : rand();
+                    kv.v.val[ 0 ] = rand();
+                    if( i % 3 == 0 )
+                    {
+                        batch.push_back( kv );
+                    }
+                    else
+                    {
+                        b.insert( kv.k, kv.v, t );
+                    }
+                    if( i % 7 != 6 ) keys.push_back( kv.k );
+                }
+                b.insert_batch( batch, t );
+                if( i % 7 == 6 )
+                {
+                    b.txn_abort( t );
+                }
+                else
+                {
+                    b.txn_commit( t );
+                }
+            }
+            check( b );
+        }
+        {
+            B_Tree b( "agg.dtb" );
+            assert( b._mHeader._mAggregates );
+            b.enable_aggregates( sum );
+            check( b );
+            B_Tree::Txn t = b.new_txn();
+            for( size_t i=0; i<20; i++ )
+            {
+                b.insert( rand(), v, t );
+            }
+            // Destructor emulates a crash with the transaction open
+        }
+        {
+            B_Tree b( "agg.dtb" );
+            assert( !b._mHeader._mAggregates );
+            b.enable_aggregates( sum );
+            check( b );
+            std::cout << "aggregates match scans over " << b.range_count( 0, 0xffffffff ) << " keys" << std::endl;
+        }
+    }
+    {
+        // Write buffering: upserts wait in tree node buffers, lookups see
+        // them, aborts drop them and commits make them durable
+        std::map<B_Tree::Key, uint8_t> expect;
+        {
+            B_Tree b( "buffer.dtb", true );
+            b.set_write_buffering( true );
+            for( size_t i=0; i<10; i++ )
+            {
+                B_Tree::Txn t = b.new_txn();
+                std::map<B_Tree::Key, uint8_t> written;
+                std::vector<B_Tree::KeyVal> batch;
+                for( size_t j=0; j<40; j++ )
+                {
+                    B_Tree::KeyVal kv;
+                    kv.k = j % 4 == 0 && expect.size() ? expect.begin()->first + j : rand();
+                    kv.v.val[ 0 ] = rand();
+                    if( j % 2 )
+                    {
+                        batch.push_back( kv );
+                    }
+                    else
+                    {
+                        b.insert( kv.k, kv.v, t );
+                        assert( b.find( kv.k, v ) && v.val[ 0 ] == kv.v.val[ 0 ] );
+                    }
+                    written[ kv.k ] = kv.v.val[ 0 ];
+                }
+                b.insert_batch( batch, t );
+                for( std::map<B_Tree::Key, uint8_t>::iterator it=written.begin(); it!=written.end(); it++ )
+                {
+                    assert( b.find( it->first, v ) && v.val[ 0 ] == it->second );
+                }
+                if( i % 5 == 4 )
+                {
+                    b.txn_abort( t );
+                    for( std::map<B_Tree::Key, uint8_t>::iterator it=written.begin(); it!=written.end(); it++ )
+                    {
+                        std::map<B_Tree::Key, uint8_t>::iterator e = expect.find( it->first );
+                        assert( e == expect.end() ? !b.find( it->first, v ) : b.find( it->first, v ) && v.val[ 0 ] == e->second );
+                    }
+                }
+                else
+                {
+                    b.txn_commit( t );
+                    for( std::map<B_Tree::Key, uint8_t>::iterator it=written.begin(); it!=written.end(); it++ )
+                    {
+                        expect[ it->first ] = it->second;
+                    }
+                }
+            }
+        }
+        {
+            B_Tree b( "buffer.dtb" );
+            std::vector<B_Tree::KeyVal> c;
+            b.scan( 0, 0xffffffff, c );
+            assert( c.size() == expect.size() );
+            for( size_t i=0; i<c.size(); i++ )
+            {
+                assert( expect[ c[ i ].k ] == c[ i ].v.val[ 0 ] );
+            }
+            std::cout << "write buffering kept " << c.size() << " keys" << std::endl;
+        }
+    }
+    {
+        // Node objects come from the tree's pools, a split and the insert
+        // that follows it take frames only for the new nodes
+        B_Tree b( "pool.dtb", true );
+        for( size_t i=0; i<200; i++ )
+        {
+            B_Tree::Txn t = b.new_txn();
+            b.insert( rand(), v, t );
+            b.txn_commit( t );
+            assert( b._mTreePool.in_use() == b._mHeader._mNumTreeNodes );
+            // A commit leaves every tree node clean, only changed ones are
+            // written by the next
+            for( uint32_t j=0; j<b._mHeader._mNumTreeNodes; j++ )
+            {
+                assert( !b._mTreeNodes[ j ]->_mDirty );
+            }
+            assert( b._mTreePool._mNumFrames == B_Tree::Max_Num_Tree_Nodes );
+        }
+        std::cout << "pools hold " << b._mTreePool.in_use() << " tree nodes and " << b._mLeafPool.in_use() << " leaves" << std::endl;
+    }
+    {
+        // Keys that differ only above their low byte still spread over the
+        // control fragments and the slots
+        typedef Hash_Map<uint32_t, uint32_t*> Map;
+        std::vector<bool> fragments( 128, false ), slots( 256, false );
+        uint32_t num_fragments = 0, num_slots = 0;
+        for( uint32_t i=0; i<256; i++ )
+        {
+            uint64_t h = Default_Hash<uint32_t>()( i << 8 );
+            num_fragments += !fragments[ Map::fragment( h ) ];
+            fragments[ Map::fragment( h ) ] = true;
+            num_slots += !slots[ Map::calc_index( h, 256 ) ];
+            slots[ Map::calc_index( h, 256 ) ] = true;
+        }
+        assert( num_fragments > 64 && num_slots > 128 );
+        std::cout << "hash spread 256 keys over " << num_fragments << " fragments and " << num_slots << " slots" << std::endl;
+    }
+    {
+        // Hash_Map grows by load factor, moving entries a few slots at a time
+        Hash_Map<uint32_t, uint32_t*> map( 8 );
+        bool saw_rehash = false;
+        for( uint32_t i=0; i<2000; i++ )
+        {
+            map.insert( i * 7919, new uint32_t( i ) );
+            if( i % 3 == 0 )
+            {
+                map.remove( ( i / 2 ) * 7919 );
+            }
+            saw_rehash |= map._mOld.ctrl != nullptr;
+            assert( map._mCurrSize * 4 <= map._mTable.size * 3 );
+        }
+        map.verify();
+        uint32_t count = 0;
+        for( uint32_t i=0; i<map.num_slots(); i++ )
+        {
+            count += map.slot( i ).exists;
+        }
+        assert( count == map._mCurrSize );
+        for( uint32_t i=0; i<2000; i++ )
+        {
+            Hash_Map<uint32_t, uint32_t*>::Hash_Table_Data d = map.find( i * 7919 );
+            assert( !d.exists || *d.val == i );
+        }
+        assert( saw_rehash );
+
+        // Robin Hood order keeps probes short, removal shifts clusters back
+        map.finish_rehash();
+        uint32_t max_dist = map._mTable.max_dist;
+        for( uint32_t i=0; i<2000; i+=2 )
+        {
+            if( map.find( i * 7919 ).exists )
+            {
+                map.remove( i * 7919 );
+            }
+        }
+        map.verify();
+        assert( max_dist < 32 );
+        assert( !( map._mTable.size & ( map._mTable.size - 1 ) ) );
+
+        // Byte string keys go through the wyhash style policy
+        Hash_Map<std::string, uint32_t*> names( 8 );
+        for( uint32_t i=0; i<200; i++ )
+        {
+            names.insert( "leaf_" + std::to_string( i ), new uint32_t( i ) );
+        }
+        names.verify();
+        assert( *names.find( "leaf_123" ).val == 123 );
+        assert( !names.find( "leaf_200" ).exists );
+
+        // The leaf cache follows its memory budget
+        B_Tree b( "cache.dtb", true );
+        b.set_cache_budget( 64 * b._mLeafPool._mFrameSize );
+        std::vector<B_Tree::Key> keys;
+        B_Tree::Txn t = b.new_txn();
+        for( size_t i=0; i<300; i++ )
+        {
+            keys.push_back( rand() );
+            b.insert( keys.back(), v, t );
+        }
+        b.txn_commit( t );
+        assert( b._mLeafNodeMap._mCurrSize <= 64 && b._mLeafNodeMap._mCurrSize > B_Tree::Leaf_Cache_Size );
+        b.set_cache_budget( 0 );
+        assert( b._mLeafNodeMap._mCurrSize == 1 );
+        for( size_t i=0; i<keys.size(); i++ )
+        {
+            assert( b.find( keys[ i ], v ) );
+        }
+        std::cout << "hash map holds " << map._mCurrSize << " entries in " << map._mTable.size << " slots" << std::endl;
+    }
+    {
+        // Readers find values while writers insert, remove and rehash the
+        // page table, a value is never freed under a reader's guard and a
+        // key that is never removed is never missed once it was seen
+        struct Value
+        {
+            Value( uint32_t _aKey ) : _mKey( _aKey ) {}
+            ~Value() { _mKey = UINT32_MAX; }
+
+            uint32_t _mKey;
+        };
+        Concurrent_Hash_Map<uint32_t, Value*> map( 8 );
+        std::atomic<bool> done( false );
+        std::atomic<uint64_t> hits( 0 );
+
+        std::vector<std::thread> readers;
+        for( uint32_t r=0; r<4; r++ )
+        {
+            readers.push_back( std::thread( [&map, &done, &hits, r]()
+            {
+                uint64_t n = 0;
+                std::vector<uint8_t> seen( 4096, 0 );
+                for( uint32_t i=r; !done; i=( i + 7 ) % 4096 )
+                {
+                    Concurrent_Hash_Map<uint32_t, Value*>::Guard guard( map );
+                    Concurrent_Hash_Map<uint32_t, Value*>::Hash_Table_Data d = map.find( i );
+                    if( d.exists )
+                    {
+                        assert( d.val->_mKey == i );
+                        seen[ i ] = 1;
+                        n++;
+                    }
+                    else
+                    {
+                        assert( !seen[ i ] || i % 4 < 2 );
+                    }
+                }
+                hits += n;
+            } ) );
+        }
+
+        std::vector<std::thread> writers;
+        for( uint32_t w=0; w<2; w++ )
+        {
+            writers.push_back( std::thread( [&map, w]()
+            {
+                for( uint32_t i=w; i<4096; i+=2 )
+                {
+                    map.insert( i, new Value( i ) );
+                }
+                for( uint32_t round=0; round<4; round++ )
+                {
+                    for( uint32_t i=w; i<4096; i+=4 )
+                    {
+                        map.remove( i );
+                    }
+                    if( round == 3 ) break;
+                    for( uint32_t i=w; i<4096; i+=4 )
+                    {
+                        map.insert( i, new Value( i ) );
+                    }
+                }
+            } ) );
+        }
+        for( size_t i=0; i<writers.size(); i++ )
+        {
+            writers[ i ].join();
+        }
+        done = true;
+        for( size_t i=0; i<readers.size(); i++ )
+        {
+            readers[ i ].join();
+        }
+
+        assert( map._mCurrSize == 2048 );
+        for( uint32_t i=0; i<4096; i++ )
+        {
+            assert( map.find( i ).exists == ( i % 4 >= 2 ) );
+        }
+        std::cout << "concurrent map served " << hits << " hits while holding " << map._mCurrSize << " entries" << std::endl;
+    }
+    {
+        // Nested guards share the thread's reader record, more of them than
+        // there are records never wait for a free one
+        Epoch epoch;
+        std::vector<Epoch::Guard*> guards;
+        for( unsigned i=0; i<2 * Epoch::Max_Readers; i++ )
+        {
+            guards.push_back( new Epoch::Guard( epoch ) );
+            assert( guards[ i ]->_mRecord == guards[ 0 ]->_mRecord );
+        }
+        for( size_t i=guards.size(); i--; )
+        {
+            delete guards[ i ];
+        }
+        for( unsigned i=0; i<Epoch::Max_Readers; i++ )
+        {
+            assert( epoch._mReaders[ i ].load() == Epoch::Idle );
+        }
+        std::cout << "nested epoch guards held one reader record" << std::endl;
+    }
+    {
+        // Spans nest per thread, and threads are merged by path
+        Tracer tracer( "tracer_test" );
+        tracer.record_events( true );
+        tracer.begin_trace( "setup" );
+        {
+            Tracer::Span inner( "inner" );
+        }
+        tracer.begin_trace( "work" );
+
+        std::vector<std::thread> threads;
+        for( uint32_t i=0; i<4; i++ )
+        {
+            threads.push_back( std::thread( []()
+            {
+                Tracer::Span worker( "worker" );
+                for( uint32_t j=0; j<100; j++ )
+                {
+                    Tracer::Span block( "block" );
+                }
+            } ) );
+        }
+        for( size_t i=0; i<threads.size(); i++ )
+        {
+            threads[ i ].join();
+        }
+        tracer.end_trace();
+
+        uint32_t num_threads;
+        std::vector<Tracer::Node> merged = tracer.merge( num_threads );
+        assert( num_threads == 5 );
+        uint32_t setup = Tracer::child( merged, 0, Tracer::intern( "setup" ) );
+        assert( merged[ Tracer::child( merged, setup, Tracer::intern( "inner" ) ) ].count == 1 );
+        uint32_t worker = Tracer::child( merged, 0, Tracer::intern( "worker" ) );
+        assert( merged[ worker ].count == 4 );
+        assert( merged[ Tracer::child( merged, worker, Tracer::intern( "block" ) ) ].count == 400 );
+
+        // Every span is on the timeline as a complete event
+        std::ostringstream trace;
+        tracer.write_chrome_trace( trace );
+        std::string json = trace.str();
+        size_t num_events = 0;
+        for( size_t pos=json.find( "\"ph\":\"X\"" ); pos!=std::string::npos; pos=json.find( "\"ph\":\"X\"", pos + 1 ) )
+        {
+            num_events++;
+        }
+        assert( num_events == 407 );
+        std::cout << "tracer merged " << merged.size() - 1 << " spans from " << num_threads << " threads into " << num_events << " events" << std::endl;
+    }
+    {
+        // Names are interned by content, a reused buffer gets the id of
+        // what it holds now
+        char buf[ 16 ];
+        snprintf( buf, sizeof( buf ), "alpha" );
+        uint32_t alpha = Tracer::intern( (const char*)buf );
+        snprintf( buf, sizeof( buf ), "beta" );
+        uint32_t beta = Tracer::intern( (const char*)buf );
+        assert( alpha != beta && beta == Tracer::intern( std::string( "beta" ) ) );
+        std::cout << "tracer interned names by content" << std::endl;
+    }
+    {
+        // Counters fall back to software ones where hardware counters are
+        // not allowed, a span never counts less than the spans inside it
+        Tracer tracer( "counter_test" );
+        tracer.enable_counters( true );
+        {
+            Tracer::Span outer( "outer" );
+            std::vector<uint32_t> data( 1 << 20 );
+            for( uint32_t i=0; i<4; i++ )
+            {
+                Tracer::Span inner( "inner" );
+                for( size_t j=0; j<data.size(); j+=16 )
+                {
+                    data[ j ] += j;
+                }
+            }
+        }
+
+        uint32_t num_threads;
+        std::vector<Tracer::Node> merged = tracer.merge( num_threads );
+        uint32_t outer = Tracer::child( merged, 0, Tracer::intern( "outer" ) );
+        uint32_t inner = Tracer::child( merged, outer, Tracer::intern( "inner" ) );
+        for( unsigned c=0; c<Perf_Counters::Num_Counters; c++ )
+        {
+            assert( merged[ outer ].counters[ c ] >= merged[ inner ].counters[ c ] );
+        }
+        std::cout << "counters measured " << merged[ outer ].counters[ Perf_Counters::Cycles ] << " " << ( tracer.counter_name( Perf_Counters::Cycles ) ? tracer.counter_name( Perf_Counters::Cycles ) : "(no counters)" ) << std::endl;
+    }
+    {
+        // Trace points in the tree record into the current tracer, and
+        // compile to nothing with tracing disabled
+        B_Tree b( "trace.dtb", true );
+        Tracer tracer( "trace_points" );
+        for( uint32_t i=0; i<100; i++ )
+        {
+            B_Tree::Txn t = b.new_txn();
+            b.insert( rand(), v, t );
+            b.txn_commit( t );
+        }
+
+        uint32_t num_threads;
+        std::vector<Tracer::Node> merged = tracer.merge( num_threads );
+#ifndef TRACER_DISABLED
+        assert( merged[ Tracer::child( merged, 0, Tracer::intern( "b_tree_insert" ) ) ].count == 100 );
+        assert( merged[ Tracer::child( merged, 0, Tracer::intern( "b_tree_txn_commit" ) ) ].count == 100 );
+#else
+        assert( merged.size() == 1 );
+#endif
+        std::cout << "trace points recorded " << merged.size() - 1 << " span paths at " << Tsc_Clock::ns_per_tick() << " ns per tick" << std::endl;
+    }
+    {
+        // Histograms from two threads merge into the same percentiles as
+        // one histogram of every value, within the bucket precision
+        Latency_Histogram even, odd, all;
+        for( uint64_t i=1; i<=100000; i++ )
+        {
+            ( i % 2 ? odd : even ).record( i * 10 );
+            all.record( i * 10 );
+        }
+        even.merge( odd );
+        assert( even.count() == 100000 && even.min() == 10 && even.max() == 1000000 );
+        const double ps[] = { 0.5, 0.9, 0.99, 0.999 };
+        for( size_t i=0; i<4; i++ )
+        {
+            uint64_t exact = ps[ i ] * 1000000;
+            assert( even.percentile( ps[ i ] ) == all.percentile( ps[ i ] ) );
+            assert( even.percentile( ps[ i ] ) >= exact );
+            assert( even.percentile( ps[ i ] ) <= exact + exact / Latency_Histogram::Sub_Count );
+        }
+
+        // Every span path gets a CSV row
+        Tracer tracer( "histogram_test" );
+        for( uint32_t i=0; i<100; i++ )
+        {
+            TRACE_SPAN( "outer" );
+            TRACE_SPAN( "inner" );
+        }
+        std::ostringstream csv;
+        tracer.write_histograms_csv( csv );
+#ifndef TRACER_DISABLED
+        assert( csv.str().find( "\"outer/inner\",100," ) != std::string::npos );
+#endif
+        std::cout << "histogram p99 is " << even.percentile( 0.99 ) << " for 990000" << std::endl;
+    }
 }
@@ -407,10 +407,20 @@ void fmul5( const Matrix<float>& a, const Matrix<float>& b, Matrix<float>& res,
 
     auto thread_func = [&]( unsigned id )
     {
-        bar b;
-        while( queue.pop_front( b ) )
         {
-            foo( b.i, b.j );
+            // Ends before done_count, the tracer may report right after
+            TRACE_SPAN( "fmul5_worker" );
+            bar b;
+            for( ;; )
+            {
+                // Time spent waiting on the queue shows up as bubbles
+                {
+                    TRACE_SPAN( "fmul5_queue_wait" );
+                    if( !queue.pop_front( b ) ) break;
+                }
+                TRACE_SPAN( "fmul5_block" );
+                foo( b.i, b.j );
+            }
         }
         done_count++;
     };
@@ -1,63 +1,682 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
 #include <chrono>
 #include <iostream>
 #include <string>
-#include <map>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+
+#include <cstring>
+#include <cmath>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
+/**
+ * @brief Timestamps from the time stamp counter, two orders of magnitude
+ * cheaper to take than a system clock read. Ticks are converted to time by a
+ * rate measured against steady_clock the first time it is needed. Machines
+ * without an invariant counter fall back to steady_clock nanoseconds.
+ */
+class Tsc_Clock
+{
+public:
+    static bool invariant()
+    {
+#if defined( __x86_64__ ) || defined( __i386__ )
+        static const bool inv = []()
+        {
+            unsigned a, b, c, d;
+            return __get_cpuid( 0x80000007, &a, &b, &c, &d ) && ( d & ( 1 << 8 ) );
+        }();
+        return inv;
+#else
+        return false;
+#endif
+    }
+
+    static uint64_t now()
+    {
+#if defined( __x86_64__ ) || defined( __i386__ )
+        if( invariant() ) return __rdtsc();
+#endif
+        return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+    }
+
+    /**
+     * @brief Like now(), but waits for earlier instructions to finish so the
+     * end of a span is not taken early
+     */
+    static uint64_t now_ordered()
+    {
+#if defined( __x86_64__ ) || defined( __i386__ )
+        unsigned aux;
+        if( invariant() ) return __rdtscp( &aux );
+#endif
+        return now();
+    }
+
+    static double ns_per_tick()
+    {
+        static const double rate = []()
+        {
+            if( !invariant() ) return 1.0;
+            std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+            uint64_t c0 = now();
+            std::chrono::steady_clock::time_point t1;
+            do
+            {
+                t1 = std::chrono::steady_clock::now();
+            } while( t1 - t0 < std::chrono::milliseconds( 5 ) );
+            uint64_t c1 = now();
+            return std::chrono::duration<double, std::nano>( t1 - t0 ).count() / ( c1 - c0 );
+        }();
+        return rate;
+    }
+
+    static double seconds( uint64_t ticks )
+    {
+        return ticks * ns_per_tick() / 1e9;
+    }
+};
+
+/**
+ * @brief Counters of the calling thread read through perf_event_open, opened
+ * as one group so a single read returns all of them. A hardware counter the
+ * machine or the permissions do not allow is replaced by its software
+ * fallback, or left out when it has none.
+ */
+class Perf_Counters
+{
+public:
+    enum Counter
+    {
+        Cycles,
+        Instructions,
+        Cache_Misses,
+        Branch_Misses,
+        Context_Switches,
+        Num_Counters
+    };
+
+    struct Config
+    {
+        const char* name;
+        uint32_t type;
+        uint64_t config;
+        // Used when the first choice cannot be opened, none when name is null
+        const char* fallback_name;
+        uint32_t fallback_type;
+        uint64_t fallback_config;
+    };
+
+    static const Config& config( unsigned c )
+    {
+        static const Config configs[ Num_Counters ] =
+        {
+            { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+            { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, nullptr, 0, 0 },
+            { "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+            { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, nullptr, 0, 0 },
+            { "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, nullptr, 0, 0 },
+        };
+        return configs[ c ];
+    }
+
+    Perf_Counters()
+        : _mLeader( -1 ),
+          _mNumOpen( 0 )
+    {
+        for( unsigned c=0; c<Num_Counters; c++ )
+        {
+            _mFds[ c ] = -1;
+            _mNames[ c ] = nullptr;
+            if( !open_counter( c, config( c ).name, config( c ).type, config( c ).config ) && config( c ).fallback_name )
+            {
+                open_counter( c, config( c ).fallback_name, config( c ).fallback_type, config( c ).fallback_config );
+            }
+        }
+        if( _mLeader >= 0 )
+        {
+            ioctl( _mLeader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP );
+            ioctl( _mLeader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP );
+        }
+    }
+    ~Perf_Counters()
+    {
+        for( unsigned c=0; c<Num_Counters; c++ )
+        {
+            if( _mFds[ c ] >= 0 ) close( _mFds[ c ] );
+        }
+    }
+    Perf_Counters( const Perf_Counters& ) = delete;
+    Perf_Counters& operator=( const Perf_Counters& ) = delete;
+
+    bool open_counter( unsigned c, const char* name, uint32_t type, uint64_t config )
+    {
+        perf_event_attr attr;
+        memset( &attr, 0, sizeof( attr ) );
+        attr.size = sizeof( attr );
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = _mLeader < 0;
+        attr.exclude_kernel = type == PERF_TYPE_HARDWARE;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
 
+        int fd = syscall( SYS_perf_event_open, &attr, 0, -1, _mLeader, 0 );
+        if( fd < 0 ) return false;
+        if( _mLeader < 0 ) _mLeader = fd;
+        _mFds[ c ] = fd;
+        _mNames[ c ] = name;
+        _mOrder[ _mNumOpen++ ] = c;
+        return true;
+    }
+
+    bool available( unsigned c ) const { return _mFds[ c ] >= 0; }
+    // Name of what a counter really counts, null when it is not available
+    const char* name( unsigned c ) const { return _mNames[ c ]; }
+
+    /**
+     * @brief Current values, zero for counters that are not available
+     */
+    void read_all( uint64_t* values ) const
+    {
+        memset( values, 0, Num_Counters * sizeof( uint64_t ) );
+        if( _mLeader < 0 ) return;
+
+        uint64_t buf[ 1 + Num_Counters ];
+        if( ::read( _mLeader, buf, sizeof( buf ) ) < (ssize_t)sizeof( uint64_t ) ) return;
+        for( uint64_t i=0; i<buf[ 0 ] && i<_mNumOpen; i++ )
+        {
+            values[ _mOrder[ i ] ] = buf[ 1 + i ];
+        }
+    }
+
+    // Member variables
+    int _mFds[ Num_Counters ];
+    const char* _mNames[ Num_Counters ];
+    // Counters in the order the group reports them
+    unsigned _mOrder[ Num_Counters ];
+    int _mLeader;
+    unsigned _mNumOpen;
+};
+
+/**
+ * @brief Log-linear latency histogram in the style of HdrHistogram. Values
+ * below Sub_Count are counted exactly, above that every power of two is split
+ * into Sub_Count buckets, so a reported value is within 1 / Sub_Count of the
+ * recorded one. Buckets are allocated on the first record.
+ */
+class Latency_Histogram
+{
+public:
+    static constexpr unsigned Sub_Bits = 5;
+    static constexpr uint64_t Sub_Count = 1 << Sub_Bits;
+    static constexpr unsigned Num_Buckets = Sub_Count * ( 64 - Sub_Bits + 1 );
+
+    Latency_Histogram()
+        : _mCount( 0 ),
+          _mMin( UINT64_MAX ),
+          _mMax( 0 ),
+          _mSum( 0 )
+    {
+    }
+
+    static unsigned bucket( uint64_t v )
+    {
+        if( v < Sub_Count ) return v;
+        unsigned msb = 63 - __builtin_clzll( v );
+        unsigned shift = msb - Sub_Bits;
+        return Sub_Count + shift * Sub_Count + ( ( v >> shift ) & ( Sub_Count - 1 ) );
+    }
+    // Largest value that falls in a bucket
+    static uint64_t bucket_high( unsigned b )
+    {
+        if( b < Sub_Count ) return b;
+        unsigned shift = b / Sub_Count - 1;
+        uint64_t low = ( Sub_Count + b % Sub_Count ) << shift;
+        return low + ( ( (uint64_t)1 << shift ) - 1 );
+    }
+
+    void record( uint64_t v )
+    {
+        if( _mBuckets.empty() )
+        {
+            _mBuckets.assign( Num_Buckets, 0 );
+        }
+        _mBuckets[ bucket( v ) ]++;
+        _mCount++;
+        _mSum += v;
+        if( v < _mMin ) _mMin = v;
+        if( v > _mMax ) _mMax = v;
+    }
+
+    void merge( const Latency_Histogram& other )
+    {
+        if( !other._mCount ) return;
+        if( _mBuckets.empty() )
+        {
+            _mBuckets.assign( Num_Buckets, 0 );
+        }
+        for( unsigned b=0; b<Num_Buckets; b++ )
+        {
+            _mBuckets[ b ] += other._mBuckets[ b ];
+        }
+        _mCount += other._mCount;
+        _mSum += other._mSum;
+        if( other._mMin < _mMin ) _mMin = other._mMin;
+        if( other._mMax > _mMax ) _mMax = other._mMax;
+    }
+
+    /**
+     * @brief Smallest value that at least the fraction p of the records do
+     * not exceed, up to the bucket precision
+     */
+    uint64_t percentile( double p ) const
+    {
+        if( !_mCount ) return 0;
+        uint64_t rank = std::ceil( p * _mCount );
+        if( rank < 1 ) rank = 1;
+        if( rank > _mCount ) rank = _mCount;
+
+        uint64_t seen = 0;
+        for( unsigned b=0; b<Num_Buckets; b++ )
+        {
+            seen += _mBuckets[ b ];
+            if( seen >= rank )
+            {
+                uint64_t v = bucket_high( b );
+                return v < _mMin ? _mMin : v > _mMax ? _mMax : v;
+            }
+        }
+        return _mMax;
+    }
+
+    uint64_t count() const { return _mCount; }
+    uint64_t min() const { return _mCount ? _mMin : 0; }
+    uint64_t max() const { return _mMax; }
+    double mean() const { return _mCount ? (double)_mSum / _mCount : 0.0; }
+
+    // Member variables
+    std::vector<uint64_t> _mBuckets;
+    uint64_t _mCount;
+    uint64_t _mMin;
+    uint64_t _mMax;
+    uint64_t _mSum;
+};
+
+/**
+ * @brief Times a task and the spans inside it
+ *
+ * Spans nest, a span opened while another is open on the same thread is
+ * counted as its child. Each thread records into its own buffer without
+ * taking a lock, and the buffers are merged by path when the tracer reports,
+ * so threads that recorded must have finished by then. Span names are
+ * interned once into ids that are shared by every tracer.
+ *
+ * The tracer constructed last is the current one, spans that name no tracer
+ * record into it, so code running under a tracer can be instrumented without
+ * being handed it.
+ *
+ * With events recorded every span is also kept with its start and end, and
+ * the timeline can be written as Chrome trace-event JSON for Perfetto or
+ * chrome://tracing.
+ *
+ * With counters enabled each thread opens Perf_Counters and every span adds
+ * up the counters it spanned. Reading them costs a system call at each span
+ * boundary.
+ *
+ * Spans are timed with Tsc_Clock and events are fixed size records of ticks.
+ * Trace points written with TRACE_SPAN compile to nothing when
+ * TRACER_DISABLED is defined.
+ *
+ * Every span also records its duration in the Latency_Histogram of its path,
+ * the percentiles can be written as CSV or JSON.
+ */
 class Tracer
 {
+public:
+    typedef Tsc_Clock Clock;
+
+    // Sub-tasks at one path, the root has index 0
+    struct Node
+    {
+        uint32_t name;
+        uint32_t parent;
+        uint64_t count;
+        // Ticks
+        uint64_t total;
+        uint64_t counters[ Perf_Counters::Num_Counters ];
+        // Durations in ticks
+        Latency_Histogram latency;
+        std::vector<uint32_t> children;
+    };
+
+    struct Open
+    {
+        uint32_t node;
+        uint64_t start;
+        uint64_t counters[ Perf_Counters::Num_Counters ];
+    };
+
+    // One finished span on the timeline
+    struct Event
+    {
+        uint32_t name;
+        uint32_t depth;
+        uint64_t start;
+        uint64_t end;
+    };
+    static_assert( sizeof( Event ) == 24, "events are fixed size records" );
+
+    // Written only by its thread
+    struct Thread_Buffer
+    {
+        std::vector<Node> nodes;
+        std::vector<Open> stack;
+        std::vector<Event> events;
+        // Depth of the span opened by begin_trace, zero when none is open
+        size_t legacy;
+        bool record_events;
+        // Thread id as the kernel knows it
+        uint32_t tid;
+        // Null unless counters are enabled
+        std::unique_ptr<Perf_Counters> counters;
+
+        void begin( uint32_t name )
+        {
+            uint32_t parent = stack.empty() ? 0 : stack.back().node;
+            Open o;
+            o.node = Tracer::child( nodes, parent, name );
+            if( counters )
+            {
+                counters->read_all( o.counters );
+            }
+            stack.push_back( o );
+            stack.back().start = Clock::now();
+        }
+        void end()
+        {
+            uint64_t now = Clock::now_ordered();
+            Open o = stack.back();
+            stack.pop_back();
+            nodes[ o.node ].total += now - o.start;
+            nodes[ o.node ].count++;
+            nodes[ o.node ].latency.record( now - o.start );
+            if( counters )
+            {
+                uint64_t values[ Perf_Counters::Num_Counters ];
+                counters->read_all( values );
+                for( unsigned c=0; c<Perf_Counters::Num_Counters; c++ )
+                {
+                    nodes[ o.node ].counters[ c ] += values[ c ] - o.counters[ c ];
+                }
+            }
+            if( record_events )
+            {
+                Event e = { nodes[ o.node ].name, (uint32_t)stack.size(), o.start, now };
+                events.push_back( e );
+            }
+        }
+    };
+
+    /**
+     * @brief Times the scope it lives in as a span of the tracer
+     */
+    class Span
+    {
+    public:
+        Span( Tracer& _aTracer, uint32_t _aName ) : _mBuffer( _aTracer.local_buffer() ) { _mBuffer->begin( _aName ); }
+        Span( Tracer& _aTracer, const char* _aName ) : _mBuffer( _aTracer.local_buffer() ) { _mBuffer->begin( intern( _aName ) ); }
+        Span( uint32_t _aName ) : _mBuffer( current_buffer() ) { if( _mBuffer ) _mBuffer->begin( _aName ); }
+        Span( const char* _aName ) : _mBuffer( current_buffer() ) { if( _mBuffer ) _mBuffer->begin( intern( _aName ) ); }
+        ~Span()
+        {
+            if( _mBuffer ) _mBuffer->end();
+        }
+        Span( const Span& ) = delete;
+        Span& operator=( const Span& ) = delete;
+
+        // Member variables
+        Thread_Buffer* _mBuffer;
+    };
+
 private:
+    struct Name_Table
+    {
+        std::mutex mutex;
+        std::vector<std::string> names;
+        std::unordered_map<std::string, uint32_t> ids;
+    };
+    static Name_Table& name_table()
+    {
+        static Name_Table table;
+        return table;
+    }
+    static std::atomic<Tracer*>& current_slot()
+    {
+        static std::atomic<Tracer*> slot( nullptr );
+        return slot;
+    }
+    static std::atomic<uint64_t>& serial_counter()
+    {
+        static std::atomic<uint64_t> counter( 0 );
+        return counter;
+    }
+
     std::chrono::high_resolution_clock::time_point _mStartTime;
+    uint64_t _mStartTicks;
     std::string _mName;
-    std::string _mCurrTrace;
-    std::chrono::high_resolution_clock::time_point _mTraceStart;
-    std::map<std::string, std::chrono::duration<double> > _mTraceMap;
     bool progress_update;
+    Tracer* _mPrevious;
+    // Tells tracers apart in the thread caches, addresses get reused
+    uint64_t _mSerial;
+    std::mutex _mMutex;
+    std::vector<std::unique_ptr<Thread_Buffer> > _mBuffers;
+    std::atomic<bool> _mRecordEvents;
+    std::atomic<bool> _mCounters;
+    // What each counter measured, from the first thread that opened them
+    const char* _mCounterNames[ Perf_Counters::Num_Counters ];
+    // Chrome trace written when the task finishes, none when empty
+    std::string _mTraceFile;
+
 public:
-    Tracer( const std::string& _aName )
+    /**
+     * @param _aName Task name
+     * @param _aTraceFile Records events and writes them there as Chrome
+     * trace-event JSON when the task finishes
+     */
+    Tracer( const std::string& _aName, const std::string& _aTraceFile = "" )
       : _mStartTime(std::chrono::high_resolution_clock::now()),
+        _mStartTicks( Clock::now() ),
         _mName( _aName ),
-        progress_update( false )
+        progress_update( false ),
+        _mPrevious( current_slot().exchange( this ) ),
+        _mSerial( ++serial_counter() ),
+        _mRecordEvents( !_aTraceFile.empty() ),
+        _mCounters( false ),
+        _mTraceFile( _aTraceFile )
     {
+        for( unsigned c=0; c<Perf_Counters::Num_Counters; c++ )
+        {
+            _mCounterNames[ c ] = nullptr;
+        }
         std::cout << "\033[33m" << "Task " << _mName << " started" << "\033[39m" << std::endl;
     }
     ~Tracer()
     {
-        if( _mCurrTrace != "" )
-        {
-            end_trace();
-        }
+        end_trace();
+        current_slot().store( _mPrevious );
         if( progress_update )
         {
             std::cout << "\033[1A" << "\033[K";
         }
-        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - _mStartTime;
-        std::cout << "\033[32m" << "Task " << _mName << " finished after " << std::setprecision( 6 ) << elapsed.count() << " seconds" << "\033[39m" << std::endl;
-        for( auto itr=_mTraceMap.begin(); itr!=_mTraceMap.end(); itr++ )
+        report( std::cout );
+        if( !_mTraceFile.empty() )
         {
-            std::cout << "   sub_task " << itr->first << " took " << itr->second.count() << " seconds, "
-                      << itr->second.count() / elapsed.count() * 100 << "\% of total time" << std::endl;
+            std::ofstream out( _mTraceFile );
+            write_chrome_trace( out );
         }
     }
-    void end_trace()
+
+    /**
+     * @brief Keeps every span from now on for the timeline. Threads that
+     * already recorded a span keep their setting.
+     */
+    void record_events( bool on )
+    {
+        _mRecordEvents = on;
+    }
+
+    /**
+     * @brief Collects hardware counters in spans from now on. Threads that
+     * already recorded a span keep their setting.
+     */
+    void enable_counters( bool on )
+    {
+        _mCounters = on;
+    }
+    // What a counter measured, null when no thread could open it
+    const char* counter_name( unsigned c )
     {
-        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - _mTraceStart;
-        if( _mTraceMap.find(_mCurrTrace) != _mTraceMap.end() )
+        std::lock_guard<std::mutex> lock( _mMutex );
+        return _mCounterNames[ c ];
+    }
+
+    /**
+     * @brief Id of a span name, the same for every tracer
+     */
+    static uint32_t intern( const std::string& _aName )
+    {
+        Name_Table& table = name_table();
+        std::lock_guard<std::mutex> lock( table.mutex );
+        std::unordered_map<std::string, uint32_t>::iterator itr = table.ids.find( _aName );
+        if( itr != table.ids.end() ) return itr->second;
+        table.names.push_back( _aName );
+        table.ids[ _aName ] = table.names.size() - 1;
+        return table.names.size() - 1;
+    }
+
+    /**
+     * @brief Id of a span name, cached per thread by content so that only
+     * the first use of a name on a thread takes the table lock. The pointer
+     * may be a temporary or a reused buffer.
+     */
+    static uint32_t intern( const char* _aName )
+    {
+        thread_local std::unordered_map<std::string, uint32_t> cache;
+        std::string name( _aName );
+        std::unordered_map<std::string, uint32_t>::iterator itr = cache.find( name );
+        if( itr != cache.end() ) return itr->second;
+        uint32_t id = intern( name );
+        cache[ name ] = id;
+        return id;
+    }
+
+    static std::string name( uint32_t id )
+    {
+        Name_Table& table = name_table();
+        std::lock_guard<std::mutex> lock( table.mutex );
+        return table.names[ id ];
+    }
+
+    static Tracer* current()
+    {
+        return current_slot().load( std::memory_order_acquire );
+    }
+
+    // Buffer of the calling thread in the current tracer, null without one
+    static Thread_Buffer* current_buffer()
+    {
+        Tracer* t = current();
+        return t ? t->local_buffer() : nullptr;
+    }
+
+    /**
+     * @brief Buffer of the calling thread, created on its first span
+     */
+    Thread_Buffer* local_buffer()
+    {
+        thread_local std::vector<std::pair<uint64_t, Thread_Buffer*> > cache;
+        for( size_t i=0; i<cache.size(); i++ )
+        {
+            if( cache[ i ].first == _mSerial ) return cache[ i ].second;
+        }
+
+        Thread_Buffer* buf = new Thread_Buffer();
+        buf->nodes.resize( 1 );
+        buf->nodes[ 0 ].parent = 0;
+        buf->nodes[ 0 ].count = 0;
+        buf->nodes[ 0 ].total = 0;
+        memset( buf->nodes[ 0 ].counters, 0, sizeof( buf->nodes[ 0 ].counters ) );
+        buf->legacy = 0;
+        buf->record_events = _mRecordEvents;
+        if( buf->record_events )
+        {
+            buf->events.reserve( 4096 );
+        }
+        buf->tid = syscall( SYS_gettid );
+        if( _mCounters )
         {
-            _mTraceMap[_mCurrTrace] += elapsed;
+            buf->counters.reset( new Perf_Counters() );
         }
-        else
         {
-            _mTraceMap[_mCurrTrace] = elapsed;
+            std::lock_guard<std::mutex> lock( _mMutex );
+            _mBuffers.emplace_back( buf );
+            for( unsigned c=0; buf->counters && c<Perf_Counters::Num_Counters; c++ )
+            {
+                if( !_mCounterNames[ c ] ) _mCounterNames[ c ] = buf->counters->name( c );
+            }
         }
+
+        // Entries of finished tracers are never matched again
+        if( cache.size() >= 16 )
+        {
+            cache.erase( cache.begin() );
+        }
+        cache.push_back( std::make_pair( _mSerial, buf ) );
+        return buf;
     }
-    void begin_trace( const std::string& _aTrace )
+
+    /**
+     * @brief Ends the span begun by the last begin_trace on this thread,
+     * along with spans still open inside it
+     */
+    void end_trace()
     {
-        if( _mCurrTrace != "" )
+        Thread_Buffer* buf = local_buffer();
+        if( !buf->legacy ) return;
+        while( buf->stack.size() >= buf->legacy )
         {
-            end_trace();
+            buf->end();
         }
-        _mTraceStart = std::chrono::high_resolution_clock::now();
-        _mCurrTrace = _aTrace;
+        buf->legacy = 0;
+    }
+    /**
+     * @brief Begins a span that lasts until end_trace or the next
+     * begin_trace on this thread
+     */
+    void begin_trace( const std::string& _aTrace )
+    {
+        end_trace();
+        Thread_Buffer* buf = local_buffer();
+        buf->begin( intern( _aTrace ) );
+        buf->legacy = buf->stack.size();
     }
     void update_progress( float progress )
     {
@@ -75,4 +694,322 @@ public:
                   << std::fixed << std::showpoint << std::setw( 5 ) << std::setprecision( 1 )
                   << progress * 100.0F << "% ---- " << elapsed.count() << "s" << std::endl;
     }
+
+    /**
+     * @brief Merges the span trees of every thread by path
+     *
+     * @param threads Set to the number of threads that recorded a span
+     * @return std::vector<Node> Merged tree, the root has index 0
+     */
+    std::vector<Node> merge( uint32_t& threads )
+    {
+        std::lock_guard<std::mutex> lock( _mMutex );
+        std::vector<Node> merged( 1 );
+        merged[ 0 ].parent = 0;
+        merged[ 0 ].count = 0;
+        merged[ 0 ].total = 0;
+        memset( merged[ 0 ].counters, 0, sizeof( merged[ 0 ].counters ) );
+
+        threads = 0;
+        for( size_t b=0; b<_mBuffers.size(); b++ )
+        {
+            const std::vector<Node>& nodes = _mBuffers[ b ]->nodes;
+            if( nodes.size() > 1 ) threads++;
+
+            // Where each node of this buffer went in the merged tree, parents
+            // always come before their children
+            std::vector<uint32_t> to( nodes.size(), 0 );
+            for( uint32_t i=1; i<nodes.size(); i++ )
+            {
+                to[ i ] = child( merged, to[ nodes[ i ].parent ], nodes[ i ].name );
+                merged[ to[ i ] ].count += nodes[ i ].count;
+                merged[ to[ i ] ].total += nodes[ i ].total;
+                merged[ to[ i ] ].latency.merge( nodes[ i ].latency );
+                for( unsigned c=0; c<Perf_Counters::Num_Counters; c++ )
+                {
+                    merged[ to[ i ] ].counters[ c ] += nodes[ i ].counters[ c ];
+                }
+            }
+        }
+        return merged;
+    }
+
+    /**
+     * @brief Prints the task time and the merged span tree
+     */
+    void report( std::ostream& os )
+    {
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - _mStartTime;
+        os << "\033[32m" << "Task " << _mName << " finished after " << std::setprecision( 6 ) << elapsed.count() << " seconds" << "\033[39m" << std::endl;
+
+        uint32_t threads;
+        std::vector<Node> merged = merge( threads );
+        if( threads > 1 )
+        {
+            os << "   spans recorded on " << threads << " threads, times are summed over them" << std::endl;
+        }
+        report( os, merged, 0, 0, elapsed.count() );
+    }
+    void report( std::ostream& os, const std::vector<Node>& merged, uint32_t idx, unsigned depth, double elapsed )
+    {
+        for( size_t c=0; c<merged[ idx ].children.size(); c++ )
+        {
+            const Node& n = merged[ merged[ idx ].children[ c ] ];
+            double total = Clock::seconds( n.total );
+            os << "   " << std::string( depth * 2, ' ' ) << "sub_task " << name( n.name ) << " took " << total << " seconds over "
+               << n.count << ( n.count == 1 ? " call, " : " calls, " ) << total / elapsed * 100 << "\% of total time" << std::endl;
+            if( n.count > 1 )
+            {
+                const Latency_Histogram& h = n.latency;
+                os << "   " << std::string( depth * 2 + 2, ' ' ) << "latency us min " << us( h.min() ) << ", p50 " << us( h.percentile( 0.5 ) )
+                   << ", p99 " << us( h.percentile( 0.99 ) ) << ", p99.9 " << us( h.percentile( 0.999 ) ) << ", max " << us( h.max() ) << std::endl;
+            }
+            if( _mCounters )
+            {
+                report_counters( os, n, depth );
+            }
+            report( os, merged, merged[ idx ].children[ c ], depth + 1, elapsed );
+        }
+    }
+
+    /**
+     * @brief Prints the counters of a span, with instructions per cycle and
+     * misses per thousand instructions when both sides were counted
+     */
+    void report_counters( std::ostream& os, const Node& n, unsigned depth )
+    {
+        os << "   " << std::string( depth * 2 + 2, ' ' );
+        bool any = false;
+        for( unsigned c=0; c<Perf_Counters::Num_Counters; c++ )
+        {
+            if( !_mCounterNames[ c ] ) continue;
+            os << ( any ? ", " : "" ) << _mCounterNames[ c ] << " " << n.counters[ c ];
+            any = true;
+        }
+        if( !any )
+        {
+            os << "no counters available" << std::endl;
+            return;
+        }
+
+        const uint64_t* v = n.counters;
+        bool cycles = _mCounterNames[ Perf_Counters::Cycles ] == Perf_Counters::config( Perf_Counters::Cycles ).name;
+        bool cache = _mCounterNames[ Perf_Counters::Cache_Misses ] == Perf_Counters::config( Perf_Counters::Cache_Misses ).name;
+        if( cycles && _mCounterNames[ Perf_Counters::Instructions ] && v[ Perf_Counters::Cycles ] )
+        {
+            os << ", IPC " << (double)v[ Perf_Counters::Instructions ] / v[ Perf_Counters::Cycles ];
+        }
+        if( v[ Perf_Counters::Instructions ] )
+        {
+            double kilo = v[ Perf_Counters::Instructions ] / 1000.0;
+            if( cache )
+            {
+                os << ", cache MPKI " << v[ Perf_Counters::Cache_Misses ] / kilo;
+            }
+            if( _mCounterNames[ Perf_Counters::Branch_Misses ] )
+            {
+                os << ", branch MPKI " << v[ Perf_Counters::Branch_Misses ] / kilo;
+            }
+        }
+        os << std::endl;
+    }
+
+    static double us( uint64_t ticks )
+    {
+        return Clock::seconds( ticks ) * 1e6;
+    }
+
+    static const std::vector<std::pair<const char*, double> >& percentiles()
+    {
+        static const std::vector<std::pair<const char*, double> > ps =
+        {
+            { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p99.9", 0.999 },
+        };
+        return ps;
+    }
+
+    /**
+     * @brief Merged spans in report order with their paths, names joined by
+     * slashes
+     */
+    void span_paths( const std::vector<Node>& merged, uint32_t idx, const std::string& prefix,
+                     std::vector<std::pair<std::string, uint32_t> >& paths )
+    {
+        for( size_t c=0; c<merged[ idx ].children.size(); c++ )
+        {
+            uint32_t child = merged[ idx ].children[ c ];
+            std::string path = prefix + ( prefix.empty() ? "" : "/" ) + name( merged[ child ].name );
+            paths.push_back( std::make_pair( path, child ) );
+            span_paths( merged, child, path, paths );
+        }
+    }
+
+    /**
+     * @brief Writes the latency of every span path as CSV, times in
+     * microseconds
+     */
+    void write_histograms_csv( std::ostream& os )
+    {
+        uint32_t threads;
+        std::vector<Node> merged = merge( threads );
+        std::vector<std::pair<std::string, uint32_t> > paths;
+        span_paths( merged, 0, "", paths );
+
+        os << "span,count,min_us,mean_us";
+        for( size_t p=0; p<percentiles().size(); p++ )
+        {
+            os << "," << percentiles()[ p ].first << "_us";
+        }
+        os << ",max_us" << std::endl;
+
+        for( size_t i=0; i<paths.size(); i++ )
+        {
+            const Latency_Histogram& h = merged[ paths[ i ].second ].latency;
+            write_csv_string( os, paths[ i ].first );
+            os << "," << h.count() << "," << us( h.min() ) << "," << h.mean() * Clock::ns_per_tick() / 1e3;
+            for( size_t p=0; p<percentiles().size(); p++ )
+            {
+                os << "," << us( h.percentile( percentiles()[ p ].second ) );
+            }
+            os << "," << us( h.max() ) << std::endl;
+        }
+    }
+
+    /**
+     * @brief Writes the latency of every span path as a JSON array, times in
+     * microseconds
+     */
+    void write_histograms_json( std::ostream& os )
+    {
+        uint32_t threads;
+        std::vector<Node> merged = merge( threads );
+        std::vector<std::pair<std::string, uint32_t> > paths;
+        span_paths( merged, 0, "", paths );
+
+        os << "[";
+        for( size_t i=0; i<paths.size(); i++ )
+        {
+            const Latency_Histogram& h = merged[ paths[ i ].second ].latency;
+            os << ( i ? ",\n" : "\n" ) << "{\"span\":";
+            write_json_string( os, paths[ i ].first );
+            os << ",\"count\":" << h.count() << ",\"min_us\":" << us( h.min() ) << ",\"mean_us\":" << h.mean() * Clock::ns_per_tick() / 1e3;
+            for( size_t p=0; p<percentiles().size(); p++ )
+            {
+                os << ",\"" << percentiles()[ p ].first << "_us\":" << us( h.percentile( percentiles()[ p ].second ) );
+            }
+            os << ",\"max_us\":" << us( h.max() ) << "}";
+        }
+        os << "\n]" << std::endl;
+    }
+
+    static void write_csv_string( std::ostream& os, const std::string& str )
+    {
+        os << '"';
+        for( size_t i=0; i<str.size(); i++ )
+        {
+            if( str[ i ] == '"' ) os << '"';
+            os << str[ i ];
+        }
+        os << '"';
+    }
+
+    static void write_json_string( std::ostream& os, const std::string& str )
+    {
+        os << '"';
+        for( size_t i=0; i<str.size(); i++ )
+        {
+            unsigned char c = str[ i ];
+            if( c == '"' || c == '\\' )
+            {
+                os << '\\' << c;
+            }
+            else if( c < 0x20 )
+            {
+                os << "\\u" << std::hex << std::setw( 4 ) << std::setfill( '0' ) << (unsigned)c << std::dec << std::setfill( ' ' );
+            }
+            else
+            {
+                os << c;
+            }
+        }
+        os << '"';
+    }
+
+    /**
+     * @brief Writes the recorded spans as Chrome trace-event JSON, one
+     * complete event per span with microsecond times from the task start
+     */
+    void write_chrome_trace( std::ostream& os )
+    {
+        std::lock_guard<std::mutex> lock( _mMutex );
+        std::ios::fmtflags flags = os.flags();
+        std::streamsize precision = os.precision();
+        os << std::fixed << std::setprecision( 3 );
+        os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+
+        bool first = true;
+        uint32_t pid = getpid();
+        for( size_t b=0; b<_mBuffers.size(); b++ )
+        {
+            const Thread_Buffer& buf = *_mBuffers[ b ];
+            if( buf.events.empty() ) continue;
+
+            os << ( first ? "\n" : ",\n" ) << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid << ",\"tid\":" << buf.tid
+               << ",\"args\":{\"name\":";
+            write_json_string( os, _mName + " thread " + std::to_string( b ) );
+            os << "}}";
+            first = false;
+
+            for( size_t i=0; i<buf.events.size(); i++ )
+            {
+                const Event& e = buf.events[ i ];
+                // Spans a thread began before the task are clamped to its start
+                double ts = e.start > _mStartTicks ? Clock::seconds( e.start - _mStartTicks ) * 1e6 : 0.0;
+                double dur = Clock::seconds( e.end - e.start ) * 1e6;
+                os << ",\n{\"ph\":\"X\",\"name\":";
+                write_json_string( os, name( e.name ) );
+                os << ",\"cat\":";
+                write_json_string( os, _mName );
+                os << ",\"pid\":" << pid << ",\"tid\":" << buf.tid << ",\"ts\":" << ts << ",\"dur\":" << dur << "}";
+            }
+        }
+        os << "\n]}" << std::endl;
+        os.flags( flags );
+        os.precision( precision );
+    }
+
+    /**
+     * @brief Index of the child of parent with the name, added if missing
+     */
+    static uint32_t child( std::vector<Node>& nodes, uint32_t parent, uint32_t name )
+    {
+        for( size_t c=0; c<nodes[ parent ].children.size(); c++ )
+        {
+            if( nodes[ nodes[ parent ].children[ c ] ].name == name ) return nodes[ parent ].children[ c ];
+        }
+        Node n;
+        n.name = name;
+        n.parent = parent;
+        n.count = 0;
+        n.total = 0;
+        memset( n.counters, 0, sizeof( n.counters ) );
+        nodes.push_back( n );
+        nodes[ parent ].children.push_back( nodes.size() - 1 );
+        return nodes.size() - 1;
+    }
 };
+
+#define TRACER_CONCAT_( a, b ) a##b
+#define TRACER_CONCAT( a, b ) TRACER_CONCAT_( a, b )
+
+#ifndef TRACER_DISABLED
+/**
+ * @brief Times the rest of the enclosing scope as a span of the current
+ * tracer. The name is interned once per trace point.
+ */
+#define TRACE_SPAN( name ) \
+    static const uint32_t TRACER_CONCAT( _trace_name_, __LINE__ ) = Tracer::intern( std::string( name ) ); \
+    Tracer::Span TRACER_CONCAT( _trace_span_, __LINE__ )( TRACER_CONCAT( _trace_name_, __LINE__ ) )
+#else
+#define TRACE_SPAN( name ) do {} while( 0 )
+#endif